@@ -0,0 +1,235 @@
+//
+// Offline batch processing of recorded footage
+//
+// Usage: face_batch <model dir> <video file | image dir> [-o results.jsonl|results.bin] [-j workers]
+//                   [-q frames in flight] [-n no landmarks]
+//        face_batch --selftest
+//
+// Results are written in frame order, as JSONL (default, stdout if -o isn't given) or in the binary
+// format if the output file ends with .bin, see FaceResultWriter. Progress is reported to stderr,
+// and the summary is the last line of stderr, e.g.
+//   {"input":"a.mp4","frames":108000,"faces":96420,"failed":0,"seconds":602.3,"fps":179.3,"sustained_fps":180.1,"workers":16}
+// NOTES:
+// Frames are the unit of parallelism (see FaceBatchEngine), so OpenCV's own threads are disabled:
+// nested parallel loops inside each worker would only contend for the same cores.
+// --selftest checks the scheduling of the engine without models, see selfTest().
+//
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include "face_engine.h"
+
+using namespace std;
+using namespace cv;
+
+static bool endsWith(const string& s, const string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// NOTES:
+// Self test of the engine scheduling, without models. The engine runs on an image directory of numbered frames
+// (the frame index is encoded in the pixels, every 7th file isn't an image) with fake stages, which sleep a
+// random time so frames finish out of order, and tag their results with the frame index. It checks:
+//  - order: frames are emitted in order, each with its own source & results
+//  - bounded memory: no frame is detected maxInFlight frames or more ahead of the emission
+//  - decode failures: files which aren't images are emitted as failed, without faces
+//  - completion: every frame is emitted once before run() returns
+// for several worker & in-flight configurations. Build with -DCMAKE_CXX_FLAGS=-fsanitize=thread to run it under
+// ThreadSanitizer. The video read chain (one frame per read task) isn't covered, it needs an encoded video.
+static const int SELFTEST_FRAMES = 240;
+
+static bool failedFrame(int64 frame) {
+    return frame % 7 == 3;
+}
+
+// Frame index of a test frame, encoded as blue = index & 255, green = index >> 8 (RGBA once decoded)
+static int frameOf(const Mat& rgba) {
+    const Vec4b& pixel = rgba.at<Vec4b>(0, 0);
+    return pixel[1]*256 + pixel[2];
+}
+
+static void jitter() {
+    this_thread::sleep_for(chrono::microseconds(theRNG().uniform(0, 400)));
+}
+
+static bool selfTest(const vector<string>& files, int workers, int maxInFlight, bool landmarks) {
+    atomic<int64> emitted(0);
+    atomic<int> ahead(0);
+    FaceBatchEngine::Stages stages;
+    stages.detect = [&](const Mat& rgba, FaceResults& results) {
+        const int frame = frameOf(rgba);
+        if (frame - emitted.load() >= maxInFlight) {
+            ++ahead;
+        }
+        jitter();
+        for (int k = 0; k < frame % 3; ++k) {
+            results.boxes.push_back(Rect(frame, k, 8, 8));
+            results.scores.push_back(1.0f);
+        }
+    };
+    stages.fit = [](const Mat& rgba, FaceResults& results) {
+        jitter();
+        results.landmarks.assign(results.boxes.size(), vector<Point2f>(5, Point2f(float(frameOf(rgba)), 0)));
+        return true;
+    };
+    FaceBatchEngine::Params params;
+    params.workers = workers;
+    params.maxInFlight = maxInFlight;
+    params.landmarks = landmarks;
+    FaceBatchEngine engine;
+    engine.load(stages, params);
+
+    // The callback is never called concurrently, only emitted is read by the workers
+    int errors = 0;
+    auto error = [&](int64 frame, const char* what) {
+        if (++errors <= 10) {
+            fprintf(stderr, "selftest workers=%d in_flight=%d: frame %lld: %s\n", workers, maxInFlight, (long long)frame, what);
+        }
+    };
+    const string dir = files[0].substr(0, files[0].find_last_of('/'));
+    const bool ran = engine.run(dir, [&](int64 frame, const string& source, double timestampMs, const FaceResults& results) {
+        if (frame != emitted.load()) {
+            error(frame, "out of order");
+        } else if (frame >= int64(files.size()) || source != files[size_t(frame)]) {
+            error(frame, "wrong source");
+        } else if (failedFrame(frame) ? results.size() != 0 : results.size() != size_t(frame % 3)) {
+            error(frame, "wrong face count");
+        } else {
+            for (size_t i = 0; i < results.size(); ++i) {
+                const bool fitted = i < results.landmarks.size() && results.landmarks[i][0].x == float(frame);
+                if (results.boxes[i].x != frame || fitted != landmarks) {
+                    error(frame, "results of another frame");
+                    break;
+                }
+            }
+        }
+        ++emitted;
+    });
+    int64 failed = 0;
+    for (int64 i = 0; i < int64(files.size()); ++i) {
+        failed += failedFrame(i) ? 1 : 0;
+    }
+    const FaceBatchEngine::Stats& stats = engine.stats();
+    if (!ran || emitted.load() != int64(files.size()) || stats.frames != int64(files.size())) {
+        error(emitted.load(), "not all frames emitted");
+    }
+    if (stats.failed != failed) {
+        error(stats.failed, "wrong failed frame count");
+    }
+    if (ahead.load() > 0) {
+        error(ahead.load(), "frames detected too far ahead of the emission");
+    }
+    printf("{\"selftest\":\"engine\",\"workers\":%d,\"max_in_flight\":%d,\"landmarks\":%s,\"frames\":%lld,"
+           "\"failed\":%lld,\"errors\":%d}\n", workers, maxInFlight, landmarks ? "true" : "false",
+           (long long)stats.frames, (long long)stats.failed, errors);
+    return errors == 0;
+}
+
+static bool selfTest() {
+    char dir[] = "/tmp/face_batch_XXXXXX";
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "failed to create a temporary directory\n");
+        return false;
+    }
+    vector<string> files;
+    for (int i = 0; i < SELFTEST_FRAMES; ++i) {
+        files.push_back(format("%s/%05d.png", dir, i));
+        if (failedFrame(i)) {
+            FILE* fp = fopen(files.back().c_str(), "w");
+            if (fp) {
+                fputs("not an image", fp);
+                fclose(fp);
+            }
+        } else {
+            imwrite(files.back(), Mat(16, 16, CV_8UC3, Scalar(i & 255, i >> 8, 0)));
+        }
+    }
+
+    setNumThreads(1);
+    const int cpus = max(1, getNumberOfCPUs());
+    const struct { int workers, maxInFlight; bool landmarks; } configs[] = {
+        { 1, 1, true }, { 2, 2, false }, { 4, 3, true }, { 8, 16, true }, { cpus, cpus*2, true }
+    };
+    bool passed = true;
+    for (const auto& config: configs) {
+        passed = selfTest(files, config.workers, config.maxInFlight, config.landmarks) && passed;
+    }
+    for (const string& file: files) {
+        unlink(file.c_str());
+    }
+    rmdir(dir);
+    return passed;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && !strcmp(argv[1], "--selftest")) {
+        return selfTest() ? 0 : 1;
+    }
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <model dir> <video file | image dir> [-o results.jsonl|results.bin] [-j workers]\n"
+                        "       [-q frames in flight] [-n]\n"
+                        "       %s --selftest\n", argv[0], argv[0]);
+        return 1;
+    }
+    string modelDir = argv[1];
+    string input = argv[2];
+    string output = "-";
+    FaceBatchEngine::Params params;
+    for (int i = 3; i < argc; ++i) {
+        if (!strcmp(argv[i], "-n")) {
+            params.landmarks = false;
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            params.workers = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-q") && i + 1 < argc) {
+            params.maxInFlight = atoi(argv[++i]);
+        }
+    }
+
+    setNumThreads(1);
+    FaceBatchEngine engine;
+    if (!engine.load(modelDir, params)) {
+        fprintf(stderr, "failed to load models from %s\n", modelDir.c_str());
+        return 1;
+    }
+    FaceResultWriter writer;
+    if (!writer.open(output, endsWith(output, ".bin") ? FaceResultWriter::BINARY : FaceResultWriter::JSONL)) {
+        fprintf(stderr, "failed to open %s\n", output.c_str());
+        return 1;
+    }
+
+    const int64 start = getTickCount();
+    int64 lastReport = start;
+    bool ok = engine.run(input, [&](int64 frame, const string& source, double timestampMs, const FaceResults& results) {
+        writer.write(frame, source, timestampMs, results);
+        // Progress every 5s
+        const int64 now = getTickCount();
+        if (now - lastReport > 5*getTickFrequency()) {
+            lastReport = now;
+            fprintf(stderr, "frames=%lld, fps=%.1f\n", (long long)(frame + 1),
+                    (frame + 1)*getTickFrequency()/double(now - start));
+        }
+    });
+    writer.close();
+    if (!ok) {
+        fprintf(stderr, "failed to process %s\n", input.c_str());
+        return 1;
+    }
+
+    const FaceBatchEngine::Stats& stats = engine.stats();
+    fprintf(stderr, "{\"input\":\"%s\",\"frames\":%lld,\"faces\":%lld,\"failed\":%lld,\"seconds\":%.1f,"
+                    "\"fps\":%.1f,\"sustained_fps\":%.1f,\"workers\":%d}\n",
+            input.c_str(), (long long)stats.frames, (long long)stats.faces, (long long)stats.failed,
+            stats.seconds, stats.fps, stats.sustainedFps, params.workers > 0 ? params.workers : getNumberOfCPUs());
+    return 0;
+}
@@ -0,0 +1,749 @@
+//
+// Host benchmark of the native face pipeline
+//
+// Usage: face_bench <model dir> [image dir] [-n iterations] [-o result.jsonl] [-p] [-l] [-c] [-t trace.json] [-m]
+//
+// Every stage is measured on synthetic frames (640x480, 1280x720, 1920x1080), and on the images
+// of image dir if given. Each result is written as a JSON line, e.g.
+//   {"stage":"detect","input":"1280x720","iterations":100,"p50_ms":12.1,"p95_ms":13.0,"p99_ms":13.9,
+//    "fps":81.7,"peak_rss_kb":182344,"allocs_per_iter":0.00}
+// NOTES:
+// peak_rss_kb is the peak RSS while running the stage (reset by /proc/self/clear_refs before each stage).
+// allocs_per_iter counts C++ heap allocations (operator new) & cv::Mat buffer allocations of each iteration,
+// it should be 0 for the stages running on reused buffers.
+// The analyze stages also report the faces of the last iteration: synthetic frames have none, so the landmark
+// path of analyze() (per-face buffers) is only measured on the images of image dir, which should contain faces.
+// With -p, only the accuracy vs speed report of the inference precisions (FP32/FP16/INT8) is run on the images
+// of image dir, see reportPrecision().
+// With -l, only the equivalence & speed report of the landmark models (FacemarkLBF/LBFModel FP32/FP16) is run,
+// see reportLandmarks(), it exits with 1 if a model is out of its tolerance.
+// With -c, only the check of the fused frame transforms against the OpenCV passes they replace is run, see
+// checkTransforms(), it exits with 1 if a transform is out of its tolerance.
+// With -t, the stages of all iterations are recorded (see FaceTrace) and dumped to the trace file at the end.
+// With -m, the stage metrics (see FaceMetrics) accumulated by all stages are written at the end, one line per
+// histogram with its p50/p99 bucket bounds, then one line of counters.
+//
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utils/allocator_stats.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/opencv_modules.hpp>
+#ifdef HAVE_OPENCV_FACE
+#include <opencv2/face.hpp>
+#endif
+
+#include "face_detector.h"
+#include "face_lbf.h"
+#include "face_metrics.h"
+#include "face_trace.h"
+#include "face_pool.h"
+#include "face_preprocess.h"
+#include "native_buffer.h"
+
+using namespace std;
+using namespace cv;
+
+// C++ heap allocations, counted by the replaced global operator new
+static atomic<long> gAllocations(0);
+
+void* operator new(size_t size) {
+    gAllocations.fetch_add(1, memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+static long allocations() {
+    return gAllocations.load() + long(getAllocatorStatistics().getNumberOfAllocations());
+}
+
+static void resetPeakRSS() {
+    // Writing 5 to clear_refs resets the peak RSS (VmHWM) of the process, see proc(5)
+    FILE* fp = fopen("/proc/self/clear_refs", "w");
+    if (fp) {
+        fputs("5", fp);
+        fclose(fp);
+    }
+}
+
+static long peakRSS() {
+    long kb = 0;
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (fp) {
+        char line[128];
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    if (kb == 0) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        kb = usage.ru_maxrss;
+    }
+    return kb;
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const vector<double>& sorted, double p) {
+    size_t rank = size_t(ceil(p*sorted.size()));
+    return sorted[min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+// faces (if not null) is read after the iterations and reported, e.g. set by func to the faces it found
+template<typename Func>
+static void bench(FILE* out, const char* stage, const string& input, int iterations, Func func,
+                  const int* faces = nullptr) {
+    // Warm-up, so buffers are allocated & caches are filled
+    func();
+
+    resetPeakRSS();
+    vector<double> samples;
+    samples.reserve(iterations);
+    long allocs = allocations();
+    int64 start = getTickCount();
+    for (int i = 0; i < iterations; ++i) {
+        int64 t = getTickCount();
+        func();
+        samples.push_back(1000.0*(getTickCount() - t)/getTickFrequency());
+    }
+    double seconds = (getTickCount() - start)/getTickFrequency();
+    allocs = allocations() - allocs;
+    sort(samples.begin(), samples.end());
+
+    fprintf(out, "{\"stage\":\"%s\",\"input\":\"%s\",\"iterations\":%d,"
+                 "\"p50_ms\":%.3f,\"p95_ms\":%.3f,\"p99_ms\":%.3f,\"fps\":%.2f,\"peak_rss_kb\":%ld,\"allocs_per_iter\":%.2f",
+            stage, input.c_str(), iterations,
+            percentile(samples, 0.50), percentile(samples, 0.95), percentile(samples, 0.99),
+            iterations/seconds, peakRSS(), double(allocs)/iterations);
+    if (faces) {
+        fprintf(out, ",\"faces\":%d", *faces);
+    }
+    fprintf(out, "}\n");
+    fflush(out);
+}
+
+// Run all stages with the given RGBA image
+static void benchImage(FILE* out, FaceDetector& detector, const Mat& rgba, const string& input, int iterations) {
+    const int width = rgba.cols;
+    const int height = rgba.rows;
+
+    // NativeBuffer kernels
+    Mat nv21(height + height/2, width, CV_8UC1);
+    randu(nv21, Scalar::all(0), Scalar::all(255));
+    Mat converted;
+    bench(out, "nv21_to_rgba", input, iterations, [&] { nv21ToRGBA(nv21, converted); });
+
+    Mat rotated;
+    bench(out, "rotate_90", input, iterations, [&] { rotateImage(rgba, rotated, 90); });
+
+    Mat flipped;
+    bench(out, "flip_horizontal", input, iterations, [&] { flipImage(rgba, flipped, 1); });
+
+    // Separate passes of the capture path vs. the fused transform
+    bench(out, "nv21_rotate_flip", input, iterations, [&] {
+        nv21ToRGBA(nv21, converted);
+        rotateImage(converted, rotated, 90);
+        flipImage(rotated, rotated, 1);
+    });
+    Mat transformed;
+    YUVPlanes planes = nv21Planes(nv21.data, width, height);
+    bench(out, "transform_nv21", input, iterations, [&] { transformYUV(planes, transformed, 90, 1); });
+    bench(out, "transform_nv21_half", input, iterations, [&] { transformYUV(planes, transformed, 90, 1, 2); });
+    // Separate passes of a downscaled frame vs. the fused transform (block mean, see checkTransforms())
+    bench(out, "rgba_rotate_flip_area_half", input, iterations, [&] {
+        rotateImage(rgba, rotated, 90);
+        flipImage(rotated, flipped, 1);
+        resize(flipped, converted, Size(flipped.cols/2, flipped.rows/2), 0, 0, INTER_AREA);
+    });
+    bench(out, "transform_rgba_half", input, iterations, [&] { transformRGBA(rgba, transformed, 90, 1, 2); });
+    bench(out, "transform_rgba", input, iterations, [&] { transformRGBA(rgba, transformed, 90, 1); });
+
+    Mat bgr;
+    vector<uchar> jpeg;
+    cvtColor(rgba, bgr, COLOR_RGBA2BGR);
+    imencode(".jpg", bgr, jpeg);
+    Mat encoded(1, int(jpeg.size()), CV_8UC1, jpeg.data());
+    Mat decoded, buffer;
+    bench(out, "decode_jpeg", input, iterations, [&] { decodeImage(encoded, decoded, buffer); });
+    // Decoded at the DCT scale covering the detector input, straight into the destination
+    Mat reduced(jpegScaledSize(rgba.size(), jpegScale(rgba.size(), Size(300, 300))), CV_8UC4);
+    bench(out, "decode_jpeg_reduced", input, iterations, [&] { decodeImageScaled(encoded, reduced, buffer); });
+
+    // Detector
+    int dims[] = { 1, 3, 300, 300 };
+    Mat blob(4, dims, CV_32F);
+    bench(out, "blob_rgba", input, iterations, [&] {
+        blobFromRGBA(rgba, Size(300, 300), Scalar(104.0, 177.0, 123.0), blob.ptr<float>());
+    });
+    YUVPlanes yuv = nv21Planes(nv21.data, width, height);
+    bench(out, "blob_nv21", input, iterations, [&] {
+        blobFromYUV(yuv, Size(300, 300), Scalar(104.0, 177.0, 123.0), blob.ptr<float>());
+    });
+
+    vector<Rect> faces;
+    bench(out, "detect", input, iterations, [&] { faces.clear(); detector.detect(rgba, faces); });
+    bench(out, "detect_nv21", input, iterations, [&] { faces.clear(); detector.detect(yuv, faces); });
+    vector<float> confidences;
+    FaceDetector::MultiScaleParams params;
+    bench(out, "detect_multiscale", input, iterations, [&] {
+        faces.clear();
+        confidences.clear();
+        detector.detectMultiScale(rgba, faces, confidences, params);
+    });
+    bench(out, "process", input, iterations, [&] { detector.process(rgba); });
+    // Display path: frame scaled into a portrait 1080x1920 window with the overlay of the last process()
+    Mat display(1920, 1080, CV_8UC4);
+    bench(out, "compose", input, iterations, [&] { detector.overlay().compose(rgba, display); });
+    // Detection & landmarks of every frame, then in detect-then-track mode (tracked faces are warm started)
+    int analyzed = 0;
+    auto analyze = [&] { analyzed = int(detector.analyze(rgba, true).size()); };
+    bench(out, "analyze", input, iterations, analyze, &analyzed);
+    detector.setTracking(true);
+    bench(out, "analyze_tracked", input, iterations, analyze, &analyzed);
+    detector.setTracking(false);
+    // Amortized per-frame time within the default latency budget (see FaceGovernor)
+    detector.setGovernor(true);
+    bench(out, "analyze_governed", input, iterations, analyze, &analyzed);
+    detector.setGovernor(false);
+    // Static scene in detect-then-track mode, landmarks of unchanged faces come from the cache
+    detector.setTracking(true);
+    detector.setLandmarkCache(true);
+    bench(out, "analyze_cached", input, iterations, analyze, &analyzed);
+    detector.setLandmarkCache(false);
+    detector.setTracking(false);
+
+    // Landmark fitting of the 1st detected face, or a centered box if no face is detected
+    faces.clear();
+    detector.detect(rgba, faces);
+    int side = min(width, height)/2;
+    Rect face = faces.empty() ? Rect((width - side)/2, (height - side)/2, side, side) : faces[0];
+    vector<Point2f> landmarks;
+    bench(out, "landmark", input, iterations, [&] { detector.fit(rgba, face, landmarks); });
+    // Warm start from the last result, as a tracked face of a video stream
+    vector<Rect> fitFaces(1, face);
+    vector<vector<Point2f>> fitMarks(1, landmarks), initials(1, landmarks);
+    bench(out, "landmark_warm", input, iterations, [&] { detector.fit(rgba, fitFaces, fitMarks, &initials); });
+    // Camera frame: converted to RGBA first, vs fitted on its Y plane in place
+    bench(out, "landmark_nv21_rgba", input, iterations, [&] {
+        nv21ToRGBA(nv21, converted);
+        detector.fit(converted, fitFaces, fitMarks);
+    });
+    bench(out, "landmark_y", input, iterations, [&] { detector.fit(yuv, fitFaces, fitMarks); });
+    // Aligned chips of 8 faces in one tensor, as for a recognition batch
+    vector<vector<Point2f>> chipMarks(8, landmarks);
+    Mat chips;
+    bench(out, "chips_8faces", input, iterations, [&] { detector.chips().extract(rgba, chipMarks, chips); });
+}
+
+static long currentRSS() {
+    long kb = 0;
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (fp) {
+        char line[128];
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    return kb;
+}
+
+// Detections of a precision mode against the FP32 detections of the same image: boxes are matched greedily
+// by IoU >= 0.5, returns the number of matches & sums their IoU & score differences
+static int matchDetections(const vector<Rect>& expected, const vector<float>& expectedScores,
+                           const vector<Rect>& actual, const vector<float>& actualScores,
+                           double& iouSum, double& scoreDiffSum) {
+    vector<bool> used(actual.size(), false);
+    int matched = 0;
+    for (size_t i = 0; i < expected.size(); ++i) {
+        int best = -1;
+        double bestIoU = 0.5;
+        for (size_t j = 0; j < actual.size(); ++j) {
+            double iou = double((expected[i] & actual[j]).area())/(expected[i] | actual[j]).area();
+            if (!used[j] && iou >= bestIoU) {
+                best = int(j);
+                bestIoU = iou;
+            }
+        }
+        if (best >= 0) {
+            used[best] = true;
+            ++matched;
+            iouSum += bestIoU;
+            scoreDiffSum += fabs(expectedScores[i] - actualScores[best]);
+        }
+    }
+    return matched;
+}
+
+// NOTES:
+// Accuracy vs speed report of the inference precisions (see FaceDetector::setPrecision()), one JSON line per precision.
+// Up to 16 images calibrate INT8, the others (or all if there are too few) are evaluated, the FP32 detections
+// of each image are the reference:
+//   recall/precision: matched detections over FP32/own detections, mean_iou & mean_score_diff: of the matched ones
+//   speedup: FP32 p50 over own p50, rss_kb: memory growth by creating the detector (network & landmark model)
+static void reportPrecision(FILE* out, const string& modelDir, const vector<Mat>& images, int iterations) {
+    const size_t calibrationCount = images.size() >= 4 ? min(size_t(16), images.size()/2) : images.size();
+    vector<Mat> calibration(images.begin(), images.begin() + calibrationCount);
+    vector<Mat> evaluation(images.begin() + (calibrationCount < images.size() ? calibrationCount : 0), images.end());
+
+    const char* names[] = { "fp32", "fp16", "int8" };
+    vector<vector<Rect>> reference;
+    vector<vector<float>> referenceScores;
+    double referenceP50 = 0;
+    for (int precision = FaceDetector::PRECISION_FP32; precision <= FaceDetector::PRECISION_INT8; ++precision) {
+        long rss = currentRSS();
+        // All modes start from the original FP32 weights, so the FP16 caffemodel doesn't round the reference
+        FaceDetector detector;
+        if (!detector.load(modelDir, false) ||
+            !detector.setPrecision(FaceDetector::Precision(precision), calibration)) {
+            fprintf(out, "{\"report\":\"precision\",\"mode\":\"%s\",\"supported\":false}\n", names[precision]);
+            if (precision == FaceDetector::PRECISION_FP32) {
+                // No reference
+                return;
+            }
+            continue;
+        }
+        detector.warmUp();
+        rss = currentRSS() - rss;
+
+        vector<vector<Rect>> faces(evaluation.size());
+        vector<vector<float>> scores(evaluation.size());
+        vector<double> samples;
+        for (int k = 0; k < iterations; ++k) {
+            for (size_t i = 0; i < evaluation.size(); ++i) {
+                faces[i].clear();
+                scores[i].clear();
+                int64 t = getTickCount();
+                detector.detect(evaluation[i], faces[i], scores[i]);
+                samples.push_back(1000.0*(getTickCount() - t)/getTickFrequency());
+            }
+        }
+        sort(samples.begin(), samples.end());
+        double p50 = percentile(samples, 0.50);
+        if (precision == FaceDetector::PRECISION_FP32) {
+            reference = faces;
+            referenceScores = scores;
+            referenceP50 = p50;
+        }
+
+        int expected = 0, detected = 0, matched = 0;
+        double iouSum = 0, scoreDiffSum = 0;
+        for (size_t i = 0; i < evaluation.size(); ++i) {
+            expected += int(reference[i].size());
+            detected += int(faces[i].size());
+            matched += matchDetections(reference[i], referenceScores[i], faces[i], scores[i], iouSum, scoreDiffSum);
+        }
+        fprintf(out, "{\"report\":\"precision\",\"mode\":\"%s\",\"supported\":true,\"calibration\":%d,\"images\":%d,"
+                     "\"p50_ms\":%.3f,\"p95_ms\":%.3f,\"speedup\":%.2f,\"recall\":%.4f,\"precision\":%.4f,"
+                     "\"mean_iou\":%.4f,\"mean_score_diff\":%.4f,\"rss_kb\":%ld}\n",
+                names[precision], precision == FaceDetector::PRECISION_INT8 ? int(calibration.size()) : 0, int(evaluation.size()),
+                p50, percentile(samples, 0.95), referenceP50/p50,
+                expected ? double(matched)/expected : 1.0, detected ? double(matched)/detected : 1.0,
+                matched ? iouSum/matched : 1.0, matched ? scoreDiffSum/matched : 0.0, rss);
+        fflush(out);
+    }
+}
+
+// NOTES:
+// Equivalence & speed report of the landmark models, one JSON line per model:
+//   facemark_lbf: cv::face::FacemarkLBF (if OpenCV is built with the face module of opencv_contrib),
+//   lbf_fp32/lbf_fp16: LBFModel of lbfmodel.yaml, with FP32/FP16 regression weights.
+// Faces are the detected faces of each image (a centered box if none), plus 3 synthetic noise frames, all
+// fitted from the mean shape with all stages. The first model is the reference of the others:
+//   mean_error/max_error: distance (pixels) of the landmarks to the reference ones, mismatched: faces with
+//   a landmark more than 1 pixel away, p50_ms: per face, speedup: reference p50 over own p50
+// NOTES:
+// Landmarks of LBFModel must match FacemarkLBF up to float rounding (FP32 weights), or move by less than
+// half a pixel (FP16 weights), the report fails otherwise: face_bench -l exits with 1.
+static const double LBF_FP32_TOLERANCE = 0.05;
+static const double LBF_FP16_TOLERANCE = 0.5;
+
+static bool reportLandmarks(FILE* out, const string& modelDir, const vector<Mat>& images, int iterations) {
+    const string modelFile = modelDir + "/lbfmodel.yaml";
+    LBFModel fp32;
+    if (!fp32.load(modelFile)) {
+        fprintf(stderr, "failed to load %s\n", modelFile.c_str());
+        return false;
+    }
+    LBFModel fp16 = fp32;
+    fp16.setHalfWeights();
+
+    // Gray frames & their faces
+    vector<Mat> grays;
+    vector<Rect> faces;
+    FaceDetector detector;
+    const bool detect = detector.load(modelDir);
+    const Size sizes[] = { Size(640, 480), Size(1280, 720), Size(1920, 1080) };
+    for (const Size& size: sizes) {
+        grays.push_back(Mat(size, CV_8UC1));
+        randu(grays.back(), Scalar::all(0), Scalar::all(255));
+        const int side = min(size.width, size.height)/2;
+        faces.push_back(Rect((size.width - side)/2, (size.height - side)/2, side, side));
+    }
+    for (const Mat& rgba: images) {
+        vector<Rect> detected;
+        if (detect) {
+            detector.detect(rgba, detected);
+        }
+        if (detected.empty()) {
+            const int side = min(rgba.cols, rgba.rows)/2;
+            detected.push_back(Rect((rgba.cols - side)/2, (rgba.rows - side)/2, side, side));
+        }
+        Mat gray;
+        cvtColor(rgba, gray, COLOR_RGBA2GRAY);
+        for (const Rect& face: detected) {
+            grays.push_back(gray);
+            faces.push_back(face);
+        }
+    }
+
+    // Fit function of each model: gray frame & face -> landmarks, and its max error against the reference
+    typedef function<void(const Mat&, const Rect&, vector<Point2f>&)> Fit;
+    struct Model {
+        string name;
+        double tolerance;
+        Fit fit;
+    };
+    vector<Model> models;
+#ifdef HAVE_OPENCV_FACE
+    face::FacemarkLBF::Params params;
+    params.verbose = false;
+    Ptr<face::FacemarkLBF> facemark = face::FacemarkLBF::create(params);
+    facemark->loadModel(modelFile);
+    models.push_back({ "facemark_lbf", 0.0, Fit([&](const Mat& gray, const Rect& face, vector<Point2f>& landmarks) {
+        vector<Rect> rects(1, face);
+        vector<vector<Point2f>> shapes;
+        facemark->fit(gray, rects, shapes);
+        landmarks = shapes.empty() ? vector<Point2f>() : shapes[0];
+    }) });
+#endif
+    models.push_back({ "lbf_fp32", LBF_FP32_TOLERANCE, Fit([&](const Mat& gray, const Rect& face, vector<Point2f>& landmarks) {
+        fp32.fit(gray, face, landmarks, nullptr, 0, fp32.stages());
+    }) });
+    models.push_back({ "lbf_fp16", LBF_FP16_TOLERANCE, Fit([&](const Mat& gray, const Rect& face, vector<Point2f>& landmarks) {
+        fp16.fit(gray, face, landmarks, nullptr, 0, fp16.stages());
+    }) });
+
+    vector<vector<Point2f>> reference(faces.size());
+    double referenceP50 = 0;
+    bool passed = true;
+    for (size_t m = 0; m < models.size(); ++m) {
+        const Fit& fit = models[m].fit;
+        vector<vector<Point2f>> landmarks(faces.size());
+        vector<double> samples;
+        for (int k = 0; k < iterations; ++k) {
+            for (size_t i = 0; i < faces.size(); ++i) {
+                int64 t = getTickCount();
+                fit(grays[i], faces[i], landmarks[i]);
+                samples.push_back(1000.0*(getTickCount() - t)/getTickFrequency());
+            }
+        }
+        sort(samples.begin(), samples.end());
+        const double p50 = percentile(samples, 0.50);
+        if (m == 0) {
+            reference = landmarks;
+            referenceP50 = p50;
+        }
+
+        double errorSum = 0, maxError = 0;
+        int points = 0, mismatched = 0;
+        for (size_t i = 0; i < faces.size(); ++i) {
+            double faceError = landmarks[i].size() == reference[i].size() ? 0 : HUGE_VAL;
+            for (size_t j = 0; j < landmarks[i].size() && j < reference[i].size(); ++j) {
+                const double error = norm(landmarks[i][j] - reference[i][j]);
+                errorSum += error;
+                faceError = max(faceError, error);
+                ++points;
+            }
+            maxError = max(maxError, faceError);
+            mismatched += faceError > 1.0 ? 1 : 0;
+        }
+        fprintf(out, "{\"report\":\"landmarks\",\"model\":\"%s\",\"reference\":\"%s\",\"faces\":%d,"
+                     "\"p50_ms\":%.3f,\"p95_ms\":%.3f,\"speedup\":%.2f,\"mean_error\":%.4f,\"max_error\":%.4f,"
+                     "\"mismatched\":%d}\n",
+                models[m].name.c_str(), models[0].name.c_str(), int(faces.size()), p50, percentile(samples, 0.95),
+                referenceP50/p50, points ? errorSum/points : 0.0, maxError, mismatched);
+        fflush(out);
+        if (m > 0 && !(maxError <= models[m].tolerance)) {
+            fprintf(stderr, "%s: max error %.4f pixels against %s exceeds %.2f pixels\n", models[m].name.c_str(),
+                    maxError, models[0].name.c_str(), models[m].tolerance);
+            passed = false;
+        }
+    }
+    return passed;
+}
+
+// Upper bound of the bucket holding the percentile p of a FaceMetrics histogram
+static int64 bucketPercentile(const int64* buckets, int64 count, double p) {
+    int64 seen = 0;
+    for (int k = 0; k < FaceMetrics::BUCKETS; ++k) {
+        seen += buckets[k];
+        if (seen > 0 && seen >= p*count) {
+            return int64(1) << k;
+        }
+    }
+    return int64(1) << (FaceMetrics::BUCKETS - 1);
+}
+
+static void reportMetrics(FILE* out) {
+    vector<int64> packed;
+    FaceMetrics::snapshot(packed, false);
+    const int64* p = packed.data() + FaceMetrics::HEADER_WORDS;
+    for (int h = 0; h < FaceMetrics::HISTOGRAMS; ++h, p += FaceMetrics::HISTOGRAM_WORDS) {
+        const int64 count = p[0];
+        if (count == 0) {
+            continue;
+        }
+        fprintf(out, "{\"metric\":\"%s\",\"count\":%lld,\"mean\":%.1f,\"max\":%lld,\"p50_le\":%lld,\"p99_le\":%lld}\n",
+                FaceMetrics::name(FaceMetrics::Histogram(h)), (long long)count, double(p[1])/count, (long long)p[2],
+                (long long)bucketPercentile(p + 3, count, 0.5), (long long)bucketPercentile(p + 3, count, 0.99));
+    }
+    fprintf(out, "{\"metric\":\"counters\"");
+    for (int c = 0; c < FaceMetrics::COUNTERS; ++c) {
+        fprintf(out, ",\"%s\":%lld", FaceMetrics::name(FaceMetrics::Counter(c)), (long long)p[c]);
+    }
+    fprintf(out, "}\n");
+    fflush(out);
+}
+
+// Frames of multiple streams served by a detector pool, each iteration is one frame of every stream
+static void benchStreams(FILE* out, DetectorPool& pool, const Mat& rgba, const string& input, int iterations) {
+    FaceScheduler scheduler(&pool);
+    const int streams = 4;
+    for (int i = 0; i < streams; ++i) {
+        scheduler.addStream(nullptr, true);
+    }
+    scheduler.start();
+    bench(out, "scheduler_4streams", input, iterations, [&] {
+        for (int i = 0; i < streams; ++i) {
+            scheduler.submit(i, rgba);
+        }
+        scheduler.flush();
+    });
+    scheduler.stop();
+}
+
+// NOTES:
+// The fused transforms (transformRGBA/transformYUV) must give the result of the separate passes: cvtColor (YUV),
+// rotate, flip, then resize(..., INTER_AREA) of the frame cropped to a multiple of scale. Checked for every
+// rotate/flip/scale on a frame whose size isn't a multiple of the scales. RGBA matches up to the rounding of
+// the block mean (exact without downscale), YUV up to 2 levels (converted before vs. after averaging, so
+// clamping & rounding differ). The YUV frame is converted from a smooth RGB frame, like a camera frame:
+// random chroma would be clamped everywhere.
+static const double TRANSFORM_RGBA_TOLERANCE = 1;
+static const double TRANSFORM_YUV_TOLERANCE = 2;
+
+static void referenceTransform(const Mat& rgba, Mat& dst, int rotateCode, int flipCode, int scale) {
+    Mat rotated, flipped;
+    rotateImage(rgba, rotated, rotateCode);
+    flipImage(rotated, flipped, flipCode);
+    const Size size(flipped.cols/scale, flipped.rows/scale);
+    resize(flipped(Rect(0, 0, size.width*scale, size.height*scale)), dst, size, 0, 0, INTER_AREA);
+}
+
+static bool checkTransforms(FILE* out) {
+    const Size size(642, 482);
+    Mat rgba(size, CV_8UC4);
+    randu(rgba, Scalar::all(0), Scalar::all(255));
+
+    // NV21 of a smooth frame, from YV12 (Y, V & U planes) by interleaving V & U
+    Mat noise(size, CV_8UC3), smooth, yv12;
+    randu(noise, Scalar::all(0), Scalar::all(255));
+    GaussianBlur(noise, smooth, Size(7, 7), 2);
+    cvtColor(smooth, yv12, COLOR_RGB2YUV_YV12);
+    Mat nv21(yv12.size(), CV_8UC1);
+    const int lumaSize = size.area();
+    memcpy(nv21.data, yv12.data, lumaSize);
+    const uchar* v = yv12.data + lumaSize;
+    const uchar* u = v + lumaSize/4;
+    for (int i = 0; i < lumaSize/4; ++i) {
+        nv21.data[lumaSize + 2*i] = v[i];
+        nv21.data[lumaSize + 2*i + 1] = u[i];
+    }
+    Mat converted;
+    nv21ToRGBA(nv21, converted);
+    const YUVPlanes planes = nv21Planes(nv21.data, size.width, size.height);
+
+    bool passed = true;
+    Mat fused, reference;
+    for (int rotateCode = 0; rotateCode < 360; rotateCode += 90) {
+        for (int flipCode = 0; flipCode < 4; ++flipCode) {
+            for (int scale = 1; scale <= 4; ++scale) {
+                transformRGBA(rgba, fused, rotateCode, flipCode, scale);
+                referenceTransform(rgba, reference, rotateCode, flipCode, scale);
+                const double rgbaDiff = norm(fused, reference, NORM_INF);
+                transformYUV(planes, fused, rotateCode, flipCode, scale);
+                referenceTransform(converted, reference, rotateCode, flipCode, scale);
+                const double yuvDiff = norm(fused, reference, NORM_INF);
+                fprintf(out, "{\"check\":\"transform\",\"rotate\":%d,\"flip\":%d,\"scale\":%d,"
+                             "\"rgba_max_diff\":%.0f,\"yuv_max_diff\":%.0f}\n",
+                        rotateCode, flipCode, scale, rgbaDiff, yuvDiff);
+                const double rgbaTolerance = (scale > 1) ? TRANSFORM_RGBA_TOLERANCE : 0;
+                if (rgbaDiff > rgbaTolerance || yuvDiff > TRANSFORM_YUV_TOLERANCE) {
+                    fprintf(stderr, "transform rotate %d flip %d scale %d: max diff %.0f (RGBA), %.0f (YUV) out of tolerance\n",
+                            rotateCode, flipCode, scale, rgbaDiff, yuvDiff);
+                    passed = false;
+                }
+            }
+        }
+    }
+    return passed;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <model dir> [image dir] [-n iterations] [-o result.jsonl] [-p] [-l] [-c] [-t trace.json] [-m]\n", argv[0]);
+        return 1;
+    }
+    string modelDir = argv[1];
+    string imageDir;
+    string output;
+    string traceFile;
+    int iterations = 100;
+    bool precisionReport = false;
+    bool landmarkReport = false;
+    bool metricsReport = false;
+    bool transformCheck = false;
+    for (int i = 2; i < argc; ++i) {
+        if (!strcmp(argv[i], "-p")) {
+            precisionReport = true;
+        } else if (!strcmp(argv[i], "-l")) {
+            landmarkReport = true;
+        } else if (!strcmp(argv[i], "-m")) {
+            metricsReport = true;
+        } else if (!strcmp(argv[i], "-c")) {
+            transformCheck = true;
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            iterations = max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else {
+            imageDir = argv[i];
+        }
+    }
+
+    FILE* out = stdout;
+    if (!output.empty()) {
+        out = fopen(output.c_str(), "w");
+        if (!out) {
+            fprintf(stderr, "failed to open %s\n", output.c_str());
+            return 1;
+        }
+    }
+
+    if (transformCheck) {
+        const bool passed = checkTransforms(out);
+        if (out != stdout) {
+            fclose(out);
+        }
+        return passed ? 0 : 1;
+    }
+
+    if (precisionReport || landmarkReport) {
+        vector<Mat> images;
+        vector<String> files;
+        if (!imageDir.empty()) {
+            glob(imageDir, files);
+        }
+        for (const String& file: files) {
+            Mat bgr = imread(file, IMREAD_COLOR);
+            if (!bgr.empty()) {
+                images.push_back(Mat());
+                cvtColor(bgr, images.back(), COLOR_BGR2RGBA);
+            }
+        }
+        bool passed = true;
+        if (landmarkReport) {
+            passed = reportLandmarks(out, modelDir, images, iterations);
+        } else if (images.empty()) {
+            fprintf(stderr, "precision report needs images\n");
+            return 1;
+        } else {
+            reportPrecision(out, modelDir, images, iterations);
+        }
+        if (out != stdout) {
+            fclose(out);
+        }
+        return passed ? 0 : 1;
+    }
+
+    if (!traceFile.empty()) {
+        FaceTrace::start(1 << 16);
+    }
+    FaceDetector detector;
+    if (!detector.load(modelDir)) {
+        fprintf(stderr, "failed to load models from %s\n", modelDir.c_str());
+        return 1;
+    }
+
+    // Synthetic frames
+    const Size sizes[] = { Size(640, 480), Size(1280, 720), Size(1920, 1080) };
+    for (const Size& size: sizes) {
+        Mat rgba(size, CV_8UC4);
+        randu(rgba, Scalar::all(0), Scalar::all(255));
+        benchImage(out, detector, rgba, format("%dx%d", size.width, size.height), iterations);
+    }
+
+    // Multiple streams sharing the models, one context per CPU
+    DetectorPool pool;
+    if (pool.load(modelDir)) {
+        Mat rgba(Size(640, 480), CV_8UC4);
+        randu(rgba, Scalar::all(0), Scalar::all(255));
+        benchStreams(out, pool, rgba, format("640x480x%d", pool.size()), iterations);
+    }
+
+    // Images of given directory
+    if (imageDir.empty()) {
+        fprintf(stderr, "no image dir: the analyze stages only ran on synthetic frames without faces\n");
+    } else {
+        vector<String> files;
+        glob(imageDir, files);
+        for (const String& file: files) {
+            Mat bgr = imread(file, IMREAD_COLOR);
+            if (bgr.empty()) {
+                continue;
+            }
+            Mat rgba;
+            cvtColor(bgr, rgba, COLOR_BGR2RGBA);
+            string name = file.substr(file.find_last_of('/') + 1);
+            benchImage(out, detector, rgba, format("%s@%dx%d", name.c_str(), rgba.cols, rgba.rows), iterations);
+        }
+    }
+
+    if (!traceFile.empty()) {
+        FaceTrace::stop();
+        FaceTrace::dump(traceFile);
+    }
+    if (metricsReport) {
+        reportMetrics(out);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
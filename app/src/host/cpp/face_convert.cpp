@@ -0,0 +1,113 @@
+//
+// Offline converter of models
+//
+// Usage: face_convert <lbfmodel.yaml> <lbfmodel.bin> [--fp16]
+//        face_convert <res10_300x300_ssd_iter_140000.caffemodel> <res10_300x300_ssd_iter_140000_fp16.caffemodel>
+//
+// The binary landmark model is memory mapped by the app instead of parsing tens of MB of YAML (see LBFModel),
+// and the FP16 caffemodel has half the size of the FP32 one. Put them next to the original models
+// in the model directory, they're used when they exist. With --fp16, the regression weights of the binary
+// landmark model are FP16 (see LBFModel::setHalfWeights()), which halves the model size.
+// NOTES:
+// After conversion, the binary landmark model is loaded back and checked against the YAML model:
+// landmarks fitted on a synthetic image must be identical, or within 0.5 pixel with FP16 weights.
+//
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/dnn.hpp>
+#include "face_lbf.h"
+
+using namespace std;
+using namespace cv;
+
+static double elapsed(int64 start) {
+    return 1000.0*(getTickCount() - start)/getTickFrequency();
+}
+
+static long fileSize(const string& file) {
+    long size = -1;
+    FILE* fp = fopen(file.c_str(), "rb");
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fclose(fp);
+    }
+    return size;
+}
+
+static bool endsWith(const string& s, const string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Caffe weights in FP16, they're converted back to FP32 when the network is loaded
+static int convertCaffe(const string& input, const string& output) {
+    dnn::shrinkCaffe(input, output);
+    printf("converted %s (%ld bytes) -> %s (%ld bytes)\n", input.c_str(), fileSize(input), output.c_str(), fileSize(output));
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <lbfmodel.yaml> <lbfmodel.bin> [--fp16]\n"
+                        "       %s <model.caffemodel> <model_fp16.caffemodel>\n", argv[0], argv[0]);
+        return 1;
+    }
+    string input = argv[1];
+    string output = argv[2];
+    const bool half = argc > 3 && !strcmp(argv[3], "--fp16");
+    if (endsWith(input, ".caffemodel")) {
+        return convertCaffe(input, output);
+    }
+
+    LBFModel model;
+    int64 t = getTickCount();
+    if (!model.load(input)) {
+        fprintf(stderr, "failed to load %s\n", input.c_str());
+        return 1;
+    }
+    printf("loaded %s: %.1fms\n", input.c_str(), elapsed(t));
+    LBFModel converted = model;
+    if (half) {
+        converted.setHalfWeights();
+    }
+    if (!converted.save(output)) {
+        fprintf(stderr, "failed to save %s\n", output.c_str());
+        return 1;
+    }
+
+    LBFModel binary;
+    t = getTickCount();
+    if (!binary.load(output)) {
+        fprintf(stderr, "failed to load %s\n", output.c_str());
+        return 1;
+    }
+    printf("loaded %s: %.1fms\n", output.c_str(), elapsed(t));
+
+    // Same landmarks from both models
+    Mat gray(480, 640, CV_8UC1);
+    randu(gray, Scalar::all(0), Scalar::all(255));
+    const Rect faces[] = { Rect(200, 120, 200, 200), Rect(0, 0, 160, 180), Rect(500, 360, 140, 120) };
+    vector<Point2f> expected, actual;
+    float maxError = 0;
+    for (const Rect& face: faces) {
+        model.fit(gray, face, expected, nullptr, 0, model.stages());
+        binary.fit(gray, face, actual, nullptr, 0, binary.stages());
+        if (expected.size() != actual.size()) {
+            fprintf(stderr, "landmarks of binary model mismatch\n");
+            return 1;
+        }
+        for (size_t i = 0; i < expected.size(); ++i) {
+            maxError = max(maxError, float(norm(expected[i] - actual[i])));
+        }
+    }
+    if (maxError > (half ? 0.5f : 0.0f)) {
+        fprintf(stderr, "landmarks of binary model mismatch: max error %.3f pixels\n", maxError);
+        return 1;
+    }
+    printf("converted %s -> %s (%ld bytes, max error %.3f pixels)\n", input.c_str(), output.c_str(), fileSize(output), maxError);
+    return 0;
+}
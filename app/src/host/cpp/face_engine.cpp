@@ -0,0 +1,399 @@
+#include <algorithm>
+#include <sys/stat.h>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include "log.h"
+#include "face_engine.h"
+
+#undef  LOG_TAG
+#define LOG_TAG "FaceEngine"
+
+using namespace std;
+using namespace cv;
+
+// Worker index of the calling thread, -1 outside the pool
+static thread_local int tWorker = -1;
+static thread_local const WorkStealingPool* tPool = nullptr;
+
+WorkStealingPool::~WorkStealingPool() {
+    stop();
+}
+
+void WorkStealingPool::start(int workers) {
+    stop();
+    workers = max(1, workers);
+    for (int i = 0; i < workers; ++i) {
+        mQueues.push_back(unique_ptr<Queue>(new Queue()));
+    }
+    mRunning = true;
+    for (int i = 0; i < workers; ++i) {
+        mWorkers.push_back(thread(&WorkStealingPool::run, this, i));
+    }
+}
+
+void WorkStealingPool::stop() {
+    if (!mRunning) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(mMutex);
+        mRunning = false;
+    }
+    mCond.notify_all();
+    // Queued tasks are still run before the workers exit
+    for (thread& worker: mWorkers) {
+        worker.join();
+    }
+    mWorkers.clear();
+    mQueues.clear();
+}
+
+void WorkStealingPool::submit(const Task& task) {
+    const size_t n = mQueues.size();
+    const size_t worker = (tPool == this) ? size_t(tWorker) : mNext++ % n;
+    {
+        lock_guard<mutex> lock(mQueues[worker]->mutex);
+        mQueues[worker]->tasks.push_back(task);
+    }
+    ++mPending;
+    // NOTES:
+    // The mutex is only used for sleeping/waking up, taking it before notifying avoids a lost wake-up
+    {
+        lock_guard<mutex> lock(mMutex);
+    }
+    mCond.notify_one();
+}
+
+bool WorkStealingPool::pop(int worker, Task& task) {
+    const int n = int(mQueues.size());
+    // Own deque first, newest task
+    {
+        Queue& queue = *mQueues[worker];
+        lock_guard<mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = move(queue.tasks.back());
+            queue.tasks.pop_back();
+            return true;
+        }
+    }
+    // Then steal the oldest task of the others
+    for (int i = 1; i < n; ++i) {
+        Queue& queue = *mQueues[(worker + i) % n];
+        lock_guard<mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
+            ++mStolen;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::run(int worker) {
+    tWorker = worker;
+    tPool = this;
+    Task task;
+    for (;;) {
+        if (pop(worker, task)) {
+            --mPending;
+            task();
+            continue;
+        }
+        unique_lock<mutex> lock(mMutex);
+        mCond.wait(lock, [this] { return mPending > 0 || !mRunning; });
+        if (!mRunning && mPending == 0) {
+            break;
+        }
+    }
+    tWorker = -1;
+    tPool = nullptr;
+}
+
+FaceBatchEngine::Params::Params() : workers(0), maxInFlight(0), landmarks(true) {
+}
+
+void FaceBatchEngine::setParams(const Params& params) {
+    mParams = params;
+    if (mParams.workers <= 0) {
+        mParams.workers = max(1, getNumberOfCPUs());
+    }
+    if (mParams.maxInFlight <= 0) {
+        mParams.maxInFlight = mParams.workers*2;
+    }
+}
+
+bool FaceBatchEngine::load(const string& modelDir, const Params& params) {
+    setParams(params);
+    mStages = Stages();
+    // One detector context per worker, so a worker never waits for a context
+    return mDetectors.load(modelDir, mParams.workers);
+}
+
+bool FaceBatchEngine::load(const Stages& stages, const Params& params) {
+    setParams(params);
+    mStages = stages;
+    return bool(mStages.detect) && bool(mStages.fit);
+}
+
+bool FaceBatchEngine::run(const string& input, const Callback& callback) {
+    if (mDetectors.size() == 0 && !mStages.detect) {
+        LOGE("models aren't loaded");
+        return false;
+    }
+    mFiles.clear();
+    struct stat st;
+    if (stat(input.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        glob(input, mFiles);
+        sort(mFiles.begin(), mFiles.end());
+    } else if (!mVideo.open(input)) {
+        LOGE("failed to open %s", input.c_str());
+        return false;
+    }
+
+    mCallback = callback;
+    mSlots.clear();
+    mSlots.resize(size_t(mParams.maxInFlight));
+    mNextRead = 0;
+    mNextEmit = 0;
+    mInFlight = 0;
+    mEnd = false;
+    mParked = false;
+    mStats = Stats();
+    mStart = getTickCount();
+    mSustainedStart = 0;
+
+    mPool.start(mParams.workers);
+    mPool.submit([this] { read(); });
+    {
+        unique_lock<mutex> lock(mMutex);
+        mDone.wait(lock, [this] { return mEnd && mInFlight == 0; });
+    }
+    mPool.stop();
+    mVideo.release();
+
+    const int64 end = getTickCount();
+    mStats.seconds = double(end - mStart)/getTickFrequency();
+    mStats.fps = mStats.seconds > 0 ? mStats.frames/mStats.seconds : 0;
+    const int64 sustained = mStats.frames - int64(mSlots.size());
+    if (mSustainedStart > 0 && sustained > 0 && end > mSustainedStart) {
+        mStats.sustainedFps = sustained/(double(end - mSustainedStart)/getTickFrequency());
+    } else {
+        mStats.sustainedFps = mStats.fps;
+    }
+    LOGI("processed %s: frames=%lld, faces=%lld, failed=%lld, %.1fs, fps=%.1f, sustained fps=%.1f, stolen tasks=%lld",
+         input.c_str(), (long long)mStats.frames, (long long)mStats.faces, (long long)mStats.failed,
+         mStats.seconds, mStats.fps, mStats.sustainedFps, (long long)mPool.stolen());
+    mCallback = nullptr;
+    return true;
+}
+
+// NOTES:
+// One frame per task, then the next read task is pushed to the same worker: it's popped first (LIFO),
+// so this worker keeps reading while the others steal the decode/detect tasks.
+void FaceBatchEngine::read() {
+    int64 frame;
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (mEnd) {
+            return;
+        }
+        if (mInFlight >= int64(mSlots.size())) {
+            // Resumed by finish() once a frame is emitted
+            mParked = true;
+            return;
+        }
+        frame = mNextRead++;
+        ++mInFlight;
+    }
+
+    Slot& s = slot(frame);
+    s.frame = frame;
+    s.failed = false;
+    s.results.clear();
+    bool end;
+    if (mVideo.isOpened()) {
+        end = !mVideo.read(s.bgr);
+        s.source.clear();
+        s.timestampMs = end ? 0 : mVideo.get(CAP_PROP_POS_MSEC);
+    } else {
+        end = frame >= int64(mFiles.size());
+        s.source = end ? string() : string(mFiles[size_t(frame)]);
+        s.timestampMs = 0;
+    }
+    if (end) {
+        {
+            lock_guard<mutex> lock(mMutex);
+            --mNextRead;
+            --mInFlight;
+            mEnd = true;
+        }
+        mDone.notify_all();
+        return;
+    }
+
+    if (mVideo.isOpened()) {
+        mPool.submit([this, &s] { detect(s); });
+    } else {
+        mPool.submit([this, &s] { decode(s); });
+    }
+    mPool.submit([this] { read(); });
+}
+
+void FaceBatchEngine::decode(Slot& s) {
+    s.bgr = imread(s.source, IMREAD_COLOR);
+    detect(s);
+}
+
+void FaceBatchEngine::detect(Slot& s) {
+    if (s.bgr.empty()) {
+        LOGW("failed to decode frame %lld %s", (long long)s.frame, s.source.c_str());
+        s.failed = true;
+        finish(s);
+        return;
+    }
+    cvtColor(s.bgr, s.rgba, COLOR_BGR2RGBA);
+    FaceResults& results = s.results;
+    if (mStages.detect) {
+        mStages.detect(s.rgba, results);
+    } else {
+        FaceDetector* detector = mDetectors.acquire();
+        detector->detect(s.rgba, results.boxes, results.scores);
+        mDetectors.release(detector);
+    }
+    for (size_t i = 0; i < results.boxes.size(); ++i) {
+        results.ids.push_back(int(i));
+        results.tracking.push_back(1.0f);
+        results.ages.push_back(0);
+    }
+    if (mParams.landmarks && !results.boxes.empty()) {
+        mPool.submit([this, &s] { fit(s); });
+    } else {
+        finish(s);
+    }
+}
+
+void FaceBatchEngine::fit(Slot& s) {
+    bool fitted;
+    if (mStages.fit) {
+        fitted = mStages.fit(s.rgba, s.results);
+    } else {
+        FaceDetector* detector = mDetectors.acquire();
+        fitted = detector->fit(s.rgba, s.results.boxes, s.results.landmarks);
+        mDetectors.release(detector);
+    }
+    if (!fitted) {
+        s.results.landmarks.clear();
+    }
+    finish(s);
+}
+
+void FaceBatchEngine::finish(Slot& s) {
+    bool resume = false;
+    {
+        lock_guard<mutex> lock(mMutex);
+        s.done = true;
+        // Emit all the consecutive finished frames
+        while (mInFlight > 0) {
+            Slot& next = slot(mNextEmit);
+            if (!next.done) {
+                break;
+            }
+            ++mStats.frames;
+            mStats.faces += int64(next.results.size());
+            mStats.failed += next.failed ? 1 : 0;
+            if (mCallback) {
+                mCallback(next.frame, next.source, next.timestampMs, next.results);
+            }
+            next.done = false;
+            ++mNextEmit;
+            --mInFlight;
+            if (mNextEmit == int64(mSlots.size())) {
+                mSustainedStart = getTickCount();
+            }
+        }
+        if (mParked && mInFlight < int64(mSlots.size())) {
+            mParked = false;
+            resume = true;
+        }
+    }
+    if (resume) {
+        mPool.submit([this] { read(); });
+    }
+    mDone.notify_all();
+}
+
+FaceResultWriter::~FaceResultWriter() {
+    close();
+}
+
+bool FaceResultWriter::open(const string& file, Format format) {
+    close();
+    mFormat = format;
+    if (file == "-") {
+        mFormat = JSONL;
+        mFile = stdout;
+        return true;
+    }
+    mFile = fopen(file.c_str(), format == BINARY ? "wb" : "w");
+    if (!mFile) {
+        LOGE("failed to open %s", file.c_str());
+        return false;
+    }
+    if (mFormat == BINARY) {
+        const uint32_t version = 1;
+        fwrite("FBRS", 1, 4, mFile);
+        fwrite(&version, sizeof(version), 1, mFile);
+    }
+    return true;
+}
+
+void FaceResultWriter::close() {
+    if (mFile && mFile != stdout) {
+        fclose(mFile);
+    } else if (mFile) {
+        fflush(mFile);
+    }
+    mFile = nullptr;
+}
+
+bool FaceResultWriter::write(int64 frame, const string& source, double timestampMs, const FaceResults& results) {
+    if (!mFile) {
+        return false;
+    }
+    if (mFormat == BINARY) {
+        const int m = results.landmarks.empty() ? 0 : int(results.landmarks[0].size());
+        mBuffer.resize(FaceResultLayout::HEADER_WORDS + results.size()*FaceResultLayout::faceWords(m));
+        packFaceResults(results, mBuffer.data(), mBuffer.size()*sizeof(int32_t));
+        const int64_t id = frame;
+        const uint32_t size = uint32_t(mBuffer.size()*sizeof(int32_t));
+        fwrite(&id, sizeof(id), 1, mFile);
+        fwrite(&timestampMs, sizeof(timestampMs), 1, mFile);
+        fwrite(&size, sizeof(size), 1, mFile);
+        return fwrite(mBuffer.data(), 1, size, mFile) == size;
+    }
+
+    fprintf(mFile, "{\"frame\":%lld,\"source\":\"", (long long)frame);
+    for (char c: source) {
+        if (c == '"' || c == '\\') {
+            fputc('\\', mFile);
+        }
+        fputc(c, mFile);
+    }
+    fprintf(mFile, "\",\"timestamp_ms\":%.1f,\"faces\":[", timestampMs);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Rect& box = results.boxes[i];
+        fprintf(mFile, "%s{\"box\":[%d,%d,%d,%d],\"score\":%.4f", i ? "," : "",
+                box.x, box.y, box.x + box.width, box.y + box.height, results.scores[i]);
+        if (i < results.landmarks.size()) {
+            fputs(",\"landmarks\":[", mFile);
+            const vector<Point2f>& points = results.landmarks[i];
+            for (size_t j = 0; j < points.size(); ++j) {
+                fprintf(mFile, "%s%.2f,%.2f", j ? "," : "", points[j].x, points[j].y);
+            }
+            fputc(']', mFile);
+        }
+        fputc('}', mFile);
+    }
+    return fputs("]}\n", mFile) >= 0;
+}
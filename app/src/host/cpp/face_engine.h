@@ -0,0 +1,185 @@
+#ifndef FACE_FACE_ENGINE_H
+#define FACE_FACE_ENGINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+#include "face_pool.h"
+#include "face_result.h"
+
+// NOTES:
+// Thread pool with a task deque per worker. A worker pushes & pops its own deque at the back (LIFO, the frame
+// it just touched is hot in cache), an idle worker steals from the front of the others' deques (the oldest task),
+// so the stages of different frames spread over all cores without a central queue everybody contends on.
+class WorkStealingPool {
+public:
+    typedef std::function<void()> Task;
+
+    WorkStealingPool() {}
+    ~WorkStealingPool();
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    void start(int workers);
+    void stop();
+    int size() const { return int(mQueues.size()); }
+
+    // Push task to the deque of the calling worker, or of a worker in turn if called from outside the pool
+    void submit(const Task& task);
+    // Tasks stolen from other workers so far
+    int64 stolen() const { return mStolen.load(); }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void run(int worker);
+    bool pop(int worker, Task& task);
+
+    std::vector<std::unique_ptr<Queue>> mQueues;
+    std::vector<std::thread> mWorkers;
+    std::atomic<size_t> mNext{0};
+    std::atomic<int64> mStolen{0};
+    // Tasks queued in all deques, workers sleep when it's 0
+    std::atomic<int64> mPending{0};
+    std::atomic<bool> mRunning{false};
+    std::mutex mMutex;
+    std::condition_variable mCond;
+};
+
+// NOTES:
+// Offline batch engine: streams a video file (or the images of a directory) through the stages
+//   read/decode -> detect -> landmark -> emit
+// Each stage of each frame is a task of a WorkStealingPool, so different frames are in different stages at
+// the same time, and a slow stage (detection) spreads over all cores. Detection & landmarks run on the
+// contexts of a DetectorPool (models loaded once).
+//  - Video frames are decoded in order by a chain of read tasks (one at a time), images are decoded in parallel.
+//  - Bounded memory: at most maxInFlight frames are read but not emitted yet, their buffers are recycled
+//    through a ring of slots. The read chain parks when the ring is full, the emitter resumes it.
+//  - In-order emission: a finished frame is emitted (callback called) only after all the frames before it,
+//    the callback is never called concurrently.
+// Frames are processed independently, detection runs on every frame (no tracking, which needs the
+// previous frame and would serialize the stream).
+class FaceBatchEngine {
+public:
+    struct Params {
+        Params();
+        // Worker threads & detector contexts, 0 for one per CPU
+        int workers;
+        // Frames read but not emitted yet, 0 for 2 per worker
+        int maxInFlight;
+        bool landmarks;
+    };
+
+    struct Stats {
+        int64 frames = 0;
+        int64 faces = 0;
+        // Frames which failed to decode, emitted without faces
+        int64 failed = 0;
+        double seconds = 0;
+        double fps = 0;
+        // FPS after the first maxInFlight frames, i.e. once the pipeline is full
+        double sustainedFps = 0;
+    };
+
+    // Called in frame order with the results of a frame. source is the image file (empty for video),
+    // timestampMs the position in the video (0 for images). Results are only valid during the call
+    typedef std::function<void(int64 frame, const std::string& source, double timestampMs,
+                               const FaceResults& results)> Callback;
+
+    // Stand-ins of the detector contexts, called concurrently by the workers: detect fills boxes & scores
+    // of results from the RGBA frame, fit fills landmarks and returns false on failure
+    struct Stages {
+        std::function<void(const cv::Mat& rgba, FaceResults& results)> detect;
+        std::function<bool(const cv::Mat& rgba, FaceResults& results)> fit;
+    };
+
+    FaceBatchEngine() {}
+    bool load(const std::string& modelDir, const Params& params = Params());
+    // Run the engine on stages instead of models, e.g. fakes of the self test (face_batch --selftest)
+    bool load(const Stages& stages, const Params& params = Params());
+    // Process the video file or the images of a directory, blocks until all frames are emitted
+    bool run(const std::string& input, const Callback& callback);
+    const Stats& stats() const { return mStats; }
+
+private:
+    struct Slot {
+        int64 frame = -1;
+        std::string source;
+        double timestampMs = 0;
+        cv::Mat bgr;
+        cv::Mat rgba;
+        FaceResults results;
+        bool failed = false;
+        bool done = false;
+    };
+
+    Slot& slot(int64 frame) { return mSlots[size_t(frame % int64(mSlots.size()))]; }
+    void read();
+    void decode(Slot& s);
+    void detect(Slot& s);
+    void fit(Slot& s);
+    void finish(Slot& s);
+    void setParams(const Params& params);
+
+    Params mParams;
+    DetectorPool mDetectors;
+    Stages mStages;
+    WorkStealingPool mPool;
+    std::vector<Slot> mSlots;
+    Callback mCallback;
+
+    // Source, used by the read chain only
+    cv::VideoCapture mVideo;
+    std::vector<cv::String> mFiles;
+    int64 mNextRead = 0;
+
+    // Emission state
+    std::mutex mMutex;
+    std::condition_variable mDone;
+    int64 mNextEmit = 0;
+    int64 mInFlight = 0;
+    bool mEnd = false;
+    bool mParked = false;
+    int64 mStart = 0;
+    int64 mSustainedStart = 0;
+    Stats mStats;
+};
+
+// NOTES:
+// Writer of the results of FaceBatchEngine:
+//  - JSONL: one line per frame, e.g.
+//    {"frame":0,"source":"a.jpg","timestamp_ms":0.0,"faces":[{"box":[l,t,r,b],"score":0.98,"landmarks":[x,y,...]}]}
+//  - binary: header "FBRS", uint32 version (1), then one record per frame: int64 frame, double timestamp_ms,
+//    uint32 size, then size bytes of packed FaceResults (see FaceResultLayout), all in native byte order.
+class FaceResultWriter {
+public:
+    enum Format { JSONL, BINARY };
+
+    FaceResultWriter() {}
+    ~FaceResultWriter();
+    FaceResultWriter(const FaceResultWriter&) = delete;
+    FaceResultWriter& operator=(const FaceResultWriter&) = delete;
+
+    // "-" writes JSONL to stdout
+    bool open(const std::string& file, Format format);
+    void close();
+    bool write(int64 frame, const std::string& source, double timestampMs, const FaceResults& results);
+
+private:
+    FILE* mFile = nullptr;
+    Format mFormat = JSONL;
+    std::vector<int32_t> mBuffer;
+};
+
+#endif //FACE_FACE_ENGINE_H
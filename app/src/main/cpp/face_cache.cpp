@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <opencv2/core/hal/intrin.hpp>
+#include <opencv2/imgproc.hpp>
+#include "face_cache.h"
+
+using namespace std;
+using namespace cv;
+
+double meanAbsDiff(const Mat& a, const Mat& b) {
+    CV_Assert(a.type() == CV_8UC1 && b.type() == CV_8UC1 && a.size() == b.size());
+    uint64 sum = 0;
+    for (int y = 0; y < a.rows; ++y) {
+        const uchar* pa = a.ptr<uchar>(y);
+        const uchar* pb = b.ptr<uchar>(y);
+        int x = 0;
+#if CV_SIMD128
+        for (; x <= a.cols - 16; x += 16) {
+            sum += v_reduce_sad(v_load(pa + x), v_load(pb + x));
+        }
+#endif
+        for (; x < a.cols; ++x) {
+            sum += abs(pa[x] - pb[x]);
+        }
+    }
+    return a.empty() ? 0.0 : double(sum)/a.total();
+}
+
+LandmarkCache::Params::Params() : threshold(3.0f), cropSize(32), maxScaleChange(0.1f) {
+}
+
+void LandmarkCache::setParams(const Params& params) {
+    mParams = params;
+    mParams.cropSize = max(8, mParams.cropSize);
+    clear();
+}
+
+void LandmarkCache::clear() {
+    mEntries.clear();
+}
+
+void LandmarkCache::resetCounters() {
+    mHits = 0;
+    mMisses = 0;
+}
+
+LandmarkCache::Entry* LandmarkCache::find(int id) {
+    for (Entry& entry: mEntries) {
+        if (entry.id == id) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+void LandmarkCache::crop(const Mat& image, const Rect& box, Mat& gray) {
+    // Downscaled first, so only cropSize^2 pixels are converted
+    const Size size(mParams.cropSize, mParams.cropSize);
+    resize(image(box), mSmall, size, 0, 0, INTER_AREA);
+    if (mSmall.channels() == 4) {
+        cvtColor(mSmall, gray, COLOR_RGBA2GRAY);
+    } else if (mSmall.channels() == 3) {
+        cvtColor(mSmall, gray, COLOR_RGB2GRAY);
+    } else {
+        mSmall.copyTo(gray);
+    }
+}
+
+bool LandmarkCache::lookup(const Mat& image, int id, const Rect& box, vector<Point2f>& landmarks) {
+    const Rect visible = box & Rect(0, 0, image.cols, image.rows);
+    // A face mostly out of the image is always fitted
+    if (visible.area() < box.area()/2 || visible.width < 2 || visible.height < 2) {
+        ++mMisses;
+        return false;
+    }
+    Entry* entry = find(id);
+    if (!entry) {
+        mEntries.push_back(Entry());
+        entry = &mEntries.back();
+        entry->id = id;
+    }
+    crop(image, visible, mCrop);
+
+    if (entry->valid) {
+        const Rect& prev = entry->box;
+        const float sx = float(box.width)/max(prev.width, 1);
+        const float sy = float(box.height)/max(prev.height, 1);
+        if (fabs(sx - 1) <= mParams.maxScaleChange && fabs(sy - 1) <= mParams.maxScaleChange &&
+            meanAbsDiff(mCrop, entry->crop) <= mParams.threshold) {
+            const Point2f prevCenter(prev.x + prev.width*0.5f, prev.y + prev.height*0.5f);
+            const Point2f center(box.x + box.width*0.5f, box.y + box.height*0.5f);
+            landmarks.resize(entry->landmarks.size());
+            for (size_t i = 0; i < landmarks.size(); ++i) {
+                const Point2f& p = entry->landmarks[i];
+                landmarks[i] = Point2f(center.x + (p.x - prevCenter.x)*sx, center.y + (p.y - prevCenter.y)*sy);
+            }
+            ++mHits;
+            return true;
+        }
+    }
+    // The current crop becomes the reference of the landmarks stored next
+    mCrop.copyTo(entry->crop);
+    entry->valid = false;
+    ++mMisses;
+    return false;
+}
+
+void LandmarkCache::store(int id, const Rect& box, const vector<Point2f>& landmarks) {
+    Entry* entry = find(id);
+    if (!entry || entry->crop.empty() || landmarks.empty()) {
+        return;
+    }
+    entry->box = box;
+    entry->landmarks.assign(landmarks.begin(), landmarks.end());
+    entry->valid = true;
+}
+
+void LandmarkCache::retain(const vector<int>& ids) {
+    mEntries.erase(remove_if(mEntries.begin(), mEntries.end(), [&](const Entry& entry) {
+        return std::find(ids.begin(), ids.end(), entry.id) == ids.end();
+    }), mEntries.end());
+}
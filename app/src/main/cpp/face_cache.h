@@ -0,0 +1,69 @@
+#ifndef FACE_FACE_CACHE_H
+#define FACE_FACE_CACHE_H
+
+#include <atomic>
+#include <vector>
+#include <opencv2/core.hpp>
+
+// NOTES:
+// Landmark cache of tracked faces, keyed by track id: a nearly stationary face (video call, kiosk) doesn't
+// need the LBF cascade again. The face box is downscaled to a small gray crop (cropSize^2), and compared
+// against the crop the cached landmarks were fitted on, by the mean absolute difference (SAD / pixels,
+// vectorized). Below threshold, the cached landmarks are moved from the cached box to the current box
+// (shifted by the box center & scaled by the box size) instead of being fitted.
+// The reference crop is only replaced when the face is fitted again, so slow changes add up until they're
+// over the threshold, rather than drifting away frame by frame.
+class LandmarkCache {
+public:
+    struct Params {
+        Params();
+        // Max mean absolute difference of gray levels (0-255) of a hit
+        float threshold;
+        // Side of the downscaled crop
+        int cropSize;
+        // Max relative change of box size of a hit
+        float maxScaleChange;
+    };
+
+    LandmarkCache() {}
+    void setParams(const Params& params);
+    const Params& params() const { return mParams; }
+    void clear();
+
+    // Cached landmarks of face id if it didn't change, otherwise false (miss), and the crop of image
+    // is kept as the reference for store()
+    bool lookup(const cv::Mat& image, int id, const cv::Rect& box, std::vector<cv::Point2f>& landmarks);
+    // Landmarks fitted for face id after a miss
+    void store(int id, const cv::Rect& box, const std::vector<cv::Point2f>& landmarks);
+    // Drop the faces which aren't in ids (lost tracks)
+    void retain(const std::vector<int>& ids);
+
+    // Counters since the last resetCounters(), can be read from any thread
+    int64 hits() const { return mHits.load(); }
+    int64 misses() const { return mMisses.load(); }
+    void resetCounters();
+
+private:
+    struct Entry {
+        int id;
+        cv::Rect box;
+        cv::Mat crop;
+        std::vector<cv::Point2f> landmarks;
+        bool valid = false;
+    };
+
+    Entry* find(int id);
+    void crop(const cv::Mat& image, const cv::Rect& box, cv::Mat& gray);
+
+    Params mParams;
+    std::vector<Entry> mEntries;
+    cv::Mat mSmall;
+    cv::Mat mCrop;
+    std::atomic<int64> mHits{0};
+    std::atomic<int64> mMisses{0};
+};
+
+// Mean absolute difference of two CV_8UC1 images of the same size
+double meanAbsDiff(const cv::Mat& a, const cv::Mat& b);
+
+#endif //FACE_FACE_CACHE_H
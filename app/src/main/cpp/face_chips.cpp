@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+#include "log.h"
+#include "face_chips.h"
+#include "face_metrics.h"
+#include "face_trace.h"
+
+#undef  LOG_TAG
+#define LOG_TAG "FaceChips"
+
+using namespace std;
+using namespace cv;
+
+// Eye centers & mouth corners of the 112x112 ArcFace template
+static const Point2f REFERENCE_POINTS[4] = {
+    Point2f(38.2946f, 51.6963f), Point2f(73.5318f, 51.5014f), Point2f(41.5493f, 92.3655f), Point2f(70.7299f, 92.2041f)
+};
+static const float REFERENCE_SIZE = 112.0f;
+
+FaceChips::Params::Params() : size(112, 112), channels(3), swapRB(false), depth(CV_32F),
+                              mean(Scalar::all(127.5)), scale(Scalar::all(1.0/128)) {
+}
+
+void FaceChips::setParams(const Params& params) {
+    mParams = params;
+    mParams.size.width = max(8, mParams.size.width);
+    mParams.size.height = max(8, mParams.size.height);
+    if (mParams.channels != 1 && mParams.channels != 3) {
+        LOGW("unsupported chip channels %d, 3 is used", mParams.channels);
+        mParams.channels = 3;
+    }
+    if (mParams.depth != CV_8U && mParams.depth != CV_32F) {
+        LOGW("unsupported chip depth %d, CV_32F is used", mParams.depth);
+        mParams.depth = CV_32F;
+    }
+}
+
+size_t FaceChips::bytes(int n) const {
+    return size_t(n)*mParams.size.area()*mParams.channels*CV_ELEM_SIZE1(mParams.depth);
+}
+
+bool FaceChips::alignmentPoints(const vector<Point2f>& landmarks, Point2f points[4]) {
+    if (landmarks.size() == 68) {
+        Point2f left, right;
+        for (int i = 0; i < 6; ++i) {
+            left += landmarks[36 + i];
+            right += landmarks[42 + i];
+        }
+        points[0] = left*(1.0f/6);
+        points[1] = right*(1.0f/6);
+        points[2] = landmarks[48];
+        points[3] = landmarks[54];
+        return true;
+    }
+    if (landmarks.size() == 5) {
+        points[0] = landmarks[0];
+        points[1] = landmarks[1];
+        points[2] = landmarks[3];
+        points[3] = landmarks[4];
+        return true;
+    }
+    return false;
+}
+
+// NOTES:
+// Closed form of the least-squares similarity: with centered points s & d, the transform is
+// [a -b; b a] where a = sum(s.d)/sum(|s|^2) and b = sum(s x d)/sum(|s|^2), then the translation maps the
+// centroids onto each other. It's never a reflection, unlike a general affine fit.
+Matx23f FaceChips::similarity(const Point2f* src, const Point2f* dst, int n) {
+    Point2f srcMean, dstMean;
+    for (int i = 0; i < n; ++i) {
+        srcMean += src[i];
+        dstMean += dst[i];
+    }
+    srcMean *= 1.0f/max(n, 1);
+    dstMean *= 1.0f/max(n, 1);
+    float norm = 0, dot = 0, cross = 0;
+    for (int i = 0; i < n; ++i) {
+        const Point2f s = src[i] - srcMean;
+        const Point2f d = dst[i] - dstMean;
+        norm += s.dot(s);
+        dot += s.dot(d);
+        cross += s.cross(d);
+    }
+    if (norm <= 0) {
+        return Matx23f();
+    }
+    const float a = dot/norm;
+    const float b = cross/norm;
+    return Matx23f(a, -b, dstMean.x - (a*srcMean.x - b*srcMean.y),
+                   b,  a, dstMean.y - (b*srcMean.x + a*srcMean.y));
+}
+
+void FaceChips::warp(const Mat& image, const Matx23f& transform, Mat& chip) const {
+    // Per thread buffers, warps run in parallel
+    thread_local Mat tWarped;
+    thread_local Mat tColor;
+    int code = -1;
+    const int cn = image.channels();
+    if (mParams.channels == 3) {
+        if (cn == 4) {
+            code = mParams.swapRB ? COLOR_RGBA2BGR : COLOR_RGBA2RGB;
+        } else if (cn == 3 && mParams.swapRB) {
+            code = COLOR_RGB2BGR;
+        } else if (cn == 1) {
+            code = COLOR_GRAY2RGB;
+        }
+    } else if (cn != 1) {
+        code = (cn == 4) ? COLOR_RGBA2GRAY : COLOR_RGB2GRAY;
+    }
+
+    // uint8 chips are written in place, float chips are normalized from the uint8 color chip
+    const bool direct = mParams.depth == CV_8U;
+    Mat& color = direct ? chip : tColor;
+    if (code < 0) {
+        warpAffine(image, color, transform, mParams.size, INTER_LINEAR, BORDER_CONSTANT);
+    } else {
+        warpAffine(image, tWarped, transform, mParams.size, INTER_LINEAR, BORDER_CONSTANT);
+        cvtColor(tWarped, color, code);
+    }
+    if (direct) {
+        return;
+    }
+    const int channels = mParams.channels;
+    float mean[3], scale[3];
+    for (int c = 0; c < channels; ++c) {
+        mean[c] = float(mParams.mean[c]);
+        scale[c] = float(mParams.scale[c]);
+    }
+    const int width = mParams.size.width*channels;
+    for (int y = 0; y < chip.rows; ++y) {
+        const uchar* src = color.ptr<uchar>(y);
+        float* dst = chip.ptr<float>(y);
+        if (channels == 1) {
+            for (int x = 0; x < width; ++x) {
+                dst[x] = (src[x] - mean[0])*scale[0];
+            }
+        } else {
+            for (int x = 0; x < width; x += 3) {
+                dst[x] = (src[x] - mean[0])*scale[0];
+                dst[x + 1] = (src[x + 1] - mean[1])*scale[1];
+                dst[x + 2] = (src[x + 2] - mean[2])*scale[2];
+            }
+        }
+    }
+}
+
+bool FaceChips::extract(const Mat& image, const vector<vector<Point2f>>& landmarks, Mat& chips) {
+    FACE_TRACE_SCOPE("chips");
+    FACE_METRIC_SCOPE(CHIPS);
+    const int cn = image.channels();
+    if (image.depth() != CV_8U || (cn != 1 && cn != 3 && cn != 4)) {
+        LOGE("extract failed: unsupported image type %d", image.type());
+        return false;
+    }
+    const int n = int(landmarks.size());
+    mTransforms.resize(landmarks.size());
+    if (n == 0) {
+        chips.release();
+        return true;
+    }
+    const Size& size = mParams.size;
+    const int dims[] = { n, size.height, size.width, mParams.channels };
+    const bool shaped = chips.dims == 4 && chips.type() == mParams.depth && chips.isContinuous() &&
+                        equal(dims, dims + 4, chips.size.p);
+    if (!shaped) {
+        const size_t needed = bytes(n);
+        if (mBuffer.total() < needed) {
+            mBuffer.create(1, int(needed), CV_8U);
+        }
+        chips = Mat(4, dims, mParams.depth, mBuffer.data);
+    }
+
+    Point2f reference[4];
+    for (int k = 0; k < 4; ++k) {
+        reference[k] = Point2f(REFERENCE_POINTS[k].x*size.width/REFERENCE_SIZE, REFERENCE_POINTS[k].y*size.height/REFERENCE_SIZE);
+    }
+    const int type = CV_MAKETYPE(mParams.depth, mParams.channels);
+    parallel_for_(Range(0, n), [&](const Range& range) {
+        Point2f points[4];
+        for (int i = range.start; i < range.end; ++i) {
+            Mat chip(size, type, chips.ptr(i));
+            if (!alignmentPoints(landmarks[i], points)) {
+                mTransforms[i] = Matx23f();
+                chip.setTo(Scalar::all(0));
+                continue;
+            }
+            mTransforms[i] = similarity(points, reference, 4);
+            warp(image, mTransforms[i], chip);
+        }
+    });
+    return true;
+}
@@ -0,0 +1,59 @@
+#ifndef FACE_FACE_CHIPS_H
+#define FACE_FACE_CHIPS_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+// NOTES:
+// Aligned face chips for a second network (e.g. recognition): each face is warped by the similarity transform
+// (rotation, uniform scale, translation) which best maps (least squares) its eye centers & mouth corners onto
+// the reference points of the chip, those of the common 112x112 ArcFace template scaled to the chip size.
+// All faces of a frame are warped in one parallel pass into one contiguous NxHxWxC tensor (row-major, channels
+// interleaved), uint8 or float32 normalized as (value - mean)*scale per channel, which is fed as is as a batch.
+// The tensor is kept across frames like the other frame buffers: it's only reallocated when it grows.
+// Landmarks are the 68 points of the LBF model (eyes 36-41 & 42-47, mouth corners 48 & 54), or 5 points as
+// { left eye, right eye, nose, left mouth corner, right mouth corner }. A face with other landmarks gets a zero chip.
+class FaceChips {
+public:
+    struct Params {
+        Params();
+        // Chip size
+        cv::Size size;
+        // 3 (RGB) or 1 (gray)
+        int channels;
+        // BGR order of 3 channels
+        bool swapRB;
+        // CV_8U or CV_32F, only float chips are normalized
+        int depth;
+        cv::Scalar mean;
+        cv::Scalar scale;
+    };
+
+    FaceChips() {}
+    void setParams(const Params& params);
+    const Params& params() const { return mParams; }
+    // Bytes of the chips of n faces
+    size_t bytes(int n) const;
+
+    // Warp the faces of landmarks of image (RGBA, RGB or gray) into chips, a NxHxWxC tensor (N = landmarks.size()).
+    // chips is used as is if it already has that shape & type (e.g. it wraps a buffer of the caller), otherwise it
+    // becomes a view of the buffer of FaceChips, valid until the next extract(). Returns false if the image isn't supported
+    bool extract(const cv::Mat& image, const std::vector<std::vector<cv::Point2f>>& landmarks, cv::Mat& chips);
+    // Image to chip transforms of the last extract()
+    const std::vector<cv::Matx23f>& transforms() const { return mTransforms; }
+
+    // Eye centers & mouth corners of landmarks, false if the landmark layout isn't known
+    static bool alignmentPoints(const std::vector<cv::Point2f>& landmarks, cv::Point2f points[4]);
+    // Least-squares similarity transform mapping n points src onto dst
+    static cv::Matx23f similarity(const cv::Point2f* src, const cv::Point2f* dst, int n);
+
+private:
+    void warp(const cv::Mat& image, const cv::Matx23f& transform, cv::Mat& chip) const;
+
+    Params mParams;
+    std::vector<cv::Matx23f> mTransforms;
+    // Storage of the tensor, grown on demand
+    cv::Mat mBuffer;
+};
+
+#endif //FACE_FACE_CHIPS_H
@@ -1,6 +1,12 @@
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
 #include <opencv2/imgproc.hpp>
-#include "utils.h"
+#include "log.h"
 #include "face_detector.h"
+#include "face_metrics.h"
+#include "face_trace.h"
+#include "native_buffer.h"
 
 #undef  LOG_TAG
 #define LOG_TAG "FaceDetector"
@@ -8,148 +14,782 @@
 using namespace std;
 using namespace cv;
 
-static vector<String> getOutputsNames(const dnn::Net& net) {
-    static std::vector<String> names;
-    if (names.empty()) {
-        vector<int> outLayers = net.getUnconnectedOutLayers();
-        vector<String> layersNames = net.getLayerNames();
-        names.resize(outLayers.size());
-        for (size_t i = 0; i < outLayers.size(); ++i)
-            names[i] = layersNames[outLayers[i] - 1];
+// Available physical memory in bytes
+static size_t availableMemory() {
+    size_t available = 0;
+    FILE* fp = fopen("/proc/meminfo", "r");
+    if (fp) {
+        char line[128];
+        unsigned long kb;
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "MemAvailable: %lu kB", &kb) == 1) {
+                available = size_t(kb)*1024;
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    if (available == 0) {
+        available = size_t(sysconf(_SC_AVPHYS_PAGES))*size_t(sysconf(_SC_PAGESIZE));
     }
-    return names;
+    return available;
 }
 
-static void drawDetection(const Mat& frame, float confidence, int left, int top, int right, int bottom) {
-    rectangle(frame, Point(left, top), Point(right, bottom), Scalar(0, 255, 0));
-    string label = format("%.2f", confidence);
-
-    int baseLine;
-    Size labelSize = getTextSize(label, FONT_HERSHEY_SIMPLEX, 0.5, 1, &baseLine);
-
-    top = max(top, labelSize.height);
-    rectangle(frame, Point(left, top - labelSize.height), Point(left + labelSize.width, top + baseLine), Scalar::all(255), FILLED);
-    putText(frame, label, Point(left, top), FONT_HERSHEY_SIMPLEX, 0.5, Scalar());
+// NOTES:
+// Greedy non maximum suppression like dnn::NMSBoxes(), but all buffers are given by the caller
+// so it doesn't allocate once they are warmed up. indices are sorted by score in descending order.
+static void nmsBoxes(const vector<Rect>& boxes, const vector<float>& scores, float threshold, vector<int>& indices) {
+    indices.clear();
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        indices.push_back(int(i));
+    }
+    sort(indices.begin(), indices.end(), [&](int a, int b) {
+        return scores[a] > scores[b] || (scores[a] == scores[b] && a < b);
+    });
+    size_t kept = 0;
+    for (size_t i = 0; i < indices.size(); ++i) {
+        const Rect& box = boxes[indices[i]];
+        bool keep = true;
+        for (size_t j = 0; j < kept && keep; ++j) {
+            const Rect& other = boxes[indices[j]];
+            float overlap = (box & other).area();
+            keep = overlap/(box.area() + other.area() - overlap) <= threshold;
+        }
+        if (keep) {
+            indices[kept++] = indices[i];
+        }
+    }
+    indices.resize(kept);
 }
 
+FaceDetector::MultiScaleParams::MultiScaleParams() {
+    tileSize = 600;
+    overlap = 0.25f;
+    scales = { 1.0f };
+    globalView = true;
+    confidenceThreshold = 0.5f;
+    nmsThreshold = 0.4f;
+}
 
-bool FaceDetector::load(const string& modelDir) {
-    string prototxt = modelDir + "/res10_300x300_ssd_iter_140000.prototxt";
-    string caffeModel = modelDir + "/res10_300x300_ssd_iter_140000.caffemodel";
-    string landmarkModel = modelDir + "/lbfmodel.yaml";
-
-    LOGI("load model %s,%s", prototxt.c_str(), caffeModel.c_str());
-    mFaceNet = dnn::readNetFromCaffe(prototxt, caffeModel);
-
-    LOGI("load model %s", landmarkModel.c_str());
-    return mFaceLandmark.load(landmarkModel);
+FaceDetector::FaceDetector() {
+    mArena.add(mBlob);
+    mArena.add(mPrepared);
+    mArena.add(mOuts);
+    mArena.add(mBoxes);
+    mArena.add(mScores);
+    mArena.add(mIndices);
+    mArena.add(mTiles);
+    mArena.add(mFaces);
+    mArena.add(mConfidences);
+    mArena.add(mFaceIds);
+    mArena.add(mTracks);
+    mArena.add(mFitFaces);
+    mArena.add(mFitMarks);
+    mArena.add(mFitInitials);
+    mArena.add(mFitIndices);
+    mArena.add(mResults.ids);
+    mArena.add(mResults.boxes);
+    mArena.add(mResults.scores);
+    mArena.add(mResults.tracking);
+    mArena.add(mResults.ages);
+    mArena.add(mResults.landmarks);
+    mArena.add(mPrevIds);
+    mArena.add(mPrevBoxes);
+    mArena.add(mPrevMarks);
+    mArena.add(mInitials);
+    mArena.add(mSpareMarks);
+    mFaceTracker.watch(mArena);
 }
 
-void FaceDetector::detect(const Mat& image, vector<Rect>& objects) {
-    Mat rgbImage;
-    Mat blob;
-    vector<Mat> outs;
-
-    cvtColor(image, rgbImage, COLOR_RGBA2BGR);
-    dnn::blobFromImage(rgbImage, blob, 1.0, Size(300, 300), Scalar(104.0,177.0,123.0));
-    mFaceNet.setInput(blob);
-    mFaceNet.forward(outs, getOutputsNames(mFaceNet));
-
-    // NOTES:
-    // Network produces output blob with a shape 1x1xNx7 where N is a number of
-    // detections and an every detection is a vector of values
-    // [batchId, classId, confidence, left, top, right, bottom]
-    // CV_Assert(outs.size() == 1);
+// NOTES:
+// Network produces output blob with a shape 1x1xNx7 where N is a number of
+// detections and an every detection is a vector of values
+// [batchId, classId, confidence, left, top, right, bottom]
+// Only the detections of given batchId are parsed.
+void FaceDetector::parse(const Mat& out, int batchId, const Size& imageSize, vector<Rect>& objects, vector<float>& confidences) {
+    FACE_TRACE_SCOPE("parse");
+    FACE_METRIC_SCOPE(PARSE);
     constexpr float confidenceThreshold = 0.5f;
-    vector<Rect> bboxes;
-    vector<float> confidences;
-    float* data = (float*)outs[0].data;
-    for (size_t i = 0; i < outs[0].total(); i += 7)  {
+    vector<Rect>& bboxes = mBoxes;
+    vector<float>& scores = mScores;
+    bboxes.clear();
+    scores.clear();
+    const float* data = (const float*)out.data;
+    for (size_t i = 0; i < out.total(); i += 7)  {
         // int classId = int(data[i + 1]);
+        if (int(data[i]) != batchId) {
+            continue;
+        }
         float confidence = data[i + 2];
         if (confidence > confidenceThreshold) {
-            int left = (int)(data[i + 3] * image.cols);
-            int top = (int)(data[i + 4] * image.rows);
-            int right = (int)(data[i + 5] * image.cols);
-            int bottom = (int)(data[i + 6] * image.rows);
+            int left = (int)(data[i + 3] * imageSize.width);
+            int top = (int)(data[i + 4] * imageSize.height);
+            int right = (int)(data[i + 5] * imageSize.width);
+            int bottom = (int)(data[i + 6] * imageSize.height);
             int width = right - left + 1;
             int height = bottom - top + 1;
-            if (0 < left && left < image.cols && 0 < top && top < image.rows &&
-                left < right && right < image.cols &&
-                top < bottom && bottom < image.rows) {
+            if (0 < left && left < imageSize.width && 0 < top && top < imageSize.height &&
+                left < right && right < imageSize.width &&
+                top < bottom && bottom < imageSize.height) {
                 bboxes.push_back(Rect(left, top, width, height));
-                confidences.push_back(confidence);
+                scores.push_back(confidence);
             }
         }
     }
     // Performs non maximum suppression given boxes and corresponding scores
     constexpr float nmsThreshold = 0.4f;
-    vector<int> indices;
-    dnn::NMSBoxes(bboxes, confidences, confidenceThreshold, nmsThreshold, indices);
-    for (int index: indices) {
+    nmsBoxes(bboxes, scores, nmsThreshold, mIndices);
+    for (int index: mIndices) {
         objects.push_back(bboxes[index]);
+        confidences.push_back(scores[index]);
     }
 }
 
-bool FaceDetector::fit(const Mat& image, const Rect& face, vector<Point2f>& landmarks) {
-    vector<Rect> faces = { face };
-    vector<vector<Point2f>> marks = { landmarks };
-    if (!mFaceLandmark.fit(image, faces, marks)) {
-        return  false;
+bool FaceModels::load(const string& modelDir, bool halfWeights) {
+    string prototxtFile = modelDir + "/res10_300x300_ssd_iter_140000.prototxt";
+    string caffeModelFile = modelDir + "/res10_300x300_ssd_iter_140000_fp16.caffemodel";
+    if (!halfWeights || access(caffeModelFile.c_str(), R_OK) != 0) {
+        caffeModelFile = modelDir + "/res10_300x300_ssd_iter_140000.caffemodel";
+        halfWeights = false;
+    }
+    LOGI("detection weights: %s", halfWeights ? "FP16 (converted by face_convert)" : "FP32 (original)");
+    string landmarkFile = modelDir + "/lbfmodel.bin";
+    if (access(landmarkFile.c_str(), R_OK) != 0) {
+        landmarkFile = modelDir + "/lbfmodel.yaml";
+    }
+
+    LOGI("load model %s,%s", prototxtFile.c_str(), caffeModelFile.c_str());
+    if (!prototxt.open(prototxtFile) || !caffeModel.open(caffeModelFile)) {
+        LOGE("failed to open model files: %s", modelDir.c_str());
+        return false;
+    }
+    LOGI("load model %s", landmarkFile.c_str());
+    int64 t = getTickCount();
+    shared_ptr<LBFModel> model(new LBFModel());
+    if (!model->load(landmarkFile)) {
+        return false;
+    }
+    landmark = model;
+    LOGI("landmark model loaded: %.1fms", 1000.0*(getTickCount() - t)/getTickFrequency());
+    return true;
+}
+
+bool FaceDetector::load(const string& modelDir, bool halfWeights) {
+    FaceModels models;
+    return models.load(modelDir, halfWeights) && load(models);
+}
+
+bool FaceDetector::load(const FaceModels& models) {
+    if (!models.landmark) {
+        return false;
+    }
+    mFaceNet = dnn::readNetFromCaffe((const char*)models.prototxt.data(), models.prototxt.size(),
+                                     (const char*)models.caffeModel.data(), models.caffeModel.size());
+    if (mFaceNet.empty()) {
+        LOGE("failed to load network");
+        return false;
+    }
+    mFloatNet = mFaceNet;
+    mPrecision = PRECISION_FP32;
+    resolveOutputs();
+    mFaceLandmark.setModel(models.landmark);
+    return true;
+}
+
+void FaceDetector::resolveOutputs() {
+    vector<int> outLayers = mFaceNet.getUnconnectedOutLayers();
+    vector<String> layersNames = mFaceNet.getLayerNames();
+    mOutNames.resize(outLayers.size());
+    for (size_t i = 0; i < outLayers.size(); ++i) {
+        mOutNames[i] = layersNames[outLayers[i] - 1];
+    }
+}
+
+// Network input mean values of res10_300x300_ssd
+static const Scalar inputMean(104.0, 177.0, 123.0);
+
+#define FACE_CV_VERSION(major, minor) ((major)*100 + (minor))
+#define FACE_CV_VERSION_CURRENT FACE_CV_VERSION(CV_VERSION_MAJOR, CV_VERSION_MINOR)
+
+bool FaceDetector::setPrecision(Precision precision, const vector<Mat>& calibration) {
+    if (precision == mPrecision) {
+        return true;
+    }
+    if (mFloatNet.empty()) {
+        LOGE("precision can't be changed once quantized, load the models again");
+        return false;
+    }
+    switch (precision) {
+    case PRECISION_FP32:
+        mFloatNet.setPreferableBackend(dnn::DNN_BACKEND_OPENCV);
+        mFloatNet.setPreferableTarget(dnn::DNN_TARGET_CPU);
+        mFaceNet = mFloatNet;
+        break;
+    case PRECISION_FP16:
+#if FACE_CV_VERSION_CURRENT >= FACE_CV_VERSION(4, 9)
+        mFloatNet.setPreferableBackend(dnn::DNN_BACKEND_OPENCV);
+        mFloatNet.setPreferableTarget(dnn::DNN_TARGET_CPU_FP16);
+        mFaceNet = mFloatNet;
+        break;
+#else
+        LOGE("FP16 inference needs OpenCV 4.9+");
+        return false;
+#endif
+    case PRECISION_INT8: {
+#if FACE_CV_VERSION_CURRENT >= FACE_CV_VERSION(4, 6)
+        if (calibration.empty()) {
+            LOGE("INT8 quantization needs calibration images");
+            return false;
+        }
+        // NOTES:
+        // Net::quantize() takes one Mat per network input, so all calibration images are packed into one
+        // NxCxHxW blob of the only input, each prepared the same way as detect()
+        int64 t = getTickCount();
+        Mat blob;
+        int dims[] = { int(calibration.size()), 3, mInputSize.height, mInputSize.width };
+        blob.create(4, dims, CV_32F);
+        for (size_t i = 0; i < calibration.size(); ++i) {
+            blobFromRGBA(calibration[i], mInputSize, inputMean, blob.ptr<float>(int(i)));
+        }
+        mFloatNet.setPreferableTarget(dnn::DNN_TARGET_CPU);
+        dnn::Net quantized = mFloatNet.quantize(blob, CV_32F, CV_32F);
+        if (quantized.empty()) {
+            LOGE("INT8 quantization failed");
+            return false;
+        }
+        mFaceNet = quantized;
+        mFloatNet = dnn::Net();
+        LOGI("INT8 quantization: calibration=%d, duration=%.1fms", (int)calibration.size(),
+             1000.0*(getTickCount() - t)/getTickFrequency());
+        break;
+#else
+        LOGE("INT8 inference needs OpenCV 4.6+");
+        return false;
+#endif
     }
-    landmarks = std::move(marks[0]);
+    default:
+        return false;
+    }
+    mPrecision = precision;
+    resolveOutputs();
+    // The network is set up again (and batch memory estimated again) by the next forward pass
+    mBatchBytes = 0;
+    mBatchSize = 0;
     return true;
 }
 
-void FaceDetector::process(cv::Mat& image) {
+void FaceDetector::setInputSize(int side) {
+    side = max(32, side);
+    if (side != mInputSize.width) {
+        mInputSize = Size(side, side);
+        // Batch memory is estimated again for the new size
+        mBatchBytes = 0;
+        mBatchSize = 0;
+    }
+}
+
+void FaceDetector::warmUp() {
     int64 t = getTickCount();
+    Mat image(mInputSize, CV_8UC4, Scalar::all(0));
+    mFaces.clear();
+    mConfidences.clear();
+    detect(image, mFaces, mConfidences);
+    vector<Point2f> landmarks;
+    fit(image, Rect(mInputSize.width/4, mInputSize.height/4, mInputSize.width/2, mInputSize.height/2), landmarks);
+    LOGI("warm up: %.1fms", 1000.0*(getTickCount() - t)/getTickFrequency());
+}
 
-    Mat rgbImage;
-    Mat blob;
-    vector<Mat> outs;
-    cvtColor(image, rgbImage, COLOR_RGBA2BGR);
-    dnn::blobFromImage(rgbImage, blob, 1.0, Size(300, 300), Scalar(104.0,177.0,123.0));
-    mFaceNet.setInput(blob);
-    mFaceNet.forward(outs, getOutputsNames(mFaceNet));
-
-    // NOTES:
-    // Network produces output blob with a shape 1x1xNx7 where N is a number of
-    // detections and an every detection is a vector of values
-    // [batchId, classId, confidence, left, top, right, bottom]
-    // CV_Assert(outs.size() == 1);
-    constexpr float confidenceThreshold = 0.5f;
-    vector<Rect> bboxes;
+void FaceDetector::detect(const Mat& image, vector<Rect>& objects) {
     vector<float> confidences;
-    float* data = (float*)outs[0].data;
-    for (size_t i = 0; i < outs[0].total(); i += 7)  {
-        // int classId = int(data[i + 1]);
-        float confidence = data[i + 2];
-        if (confidence > confidenceThreshold) {
-            int left = (int)(data[i + 3] * image.cols);
-            int top = (int)(data[i + 4] * image.rows);
-            int right = (int)(data[i + 5] * image.cols);
-            int bottom = (int)(data[i + 6] * image.rows);
-            int width = right - left + 1;
-            int height = bottom - top + 1;
-            if (0 < left && left < image.cols && 0 < top && top < image.rows &&
-                left < right && right < image.cols &&
-                top < bottom && bottom < image.rows) {
-                bboxes.push_back(Rect(left, top, width, height));
-                confidences.push_back(confidence);
+    detect(image, objects, confidences);
+}
+
+void FaceDetector::detect(const Mat& image, vector<Rect>& objects, vector<float>& confidences) {
+    if (mMultiScale) {
+        detectMultiScale(image, objects, confidences, mMultiScaleParams);
+        return;
+    }
+    int dims[] = { 1, 3, mInputSize.height, mInputSize.width };
+    mBlob.create(4, dims, CV_32F);
+    {
+        FACE_TRACE_SCOPE("blob");
+        FACE_METRIC_SCOPE(BLOB);
+        blobFromRGBA(image, mInputSize, inputMean, mBlob.ptr<float>());
+    }
+    forward(mOuts);
+    parse(mOuts[0], 0, image.size(), objects, confidences);
+}
+
+void FaceDetector::detect(const YUVPlanes& yuv, vector<Rect>& objects) {
+    prepare(yuv);
+    detectPrepared(Size(yuv.width, yuv.height), objects);
+}
+
+void FaceDetector::prepare(const YUVPlanes& yuv) {
+    // Tiles of multi-scale detection are sampled from the whole RGBA frame
+    if (mMultiScale) {
+        FACE_TRACE_SCOPE("convert");
+        FACE_METRIC_SCOPE(CONVERT);
+        transformYUV(yuv, mPrepared, 0, 0);
+        return;
+    }
+    int dims[] = { 1, 3, mInputSize.height, mInputSize.width };
+    mBlob.create(4, dims, CV_32F);
+    FACE_TRACE_SCOPE("blob");
+    FACE_METRIC_SCOPE(BLOB);
+    blobFromYUV(yuv, mInputSize, inputMean, mBlob.ptr<float>());
+}
+
+void FaceDetector::detectPrepared(const Size& imageSize, vector<Rect>& objects) {
+    mConfidences.clear();
+    if (mMultiScale) {
+        detectMultiScale(mPrepared, objects, mConfidences, mMultiScaleParams);
+        return;
+    }
+    forward(mOuts);
+    parse(mOuts[0], 0, imageSize, objects, mConfidences);
+}
+
+void FaceDetector::detectBatch(const vector<Mat>& images, vector<vector<Rect>>& objects) {
+    objects.clear();
+    objects.resize(images.size());
+    const int batchSize = maxBatchSize();
+    vector<float> confidences;
+    for (size_t start = 0; start < images.size(); start += batchSize) {
+        // Pack N images into one NxCxHxW blob
+        int n = min(batchSize, int(images.size() - start));
+        int dims[] = { n, 3, mInputSize.height, mInputSize.width };
+        mBlob.create(4, dims, CV_32F);
+        {
+            FACE_METRIC_SCOPE(BLOB);
+            parallel_for_(Range(0, n), [&](const Range& range) {
+                for (int i = range.start; i < range.end; ++i) {
+                    blobFromRGBA(images[start + i], mInputSize, inputMean, mBlob.ptr<float>(i));
+                }
+            });
+        }
+        forward(mOuts);
+        for (int i = 0; i < n; ++i) {
+            confidences.clear();
+            parse(mOuts[0], i, images[start + i].size(), objects[start + i], confidences);
+        }
+        LOGD("detect batch: images=%d", n);
+    }
+}
+
+// Smallest face found by the network, as fraction of its input (about 30 pixels of 300)
+static const float minFaceFraction = 0.1f;
+
+// NOTES:
+// Without the global view, a face is only found if it's fully inside one tile. The overlap is raised to at
+// least minFaceFraction, so every face large enough to be found in a tile is fully inside one. Faces larger than
+// the overlap (overlap*tileSize/scale image pixels) may still be cut by every tile of a scale: a smaller scale
+// (or the global view) is needed for them.
+void FaceDetector::setMultiScale(bool enabled, const MultiScaleParams& params) {
+    mMultiScale = enabled;
+    mMultiScaleParams = params;
+    MultiScaleParams& p = mMultiScaleParams;
+    p.scales.erase(remove_if(p.scales.begin(), p.scales.end(), [](float scale) { return !(scale > 0); }), p.scales.end());
+    if (p.scales.size() != params.scales.size()) {
+        LOGW("multi-scale: %d scales <= 0 are ignored", int(params.scales.size() - p.scales.size()));
+    }
+    if (p.scales.empty() && !p.globalView) {
+        LOGW("multi-scale: no scale, scale 1 is used");
+        p.scales.push_back(1.0f);
+    }
+    p.tileSize = max(p.tileSize, 1);
+    const float minOverlap = p.globalView ? 0.0f : minFaceFraction;
+    if (!(p.overlap >= minOverlap && p.overlap <= 0.9f)) {
+        p.overlap = min(max(p.overlap, minOverlap), 0.9f);
+        LOGW("multi-scale: overlap %f is clamped to %f", params.overlap, p.overlap);
+    }
+}
+
+void FaceDetector::layoutTiles(const Size& imageSize, const MultiScaleParams& params, vector<Rect>& tiles) {
+    tiles.clear();
+    if (params.globalView) {
+        tiles.push_back(Rect(Point(), imageSize));
+    }
+    for (float scale: params.scales) {
+        if (!(scale > 0)) {
+            continue;
+        }
+        // Tile side in image pixels, tiles are square so faces aren't squashed
+        const int side = cvRound(params.tileSize/scale);
+        if (side <= 0) {
+            continue;
+        }
+        if (side >= imageSize.width && side >= imageSize.height && params.globalView) {
+            // The global view already covers it
+            continue;
+        }
+        const int w = min(side, imageSize.width);
+        const int h = min(side, imageSize.height);
+        const int stride = max(1, cvRound(side*(1.0f - params.overlap)));
+        // Tiles are spread evenly, so the last one ends at the image border
+        const int nx = (imageSize.width - w + stride - 1)/stride + 1;
+        const int ny = (imageSize.height - h + stride - 1)/stride + 1;
+        for (int j = 0; j < ny; ++j) {
+            int y = ny > 1 ? (imageSize.height - h)*j/(ny - 1) : 0;
+            for (int i = 0; i < nx; ++i) {
+                int x = nx > 1 ? (imageSize.width - w)*i/(nx - 1) : 0;
+                tiles.push_back(Rect(x, y, w, h));
             }
         }
     }
-    // Performs non maximum suppression given boxes and corresponding scores
-    constexpr float nmsThreshold = 0.4f;
-    vector<int> indices;
-    dnn::NMSBoxes(bboxes, confidences, confidenceThreshold, nmsThreshold, indices);
+}
+
+// NOTES:
+// Unlike parse(), a box touching the image border is kept (clamped), as tiles make border faces common.
+// But a box touching an inner tile edge is dropped: it's a cut face, which is fully inside a neighbour tile
+// (if it's smaller than the overlap) or detected at a coarser scale.
+void FaceDetector::detectMultiScale(const Mat& image, vector<Rect>& objects, vector<float>& confidences,
+                                    const MultiScaleParams& params) {
+    layoutTiles(image.size(), params, mTiles);
+    vector<Rect>& bboxes = mBoxes;
+    vector<float>& scores = mScores;
+    bboxes.clear();
+    scores.clear();
+    const Rect imageRect(Point(), image.size());
+    const int batchSize = maxBatchSize();
+    for (size_t start = 0; start < mTiles.size(); start += batchSize) {
+        // Pack N tiles into one NxCxHxW blob
+        int n = min(batchSize, int(mTiles.size() - start));
+        int dims[] = { n, 3, mInputSize.height, mInputSize.width };
+        mBlob.create(4, dims, CV_32F);
+        {
+            FACE_METRIC_SCOPE(BLOB);
+            // Tiles are converted on worker threads, their events are tagged with the frame of this thread
+            const int64 frame = FaceTrace::frame();
+            parallel_for_(Range(0, n), [&](const Range& range) {
+                FACE_TRACE_FRAME(frame);
+                FACE_TRACE_SCOPE("blob");
+                for (int i = range.start; i < range.end; ++i) {
+                    blobFromRGBA(image(mTiles[start + i]), mInputSize, inputMean, mBlob.ptr<float>(i));
+                }
+            });
+        }
+        forward(mOuts);
+
+        FACE_METRIC_SCOPE(PARSE);
+        const Mat& out = mOuts[0];
+        const float* data = (const float*)out.data;
+        for (size_t k = 0; k < out.total(); k += 7)  {
+            float confidence = data[k + 2];
+            int i = int(data[k]);
+            if (confidence <= params.confidenceThreshold || i < 0 || i >= n) {
+                continue;
+            }
+            const Rect& tile = mTiles[start + i];
+            int left = tile.x + (int)(data[k + 3]*tile.width);
+            int top = tile.y + (int)(data[k + 4]*tile.height);
+            int right = tile.x + (int)(data[k + 5]*tile.width);
+            int bottom = tile.y + (int)(data[k + 6]*tile.height);
+            if ((left <= tile.x && tile.x > 0) || (top <= tile.y && tile.y > 0) ||
+                (right >= tile.br().x && tile.br().x < imageRect.width) ||
+                (bottom >= tile.br().y && tile.br().y < imageRect.height)) {
+                continue;
+            }
+            Rect box = Rect(Point(left, top), Point(right + 1, bottom + 1)) & imageRect;
+            if (box.area() > 0) {
+                bboxes.push_back(box);
+                scores.push_back(confidence);
+            }
+        }
+    }
+    // Merge detections of all tiles & scales
+    {
+        FACE_METRIC_SCOPE(PARSE);
+        nmsBoxes(bboxes, scores, params.nmsThreshold, mIndices);
+    }
+    for (int index: mIndices) {
+        objects.push_back(bboxes[index]);
+        confidences.push_back(scores[index]);
+    }
+    LOGD("detect multi-scale: tiles=%d, candidates=%d, faces=%d", (int)mTiles.size(), (int)bboxes.size(), (int)mIndices.size());
+}
+
+// NOTES:
+// The max batch size is limited by available memory: each image of a batch needs an input blob
+// and all the intermediate blobs of the network, which are estimated by Net::getMemoryConsumption().
+// At most a quarter of the available memory is used for a batch.
+int FaceDetector::maxBatchSize() {
+    constexpr int maxBatch = 32;
+    if (mBatchBytes == 0) {
+        size_t weights = 0;
+        size_t blobs = 0;
+        mFaceNet.getMemoryConsumption(dnn::MatShape({ 1, 3, mInputSize.height, mInputSize.width }), weights, blobs);
+        mBatchBytes = max(blobs, size_t(3*mInputSize.area()*sizeof(float)));
+    }
+    // Available memory is re-read at most once per second, as detectMultiScale() asks for every frame
+    int64 now = getTickCount();
+    if (mBatchSize == 0 || now - mBatchTick > getTickFrequency()) {
+        size_t available = availableMemory()/4;
+        mBatchSize = max(1, min(maxBatch, int(available/mBatchBytes)));
+        mBatchTick = now;
+    }
+    return mBatchSize;
+}
+
+void FaceDetector::forward(vector<Mat>& outs) {
+    FACE_TRACE_SCOPE("forward");
+    FACE_METRIC_SCOPE(FORWARD);
+    mFaceNet.setInput(mBlob);
+    mFaceNet.forward(outs, mOutNames);
+}
+
+bool FaceDetector::fit(const Mat& image, const Rect& face, vector<Point2f>& landmarks) {
+    mFitFaces.assign(1, face);
+    resizeShapes(mFitMarks, 1);
+    if (!mFaceLandmark.fit(image, mFitFaces, mFitMarks)) {
+        return  false;
+    }
+    landmarks.assign(mFitMarks[0].begin(), mFitMarks[0].end());
+    return true;
+}
+
+bool FaceDetector::fit(const Mat& image, const vector<Rect>& faces, vector<vector<Point2f>>& landmarks,
+                       const vector<vector<Point2f>>* initials) {
+    return mFaceLandmark.fit(image, faces, landmarks, initials);
+}
+
+bool FaceDetector::fit(const YUVPlanes& yuv, const vector<Rect>& faces, vector<vector<Point2f>>& landmarks,
+                       const vector<vector<Point2f>>* initials) {
+    return mFaceLandmark.fit(yuv, faces, landmarks, initials);
+}
+
+void FaceDetector::setLandmarkStages(int stages, int warmStages) {
+    mFaceLandmark.setStages(stages, warmStages);
+}
+
+void FaceDetector::setTracking(bool enabled, const FaceTracker::Params& params) {
+    mTracking = enabled;
+    mFaceTracker.setParams(params);
+    mFaceTracker.reset();
+}
+
+void FaceDetector::track(const Mat& image, vector<FaceTracker::Track>& tracks) {
+    FACE_TRACE_SCOPE("track");
+    mFaceTracker.track(image, *this, tracks);
+}
+
+// NOTES:
+// A track keeps its id across frames, so its landmarks of last frame are moved along with its box
+// (shifted by the box center & scaled by the box size) as the initial shape, which is much closer to
+// the result than the mean shape.
+void FaceDetector::warmStart() {
+    resizeShapes(mInitials, mResults.size());
+    for (size_t i = 0; i < mResults.size(); ++i) {
+        vector<Point2f>& initial = mInitials[i];
+        initial.clear();
+        size_t j = find(mPrevIds.begin(), mPrevIds.end(), mResults.ids[i]) - mPrevIds.begin();
+        if (j >= mPrevMarks.size() || mPrevMarks[j].empty()) {
+            continue;
+        }
+        const Rect& prev = mPrevBoxes[j];
+        const Rect& box = mResults.boxes[i];
+        const float sx = float(box.width)/max(prev.width, 1);
+        const float sy = float(box.height)/max(prev.height, 1);
+        const Point2f prevCenter(prev.x + prev.width*0.5f, prev.y + prev.height*0.5f);
+        const Point2f center(box.x + box.width*0.5f, box.y + box.height*0.5f);
+        for (const Point2f& p: mPrevMarks[j]) {
+            initial.push_back(Point2f(center.x + (p.x - prevCenter.x)*sx, center.y + (p.y - prevCenter.y)*sy));
+        }
+    }
+}
+
+// NOTES:
+// Shapes (landmarks of a face) are vectors of their own, so clearing or shrinking a vector of shapes frees their
+// point buffers, and growing it back allocates them again, for every face of every frame. Dropped shapes are moved
+// (cleared, with their capacity) into mSpareMarks instead, and new shapes are moved back from it: once warmed up
+// to the most faces of a frame, shapes don't touch the heap whatever the number of faces.
+void FaceDetector::resizeShapes(vector<vector<Point2f>>& shapes, size_t n) {
+    while (shapes.size() > n) {
+        shapes.back().clear();
+        mSpareMarks.push_back(std::move(shapes.back()));
+        shapes.pop_back();
+    }
+    while (shapes.size() < n) {
+        if (mSpareMarks.empty()) {
+            shapes.emplace_back();
+        } else {
+            shapes.push_back(std::move(mSpareMarks.back()));
+            mSpareMarks.pop_back();
+        }
+    }
+}
+
+void FaceDetector::setGovernor(bool enabled, const FaceGovernor::Params& params) {
+    mGoverned = enabled;
+    mGovernor.setParams(params);
+    mGovernor.reset();
+    if (!enabled) {
+        setInputSize(300);
+    }
+}
+
+void FaceDetector::setLandmarkCache(bool enabled, const LandmarkCache::Params& params) {
+    mCached = enabled;
+    mLandmarkCache.setParams(params);
+    mLandmarkCache.resetCounters();
+}
+
+// NOTES:
+// Landmarks of each face come from, in order:
+//  - its moved landmarks of last frame, between the landmark frames of the governor (reuse)
+//  - the landmark cache, if the tracked face didn't change
+//  - fitting, all the remaining faces at once (warm started in detect-then-track mode)
+bool FaceDetector::fitResults(const Mat& image, bool reuse) {
+    const bool cached = mCached && mTracking;
+    resizeShapes(mResults.landmarks, mResults.size());
+    mFitFaces.clear();
+    resizeShapes(mFitInitials, 0);
+    mFitIndices.clear();
+    for (size_t i = 0; i < mResults.size(); ++i) {
+        vector<Point2f>& landmarks = mResults.landmarks[i];
+        if (reuse && !mInitials[i].empty()) {
+            landmarks.assign(mInitials[i].begin(), mInitials[i].end());
+            continue;
+        }
+        if (cached && mLandmarkCache.lookup(image, mResults.ids[i], mResults.boxes[i], landmarks)) {
+            continue;
+        }
+        mFitIndices.push_back(int(i));
+        mFitFaces.push_back(mResults.boxes[i]);
+        if (mTracking) {
+            resizeShapes(mFitInitials, mFitInitials.size() + 1);
+            mFitInitials.back().assign(mInitials[i].begin(), mInitials[i].end());
+        }
+    }
+    if (cached) {
+        mLandmarkCache.retain(mResults.ids);
+    }
+    if (mFitFaces.empty()) {
+        return true;
+    }
+    resizeShapes(mFitMarks, mFitFaces.size());
+    if (!mFaceLandmark.fit(image, mFitFaces, mFitMarks, mTracking ? &mFitInitials : nullptr)) {
+        return false;
+    }
+    for (size_t j = 0; j < mFitIndices.size(); ++j) {
+        const int i = mFitIndices[j];
+        mResults.landmarks[i].assign(mFitMarks[j].begin(), mFitMarks[j].end());
+        if (cached) {
+            mLandmarkCache.store(mResults.ids[i], mResults.boxes[i], mFitMarks[j]);
+        }
+    }
+    return true;
+}
+
+void FaceDetector::endFrame(int64 start, int faces) {
+    mArena.endFrame();
+    const double frameMs = 1000.0*(getTickCount() - start)/getTickFrequency();
+    if (mGoverned) {
+        mGovernor.endFrame(frameMs);
+    }
+    FaceMetrics::record(FaceMetrics::FRAME, int64(frameMs*1000));
+    FaceMetrics::record(FaceMetrics::FACES_PER_FRAME, faces);
+    FaceMetrics::add(FaceMetrics::FRAMES);
+    FaceMetrics::add(FaceMetrics::FACES, faces);
+    FaceMetrics::add(FaceMetrics::ALLOCATIONS, mArena.lastAllocations());
+    FaceMetrics::add(FaceMetrics::ALLOCATED_BYTES, int64(mArena.lastBytes()));
+}
+
+const FaceResults& FaceDetector::analyze(const Mat& image, bool landmarks) {
+    FACE_TRACE_CLAIM_FRAME();
+    FACE_TRACE_SCOPE("analyze");
+    // A skipped frame keeps the results of last frame
+    if (mGoverned && !mGovernor.beginFrame()) {
+        FaceMetrics::add(FaceMetrics::FRAMES_SKIPPED);
+        return mResults;
+    }
+    int64 t = getTickCount();
+    if (mGoverned) {
+        setInputSize(mGovernor.decision().inputSize);
+    }
+    mArena.beginFrame();
+    // Keep the results of last frame for warm start
+    mPrevIds.swap(mResults.ids);
+    mPrevBoxes.swap(mResults.boxes);
+    mPrevMarks.swap(mResults.landmarks);
+    // The shapes of two frames ago are parked for reuse, see resizeShapes()
+    resizeShapes(mResults.landmarks, 0);
+    mResults.clear();
+    if (mTracking) {
+        track(image, mTracks);
+        for (const FaceTracker::Track& face: mTracks) {
+            mResults.ids.push_back(face.id);
+            mResults.boxes.push_back(face.box);
+            mResults.scores.push_back(face.confidence);
+            mResults.tracking.push_back(face.tracking);
+            mResults.ages.push_back(face.age);
+        }
+    } else {
+        detect(image, mResults.boxes, mResults.scores);
+        for (size_t i = 0; i < mResults.boxes.size(); ++i) {
+            mResults.ids.push_back(int(i));
+            mResults.tracking.push_back(1.0f);
+            mResults.ages.push_back(0);
+        }
+    }
+    // All faces are fitted at once, tracked faces start from their landmarks of last frame.
+    // Between the landmark frames of the governor, tracked faces only move their landmarks of last frame
+    if (landmarks && !mResults.boxes.empty()) {
+        if (mTracking) {
+            warmStart();
+        }
+        const bool reuse = mGoverned && mTracking && !mGovernor.fitLandmarks();
+        if (!fitResults(image, reuse)) {
+            resizeShapes(mResults.landmarks, 0);
+        }
+    }
+    mOverlay.update(mResults.boxes, mResults.scores, mTracking ? &mResults.ids : nullptr, mResults.landmarks);
+    endFrame(t, int(mResults.boxes.size()));
+    return mResults;
+}
+
+void FaceDetector::process(const Mat& image) {
+    FACE_TRACE_CLAIM_FRAME();
+    FACE_TRACE_SCOPE("process");
+    // A skipped frame keeps the overlay of last frame
+    if (mGoverned && !mGovernor.beginFrame()) {
+        FaceMetrics::add(FaceMetrics::FRAMES_SKIPPED);
+        return;
+    }
+    int64 t = getTickCount();
+    if (mGoverned) {
+        setInputSize(mGovernor.decision().inputSize);
+    }
+    mArena.beginFrame();
+    // The frame itself isn't drawn, results go to the overlay composed at display time
+    static const vector<vector<Point2f>> noLandmarks;
+
+    if (mTracking) {
+        track(image, mTracks);
+        mFaces.clear();
+        mConfidences.clear();
+        mFaceIds.clear();
+        for (const FaceTracker::Track& face: mTracks) {
+            mFaces.push_back(face.box);
+            mConfidences.push_back(face.confidence);
+            mFaceIds.push_back(face.id);
+        }
+        mOverlay.update(mFaces, mConfidences, &mFaceIds, noLandmarks);
+        endFrame(t, int(mTracks.size()));
+        LOGI("track face: faces=%d, detected=%d, arena allocations>=%d, duration=%.1fms", (int)mTracks.size(),
+             mFaceTracker.detected(), mArena.lastAllocations(), 1000.0*(getTickCount() - t)/getTickFrequency());
+        return;
+    }
 
-    LOGI("detect face: candidates=%d, passed=%d, duration=%.1fms",
-         outs[0].total(), indices.size(), 1000.0*(getTickCount() - t)/getTickFrequency());
-    for (int index: indices) {
-        Rect box = bboxes[index];
-        float confidence = confidences[index];
-        drawDetection(image, confidence, box.x, box.y, box.x + box.width, box.y + box.height);
-        LOGI("detect face: bbox=[%d,%d,%d,%d] confidence=%.1f", box.x, box.y, box.x + box.width, box.y + box.height, confidence);
+    mFaces.clear();
+    mConfidences.clear();
+    detect(image, mFaces, mConfidences);
+    for (size_t i = 0; i < mFaces.size(); ++i) {
+        Rect box = mFaces[i];
+        LOGI("detect face: bbox=[%d,%d,%d,%d] confidence=%.1f", box.x, box.y, box.x + box.width, box.y + box.height, mConfidences[i]);
     }
+    mOverlay.update(mFaces, mConfidences, nullptr, noLandmarks);
+    endFrame(t, int(mFaces.size()));
+    LOGI("detect face: passed=%d, arena allocations>=%d, duration=%.1fms",
+         (int)mFaces.size(), mArena.lastAllocations(), 1000.0*(getTickCount() - t)/getTickFrequency());
 }
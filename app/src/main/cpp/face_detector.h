@@ -1,24 +1,209 @@
 #ifndef FACE_FACE_DETECTOR_H
 #define FACE_FACE_DETECTOR_H
 
+#include <memory>
 #include <string>
 #include <vector>
 #include <opencv2/dnn.hpp>
+#include "face_cache.h"
+#include "face_chips.h"
+#include "face_governor.h"
 #include "face_landmark.h"
+#include "face_overlay.h"
+#include "face_preprocess.h"
+#include "face_result.h"
+#include "face_tracker.h"
+#include "frame_arena.h"
+#include "mapped_file.h"
+
+// NOTES:
+// Model weights loaded once, and shared read-only by any number of FaceDetector (see DetectorPool).
+// The landmark model is shared as is, lbfmodel.bin (see face_convert) is preferred to lbfmodel.yaml,
+// it's memory mapped instead of parsed. Likewise the FP16 caffemodel is preferred if it exists, unless halfWeights
+// is false (e.g. the FP32 reference of an accuracy comparison). cv::dnn::Net can't share its weights between instances,
+// so the network files are memory mapped and each detector parses its own Net from the mapping,
+// without reading the files again.
+struct FaceModels {
+    bool load(const std::string& modelDir, bool halfWeights = true);
+    MappedFile prototxt;
+    MappedFile caffeModel;
+    std::shared_ptr<const LBFModel> landmark;
+};
 
 class FaceDetector {
 public:
-    bool load(const std::string& modelDir);
+    // NOTES:
+    // Multi-scale detection: the image is scaled by each of scales, and each scaled image is split into
+    // overlapping square tiles of tileSize pixels, optionally plus the whole image (global view).
+    // Each tile is detected at network input size, so faces much smaller than image/300 are still found.
+    // Detections of all tiles are merged by NMS.
+    struct MultiScaleParams {
+        MultiScaleParams();
+        // Tile side in pixels of the scaled image
+        int tileSize;
+        // Overlap of neighbour tiles, as fraction of tileSize, at most 0.9. Faces smaller than the overlap are
+        // always fully inside a tile. Without the global view it's at least the smallest face of the network (0.1)
+        float overlap;
+        // Image scales to be tiled, > 0 (others are ignored)
+        std::vector<float> scales;
+        // Also detect the whole image at once (large faces)
+        bool globalView;
+        // Detections of tiles below confidenceThreshold are dropped, the others merged by NMS of nmsThreshold (IoU)
+        float confidenceThreshold;
+        float nmsThreshold;
+    };
+
+    // NOTES:
+    // Inference precision of the detection network, all on CPU:
+    //  - FP32: the default
+    //  - FP16: FP16 arithmetic (DNN_TARGET_CPU_FP16, OpenCV 4.9+), it's fast on ARMv8.2+ cores with FP16
+    //    vector instructions, other CPUs run it in FP32. The caffemodel itself can be stored in FP16
+    //    (res10_300x300_ssd_iter_140000_fp16.caffemodel, see face_convert), which halves the file.
+    //  - INT8: weights & activations quantized by Net::quantize() (OpenCV 4.6+), calibrated with sample images
+    //    (RGBA, e.g. frames of the target camera). The FP32 network is released afterwards to save its memory,
+    //    so changing the precision again needs load().
+    enum Precision { PRECISION_FP32, PRECISION_FP16, PRECISION_INT8 };
+
+    FaceDetector();
+    // halfWeights: use the FP16 caffemodel if it exists, see FaceModels
+    bool load(const std::string& modelDir, bool halfWeights = true);
+    // Load from models shared with other detectors
+    bool load(const FaceModels& models);
+    // Network input size (side of the square input), 300 is the size the network is trained with.
+    // A smaller input is faster, but misses small faces
+    void setInputSize(int side);
+    int inputSize() const { return mInputSize.width; }
+    // Returns false if the precision isn't supported, the precision is unchanged then
+    bool setPrecision(Precision precision, const std::vector<cv::Mat>& calibration = std::vector<cv::Mat>());
+    Precision precision() const { return mPrecision; }
+    // Run detection & landmark fitting once on a blank image, so the first frame doesn't pay for
+    // lazy initialization (network setup, buffer allocations)
+    void warmUp();
     void detect(const cv::Mat& image, std::vector<cv::Rect>& objects);
+    void detect(const cv::Mat& image, std::vector<cv::Rect>& objects, std::vector<float>& confidences);
+    // Detect faces from raw YUV planes, without converting the whole frame to RGBA (except in multi-scale mode)
+    void detect(const YUVPlanes& yuv, std::vector<cv::Rect>& objects);
+    // detect() of YUV planes in two steps: the planes are only read by prepare() (into the network input blob),
+    // so they may be released (e.g. a JNI critical section) before detectPrepared() runs the network.
+    // In multi-scale mode, prepare() converts the planes into an RGBA frame for detectMultiScale() instead.
+    // imageSize is the size of the prepared planes
+    void prepare(const YUVPlanes& yuv);
+    void detectPrepared(const cv::Size& imageSize, std::vector<cv::Rect>& objects);
+    // Detect faces of multiple images, images are packed into batches (one forward pass per batch).
+    // Batch size is adapted to available memory.
+    void detectBatch(const std::vector<cv::Mat>& images, std::vector<std::vector<cv::Rect>>& objects);
+    // Tiled multi-scale detection, tiles are detected as batches
+    void detectMultiScale(const cv::Mat& image, std::vector<cv::Rect>& objects, std::vector<float>& confidences,
+                          const MultiScaleParams& params);
+    // Use multi-scale detection for detect()/track()/process(), invalid params are clamped (with a warning)
+    void setMultiScale(bool enabled, const MultiScaleParams& params = MultiScaleParams());
     bool fit(const cv::Mat& image, const cv::Rect& face, std::vector<cv::Point2f>& landmarks);
+    // Landmarks per face of the loaded model, 0 if not loaded
+    int landmarks() const { return mFaceLandmark.landmarks(); }
+    // Fit landmarks of all faces in parallel, initials (optional) are initial shapes, see FaceLandmark
+    bool fit(const cv::Mat& image, const std::vector<cv::Rect>& faces, std::vector<std::vector<cv::Point2f>>& landmarks,
+             const std::vector<std::vector<cv::Point2f>>* initials = nullptr);
+    // Fit landmarks on the Y plane of a camera frame, without any color conversion of the frame
+    bool fit(const YUVPlanes& yuv, const std::vector<cv::Rect>& faces, std::vector<std::vector<cv::Point2f>>& landmarks,
+             const std::vector<std::vector<cv::Point2f>>* initials = nullptr);
+    // Aligned chips of faces from their fitted landmarks, for a second network, see FaceChips
+    FaceChips& chips() { return mFaceChips; }
+    // Landmark cascade stages of a new face (0: all) & of a tracked face, see FaceLandmark::setStages()
+    void setLandmarkStages(int stages, int warmStages);
+    // Landmark cache of tracked faces for analyze() in detect-then-track mode, see LandmarkCache
+    void setLandmarkCache(bool enabled, const LandmarkCache::Params& params = LandmarkCache::Params());
+    const LandmarkCache& landmarkCache() const { return mLandmarkCache; }
+
+    // Detect-then-track mode, see FaceTracker
+    void setTracking(bool enabled, const FaceTracker::Params& params = FaceTracker::Params());
+    void track(const cv::Mat& image, std::vector<FaceTracker::Track>& tracks);
+    bool isTracking() const { return mTracking; }
 
-    // Process all face-related stuff
-    void process(cv::Mat& image);
+    // Latency-budget mode, see FaceGovernor: analyze()/process() skip frames, reduce the input size and
+    // fit landmarks less often (tracked faces reuse their moved landmarks in between) to stay within the budget
+    void setGovernor(bool enabled, const FaceGovernor::Params& params = FaceGovernor::Params());
+    bool isGoverned() const { return mGoverned; }
+    const FaceGovernor& governor() const { return mGovernor; }
+
+    // Detect (or track in detect-then-track mode) faces and optionally fit their landmarks, in one call.
+    // In detect-then-track mode, landmarks of a tracked face start from its landmarks of the last call.
+    // The results are kept until the next call
+    const FaceResults& analyze(const cv::Mat& image, bool landmarks);
+
+    // Process all face-related stuff, the image isn't modified: results are drawn by overlay() at display time
+    void process(const cv::Mat& image);
+    // Overlay of the results of process()/analyze(), composed into the display by the display thread
+    FaceOverlay& overlay() { return mOverlay; }
+    // Buffer (re)allocations by process(), it stops increasing once warmed up (see FrameArena)
+    const FrameArena& arena() const { return mArena; }
 private:
+    // Names of network output layers
+    void resolveOutputs();
+    // Run network with prepared input blob
+    void forward(std::vector<cv::Mat>& outs);
+    // Parse the detections of given batchId from network output
+    void parse(const cv::Mat& out, int batchId, const cv::Size& imageSize,
+               std::vector<cv::Rect>& objects, std::vector<float>& confidences);
+    int maxBatchSize();
+    // Tiles of multi-scale detection in image coordinates
+    void layoutTiles(const cv::Size& imageSize, const MultiScaleParams& params, std::vector<cv::Rect>& tiles);
+    // Initial landmarks of the tracked faces of mResults, from the results of last frame
+    void warmStart();
+    // Landmarks of mResults, moved landmarks of last frame are used as is when reuse is set
+    bool fitResults(const cv::Mat& image, bool reuse);
+    // Resize shapes to n shapes, keeping their point buffers in mSpareMarks
+    void resizeShapes(std::vector<std::vector<cv::Point2f>>& shapes, size_t n);
+    // End of a frame of analyze()/process() begun at tick start: allocations, governor & metrics
+    void endFrame(int64 start, int faces);
+
     FaceLandmark mFaceLandmark;
+    FaceTracker mFaceTracker;
+    bool mTracking = false;
+    bool mMultiScale = false;
+    FaceGovernor mGovernor;
+    LandmarkCache mLandmarkCache;
+    FaceChips mFaceChips;
+    bool mCached = false;
+    bool mGoverned = false;
+    MultiScaleParams mMultiScaleParams;
     cv::dnn::Net mFaceNet;
+    cv::Size mInputSize = cv::Size(300, 300);
+    // Full precision network, released once quantized
+    cv::dnn::Net mFloatNet;
+    Precision mPrecision = PRECISION_FP32;
+    cv::Mat mBlob;
+    // RGBA frame of prepare() in multi-scale mode
+    cv::Mat mPrepared;
+    // Estimated memory needed by each image of a batch
+    size_t mBatchBytes = 0;
+    int mBatchSize = 0;
+    int64 mBatchTick = 0;
 
+    // Buffers reused across frames
+    FrameArena mArena;
+    std::vector<cv::String> mOutNames;
+    std::vector<cv::Mat> mOuts;
+    std::vector<cv::Rect> mBoxes;
+    std::vector<float> mScores;
+    std::vector<int> mIndices;
+    std::vector<cv::Rect> mTiles;
+    std::vector<cv::Rect> mFaces;
+    std::vector<float> mConfidences;
+    std::vector<int> mFaceIds;
+    std::vector<FaceTracker::Track> mTracks;
+    std::vector<cv::Rect> mFitFaces;
+    std::vector<std::vector<cv::Point2f>> mFitMarks;
+    std::vector<std::vector<cv::Point2f>> mFitInitials;
+    std::vector<int> mFitIndices;
+    FaceResults mResults;
+    FaceOverlay mOverlay;
+    // Results of last frame & initial landmarks for analyze()
+    std::vector<int> mPrevIds;
+    std::vector<cv::Rect> mPrevBoxes;
+    std::vector<std::vector<cv::Point2f>> mPrevMarks;
+    std::vector<std::vector<cv::Point2f>> mInitials;
+    // Cleared shapes dropped by resizeShapes(), their point buffers are reused by the next shapes
+    std::vector<std::vector<cv::Point2f>> mSpareMarks;
 };
 
-
 #endif //FACE_FACE_DETECTOR_H
@@ -0,0 +1,105 @@
+#include <algorithm>
+#include "log.h"
+#include "face_governor.h"
+
+#undef  LOG_TAG
+#define LOG_TAG "FaceGovernor"
+
+using namespace std;
+using namespace cv;
+
+FaceGovernor::Params::Params()
+    : budgetMs(33.0), inputSizes({ 300, 224, 160 }), maxLandmarkInterval(4), maxFrameSkip(3),
+      restoreRatio(0.6), holdFrames(15), smoothing(0.2) {
+}
+
+FaceGovernor::FaceGovernor() {
+    buildLevels();
+}
+
+void FaceGovernor::setParams(const Params& params) {
+    lock_guard<mutex> lock(mMutex);
+    mParams = params;
+    if (mParams.inputSizes.empty()) {
+        mParams.inputSizes.push_back(300);
+    }
+    buildLevels();
+    mLevel = min(mLevel, int(mLevels.size()) - 1);
+    mHeld = 0;
+}
+
+void FaceGovernor::reset() {
+    lock_guard<mutex> lock(mMutex);
+    mLevel = 0;
+    mFrameMs = 0;
+    mHeld = 0;
+    mSkipCountdown = 0;
+    mLandmarkCountdown = 0;
+}
+
+void FaceGovernor::buildLevels() {
+    mLevels.clear();
+    // Input size first
+    for (int size: mParams.inputSizes) {
+        mLevels.push_back({ size, 1, 0 });
+    }
+    // Then landmark interval (doubled each level), then frame skip
+    const int size = mParams.inputSizes.back();
+    int interval = 1;
+    while (interval*2 <= mParams.maxLandmarkInterval) {
+        interval *= 2;
+        mLevels.push_back({ size, interval, 0 });
+    }
+    for (int skip = 1; skip <= mParams.maxFrameSkip; ++skip) {
+        mLevels.push_back({ size, interval, skip });
+    }
+}
+
+bool FaceGovernor::beginFrame() {
+    lock_guard<mutex> lock(mMutex);
+    if (mSkipCountdown > 0) {
+        --mSkipCountdown;
+        return false;
+    }
+    return true;
+}
+
+void FaceGovernor::endFrame(double frameMs) {
+    lock_guard<mutex> lock(mMutex);
+    mFrameMs = (mFrameMs > 0) ? mFrameMs + mParams.smoothing*(frameMs - mFrameMs) : frameMs;
+    const Level& current = mLevels[mLevel];
+    mSkipCountdown = current.frameSkip;
+    mLandmarkCountdown = (mLandmarkCountdown > 0 ? mLandmarkCountdown : current.landmarkInterval) - 1;
+
+    if (++mHeld < mParams.holdFrames) {
+        return;
+    }
+    const double cost = mFrameMs/(1 + current.frameSkip);
+    int level = mLevel;
+    if (cost > mParams.budgetMs && mLevel + 1 < int(mLevels.size())) {
+        ++level;
+    } else if (cost < mParams.budgetMs*mParams.restoreRatio && mLevel > 0) {
+        --level;
+    }
+    if (level != mLevel) {
+        const Level& next = mLevels[level];
+        LOGI("level %d -> %d: cost=%.1fms, budget=%.1fms, input=%d, landmark interval=%d, frame skip=%d",
+             mLevel, level, cost, mParams.budgetMs, next.inputSize, next.landmarkInterval, next.frameSkip);
+        mLevel = level;
+        mHeld = 0;
+        mLandmarkCountdown = min(mLandmarkCountdown, next.landmarkInterval - 1);
+    }
+}
+
+FaceGovernor::Decision FaceGovernor::decision() const {
+    lock_guard<mutex> lock(mMutex);
+    const Level& current = mLevels[mLevel];
+    Decision decision;
+    decision.level = mLevel;
+    decision.inputSize = current.inputSize;
+    decision.landmarkInterval = current.landmarkInterval;
+    decision.frameSkip = current.frameSkip;
+    decision.frameMs = mFrameMs;
+    decision.costMs = mFrameMs/(1 + current.frameSkip);
+    return decision;
+}
@@ -0,0 +1,88 @@
+#ifndef FACE_FACE_GOVERNOR_H
+#define FACE_FACE_GOVERNOR_H
+
+#include <mutex>
+#include <vector>
+#include <opencv2/core.hpp>
+
+// NOTES:
+// Latency-budget governor: keeps the per-frame processing time within a budget by degrading (or restoring)
+// the work done per frame, step by step along a ladder of levels. Each level is a combination of
+//   - detector input size (e.g. 300 -> 224 -> 160)
+//   - landmark interval: landmarks are fitted every N frames (tracked faces reuse their moved landmarks in between)
+//   - frame skip: N frames are skipped (not processed) after each processed frame
+// ordered from the best quality (level 0) to the cheapest, input size is reduced first, frames are skipped last.
+// The cost of a level is the smoothed (EMA) frame time amortized over the skipped frames.
+// Hysteresis: a level is degraded when the cost exceeds the budget, but only restored when the cost is below
+// restoreRatio of the budget, and a level is held for at least holdFrames processed frames before changing again,
+// so the governor doesn't oscillate between two levels.
+class FaceGovernor {
+public:
+    struct Params {
+        Params();
+        // Target per-frame processing time
+        double budgetMs;
+        // Detector input sizes, from the best quality
+        std::vector<int> inputSizes;
+        // Largest landmark interval & frame skip
+        int maxLandmarkInterval;
+        int maxFrameSkip;
+        // Restore a better level when the cost is below restoreRatio*budgetMs
+        double restoreRatio;
+        // Processed frames to hold a level before changing again
+        int holdFrames;
+        // EMA smoothing factor of frame time
+        double smoothing;
+    };
+
+    // Current decisions
+    struct Decision {
+        int level;
+        int inputSize;
+        int landmarkInterval;
+        int frameSkip;
+        // Smoothed time of processed frames, and its amortized cost over skipped frames
+        double frameMs;
+        double costMs;
+    };
+
+    FaceGovernor();
+    void setParams(const Params& params);
+    const Params& params() const { return mParams; }
+    void reset();
+
+    // Called for each incoming frame, returns false if the frame should be skipped
+    bool beginFrame();
+    // Whether the landmarks of the current frame should be fitted
+    bool fitLandmarks() const { return mLandmarkCountdown == 0; }
+    // Called after a processed frame with its processing time
+    void endFrame(double frameMs);
+
+    // Snapshot of the current decisions, can be called from any thread
+    Decision decision() const;
+    // Levels of the ladder
+    int levels() const { return int(mLevels.size()); }
+
+private:
+    struct Level {
+        int inputSize;
+        int landmarkInterval;
+        int frameSkip;
+    };
+
+    void buildLevels();
+
+    Params mParams;
+    std::vector<Level> mLevels;
+    int mLevel = 0;
+    double mFrameMs = 0;
+    // Processed frames since the last level change
+    int mHeld = 0;
+    // Frames to skip before the next processed frame
+    int mSkipCountdown = 0;
+    // Frames until the next landmark fitting
+    int mLandmarkCountdown = 0;
+    mutable std::mutex mMutex;
+};
+
+#endif //FACE_FACE_GOVERNOR_H
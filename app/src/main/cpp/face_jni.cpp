@@ -1,4 +1,5 @@
 #include <pthread.h>
+#include <cstring>
 #include <string>
 
 #include <android/native_window_jni.h>
@@ -10,21 +11,29 @@
 
 #include "utils.h"
 #include "face_detector.h"
+#include "face_metrics.h"
+#include "face_pipeline.h"
+#include "face_trace.h"
+#include "native_buffer.h"
 #include "face_jni.h"
 
 using namespace std;
 using namespace cv;
 
+// Native memory of pooled NativeBuffer
+static BufferPool gBufferPool;
 
 //
 // com.hangsheng,face.FaceDetector
 //
-JNIEXPORT jlong JNICALL Java_com_hangsheng_face_FaceDetector_nativeCreate(JNIEnv* env, jclass cls, jstring modelDir) {
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_FaceDetector_nativeCreate(JNIEnv* env, jclass cls, jstring modelDir, jboolean warmUp) {
     const char* dir = env->GetStringUTFChars(modelDir, nullptr);
     FaceDetector* faceDetector = new FaceDetector();
     if (!faceDetector->load(dir)) {
         delete faceDetector;
         faceDetector = nullptr;
+    } else if (warmUp) {
+        faceDetector->warmUp();
     }
     env->ReleaseStringUTFChars(modelDir, dir);
     return reinterpret_cast<jlong>(faceDetector);
@@ -48,6 +57,23 @@ JNIEXPORT jobjectArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeDetect
     jobjectArray rectArray = newRectArray(faces);
     return rectArray;
 }
+JNIEXPORT jobjectArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeDetectNV21(JNIEnv *env, jclass cls,
+    jlong handle, jbyteArray nv21, jint width, jint height) {
+
+    // Detect face directly from NV21 planes, no RGBA frame is needed
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    vector<Rect> faces;
+    // Only the conversion into the network input blob reads the array: the critical section (which may block
+    // the GC) ends before the network runs
+    void* src = env->GetPrimitiveArrayCritical(nv21, 0);
+    faceDetector->prepare(nv21Planes((const uchar*)src, width, height));
+    env->ReleasePrimitiveArrayCritical(nv21, src, JNI_ABORT);
+    faceDetector->detectPrepared(Size(width, height), faces);
+
+    // Construct Java android.graphics.Rect[] instance
+    jobjectArray rectArray = newRectArray(faces);
+    return rectArray;
+}
 JNIEXPORT jobjectArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetMarks(JNIEnv *env, jclass cls,
     jlong handle, jobject byteBuffer, jint width, jint height, jint stride, jobject roi) {
     Mat image(height, width, CV_8UC4, env->GetDirectBufferAddress(byteBuffer), stride);
@@ -57,6 +83,289 @@ JNIEXPORT jobjectArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetMar
     faceDetector->fit(image, face, landmarks);
     return newPointFArray(landmarks);
 }
+// Faces packed as { left, top, right, bottom, ... }
+static void getFaces(JNIEnv* env, jintArray faceArray, vector<Rect>& faces) {
+    FACE_METRIC_SCOPE(JNI);
+    const jsize n = env->GetArrayLength(faceArray)/4;
+    vector<jint> sides(size_t(n)*4);
+    env->GetIntArrayRegion(faceArray, 0, n*4, sides.data());
+    faces.resize(size_t(n));
+    for (jsize i = 0; i < n; ++i) {
+        const jint* side = &sides[i*4];
+        faces[i] = Rect(Point(side[0], side[1]), Point(side[2], side[3]));
+    }
+}
+// Landmarks packed as { x0, y0, x1, y1, ... } face by face
+static jfloatArray newLandmarkArray(JNIEnv* env, const vector<vector<Point2f>>& landmarks) {
+    FACE_METRIC_SCOPE(JNI);
+    vector<jfloat> points;
+    for (const vector<Point2f>& marks: landmarks) {
+        for (const Point2f& point: marks) {
+            points.push_back(point.x);
+            points.push_back(point.y);
+        }
+    }
+    jfloatArray array = env->NewFloatArray(jsize(points.size()));
+    if (array) {
+        env->SetFloatArrayRegion(array, 0, jsize(points.size()), points.data());
+    }
+    return array;
+}
+JNIEXPORT jfloatArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetMarksY(JNIEnv *env, jclass cls,
+    jlong handle, jobject yPlane, jint width, jint height, jint rowStride, jintArray faceArray) {
+    // Only the Y plane is used (e.g. plane 0 of a YUV_420_888 android.media.Image), in place
+    YUVPlanes yuv = {};
+    yuv.y = (const uchar*)env->GetDirectBufferAddress(yPlane);
+    yuv.yStride = rowStride;
+    yuv.width = width;
+    yuv.height = height;
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    vector<Rect> faces;
+    getFaces(env, faceArray, faces);
+    vector<vector<Point2f>> landmarks;
+    if (!yuv.y || !faceDetector->fit(yuv, faces, landmarks)) {
+        return nullptr;
+    }
+    return newLandmarkArray(env, landmarks);
+}
+JNIEXPORT jfloatArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetMarksNV21(JNIEnv *env, jclass cls,
+    jlong handle, jbyteArray nv21, jint width, jint height, jintArray faceArray) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    vector<Rect> faces;
+    getFaces(env, faceArray, faces);
+    // Landmarks are fitted on the Y plane only: it's copied out of the array (one memcpy) so the critical
+    // section, which may block the GC, doesn't cover the fitting. The copy is kept across frames
+    static thread_local Mat luma;
+    luma.create(height, width, CV_8U);
+    void* src = env->GetPrimitiveArrayCritical(nv21, 0);
+    memcpy(luma.data, src, size_t(width)*height);
+    env->ReleasePrimitiveArrayCritical(nv21, src, JNI_ABORT);
+    YUVPlanes yuv = {};
+    yuv.y = luma.data;
+    yuv.yStride = width;
+    yuv.width = width;
+    yuv.height = height;
+    vector<vector<Point2f>> landmarks;
+    if (!faceDetector->fit(yuv, faces, landmarks)) {
+        return nullptr;
+    }
+    return newLandmarkArray(env, landmarks);
+}
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetChipParams(JNIEnv *env, jclass cls,
+    jlong handle, jint width, jint height, jint channels, jboolean swapRB, jboolean normalize, jfloat mean, jfloat scale) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    FaceChips::Params params;
+    params.size = Size(width, height);
+    params.channels = channels;
+    params.swapRB = swapRB;
+    params.depth = normalize ? CV_32F : CV_8U;
+    params.mean = Scalar::all(mean);
+    params.scale = Scalar::all(scale);
+    faceDetector->chips().setParams(params);
+}
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_FaceDetector_nativeChipBytes(JNIEnv *env, jclass cls, jlong handle, jint faces) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    return jlong(faceDetector->chips().bytes(faces));
+}
+// Landmarks packed as { x0, y0, x1, y1, ... } face by face, points per face
+static void getLandmarks(JNIEnv* env, jfloatArray landmarkArray, int points, vector<vector<Point2f>>& landmarks) {
+    FACE_METRIC_SCOPE(JNI);
+    const jsize n = env->GetArrayLength(landmarkArray)/(points*2);
+    vector<jfloat> values(size_t(n)*points*2);
+    env->GetFloatArrayRegion(landmarkArray, 0, jsize(values.size()), values.data());
+    landmarks.resize(size_t(n));
+    for (jsize i = 0; i < n; ++i) {
+        const jfloat* value = &values[size_t(i)*points*2];
+        landmarks[i].resize(size_t(points));
+        for (int j = 0; j < points; ++j) {
+            landmarks[i][j] = Point2f(value[j*2], value[j*2 + 1]);
+        }
+    }
+}
+JNIEXPORT jint JNICALL Java_com_hangsheng_face_FaceDetector_nativeExtractChips(JNIEnv *env, jclass cls,
+    jlong handle, jobject byteBuffer, jint width, jint height, jint stride, jfloatArray landmarkArray, jint points,
+    jobject chipBuffer) {
+    if (points <= 0) {
+        return -1;
+    }
+    Mat image(height, width, CV_8UC4, env->GetDirectBufferAddress(byteBuffer), stride);
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    FaceChips& faceChips = faceDetector->chips();
+    vector<vector<Point2f>> landmarks;
+    getLandmarks(env, landmarkArray, points, landmarks);
+    const int n = int(landmarks.size());
+    void* data = env->GetDirectBufferAddress(chipBuffer);
+    if (!data || size_t(env->GetDirectBufferCapacity(chipBuffer)) < faceChips.bytes(n)) {
+        return -1;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    // NOTES:
+    // The chip tensor wraps the Java buffer, so all faces are warped straight into it in one pass,
+    // and the buffer is fed as is to the next network
+    const FaceChips::Params& params = faceChips.params();
+    const int dims[] = { n, params.size.height, params.size.width, params.channels };
+    Mat chips(4, dims, params.depth, data);
+    return faceChips.extract(image, landmarks, chips) ? n : -1;
+}
+JNIEXPORT jint JNICALL Java_com_hangsheng_face_FaceDetector_nativeAnalyze(JNIEnv *env, jclass cls,
+    jlong handle, jobject byteBuffer, jint width, jint height, jint stride, jobject resultBuffer, jboolean landmarks) {
+    Mat image(height, width, CV_8UC4, env->GetDirectBufferAddress(byteBuffer), stride);
+
+    // NOTES:
+    // Faces, tracks & landmarks are all packed into the result buffer (see face_result.h),
+    // so a frame takes one JNI crossing and no Java object is created.
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    const FaceResults& results = faceDetector->analyze(image, landmarks);
+    FACE_METRIC_SCOPE(JNI);
+    return packFaceResults(results, env->GetDirectBufferAddress(resultBuffer), size_t(env->GetDirectBufferCapacity(resultBuffer)));
+}
+JNIEXPORT jint JNICALL Java_com_hangsheng_face_FaceDetector_nativeLandmarkCount(JNIEnv *env, jclass cls, jlong handle) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    return faceDetector->landmarks();
+}
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_FaceDetector_nativeAllocations(JNIEnv *env, jclass cls, jlong handle) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    return faceDetector->arena().allocations();
+}
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetMultiScale(JNIEnv *env, jclass cls,
+    jlong handle, jboolean enabled, jint tileSize, jfloat overlap, jfloatArray scales, jboolean globalView,
+    jfloat confidenceThreshold, jfloat nmsThreshold) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    FaceDetector::MultiScaleParams params;
+    params.tileSize = tileSize;
+    params.overlap = overlap;
+    params.globalView = globalView;
+    params.confidenceThreshold = confidenceThreshold;
+    params.nmsThreshold = nmsThreshold;
+    if (scales) {
+        jsize n = env->GetArrayLength(scales);
+        params.scales.resize(n);
+        env->GetFloatArrayRegion(scales, 0, n, params.scales.data());
+    }
+    faceDetector->setMultiScale(enabled, params);
+}
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetLandmarkStages(JNIEnv *env, jclass cls,
+    jlong handle, jint stages, jint warmStages) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    faceDetector->setLandmarkStages(stages, warmStages);
+}
+JNIEXPORT jboolean JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetPrecision(JNIEnv *env, jclass cls,
+    jlong handle, jint precision, jstring calibrationDir) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    // Calibration images (for INT8) are all the images of calibrationDir
+    vector<Mat> calibration;
+    if (calibrationDir) {
+        const char* dir = env->GetStringUTFChars(calibrationDir, nullptr);
+        vector<String> files;
+        glob(dir, files);
+        env->ReleaseStringUTFChars(calibrationDir, dir);
+        for (const String& file: files) {
+            Mat bgr = imread(file, IMREAD_COLOR);
+            if (!bgr.empty()) {
+                calibration.push_back(Mat());
+                cvtColor(bgr, calibration.back(), COLOR_BGR2RGBA);
+            }
+        }
+    }
+    return faceDetector->setPrecision(FaceDetector::Precision(precision), calibration);
+}
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetTracking(JNIEnv *env, jclass cls,
+    jlong handle, jboolean enabled, jint detectInterval, jfloat minConfidence, jboolean detectOnLoss,
+    jfloat matchThreshold, jint gridSize, jfloat maxError) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    FaceTracker::Params params;
+    params.detectInterval = detectInterval;
+    params.minConfidence = minConfidence;
+    params.detectOnLoss = detectOnLoss;
+    params.matchThreshold = matchThreshold;
+    params.gridSize = gridSize;
+    params.maxError = maxError;
+    faceDetector->setTracking(enabled, params);
+}
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetLandmarkCache(JNIEnv *env, jclass cls,
+    jlong handle, jboolean enabled, jfloat threshold) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    LandmarkCache::Params params;
+    if (threshold > 0) {
+        params.threshold = threshold;
+    }
+    faceDetector->setLandmarkCache(enabled, params);
+}
+JNIEXPORT jlongArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetLandmarkCacheStats(JNIEnv *env, jclass cls, jlong handle) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    const LandmarkCache& cache = faceDetector->landmarkCache();
+    const jlong values[] = { cache.hits(), cache.misses() };
+    jlongArray array = env->NewLongArray(2);
+    if (array) {
+        env->SetLongArrayRegion(array, 0, 2, values);
+    }
+    return array;
+}
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetGovernor(JNIEnv *env, jclass cls,
+    jlong handle, jboolean enabled, jfloat budgetMs) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    FaceGovernor::Params params;
+    params.budgetMs = budgetMs;
+    faceDetector->setGovernor(enabled, params);
+}
+JNIEXPORT jfloatArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetGovernor(JNIEnv *env, jclass cls, jlong handle) {
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    FaceGovernor::Decision decision = faceDetector->governor().decision();
+    // Packed as { level, inputSize, landmarkInterval, frameSkip, frameMs, costMs }
+    const jfloat values[] = { jfloat(decision.level), jfloat(decision.inputSize), jfloat(decision.landmarkInterval),
+                              jfloat(decision.frameSkip), jfloat(decision.frameMs), jfloat(decision.costMs) };
+    jfloatArray array = env->NewFloatArray(6);
+    if (array) {
+        env->SetFloatArrayRegion(array, 0, 6, values);
+    }
+    return array;
+}
+//
+// Pipeline trace, see FaceTrace
+//
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeStartTrace(JNIEnv* env, jclass cls, jint eventsPerThread) {
+    FaceTrace::start(eventsPerThread);
+}
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeStopTrace(JNIEnv* env, jclass cls) {
+    FaceTrace::stop();
+}
+JNIEXPORT jboolean JNICALL Java_com_hangsheng_face_FaceDetector_nativeDumpTrace(JNIEnv* env, jclass cls, jstring file) {
+    const char* path = env->GetStringUTFChars(file, nullptr);
+    const bool dumped = FaceTrace::dump(path);
+    env->ReleaseStringUTFChars(file, path);
+    return jboolean(dumped);
+}
+//
+// Stage metrics, see FaceMetrics
+//
+JNIEXPORT jlongArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetMetrics(JNIEnv* env, jclass cls, jboolean reset) {
+    // The snapshot buffer is reused, metrics are usually polled by one thread
+    static thread_local vector<int64> packed;
+    FaceMetrics::snapshot(packed, reset);
+    jlongArray array = env->NewLongArray(jsize(packed.size()));
+    if (array) {
+        static_assert(sizeof(jlong) == sizeof(int64), "jlong");
+        env->SetLongArrayRegion(array, 0, jsize(packed.size()), (const jlong*)packed.data());
+    }
+    return array;
+}
+JNIEXPORT jobjectArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetMetricNames(JNIEnv* env, jclass cls) {
+    const int n = FaceMetrics::HISTOGRAMS + FaceMetrics::COUNTERS;
+    jobjectArray array = env->NewObjectArray(n, env->FindClass("java/lang/String"), nullptr);
+    if (!array) {
+        return nullptr;
+    }
+    for (int i = 0; i < n; ++i) {
+        const char* name = (i < FaceMetrics::HISTOGRAMS) ? FaceMetrics::name(FaceMetrics::Histogram(i))
+                                                         : FaceMetrics::name(FaceMetrics::Counter(i - FaceMetrics::HISTOGRAMS));
+        jstring string = env->NewStringUTF(name);
+        env->SetObjectArrayElement(array, i, string);
+        env->DeleteLocalRef(string);
+    }
+    return array;
+}
 //
 // Process all face-related stuff
 //
@@ -71,92 +380,231 @@ JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeProcess(JNIEnv
     faceDetector->process(image);
 
 }
-
 //
-// com.hangsheng,face.NativeBuffer
+// Asynchronous pipeline of all face-related stuff
 //
-JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeDraw(JNIEnv* env, jclass cls,
-    jobject surface, jobject byteBuffer, jint width, jint height, jint stride) {
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_FaceDetector_nativeCreatePipeline(JNIEnv* env, jclass cls, jlong handle) {
+    FacePipeline* facePipeline = new FacePipeline(reinterpret_cast<FaceDetector*>(handle));
+    facePipeline->start();
+    return reinterpret_cast<jlong>(facePipeline);
+}
+
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeDestroyPipeline(JNIEnv* env, jclass cls, jlong pipeline) {
+    delete reinterpret_cast<FacePipeline*>(pipeline);
+}
+
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_FaceDetector_nativeProcessAsync(JNIEnv *env, jclass cls,
+    jlong pipeline, jobject byteBuffer, jint width, jint height, jint stride) {
+
+    // The external data is not automatically de-allocated
+    Mat image(height, width, CV_8UC4, env->GetDirectBufferAddress(byteBuffer), stride);
+
+    // NOTES:
+    // The frame is copied into the pipeline, so the caller never waits for detection. The frame isn't modified,
+    // the latest results are drawn over it at display time (see FaceOverlay), they may be a few frames behind.
+    FacePipeline* facePipeline = reinterpret_cast<FacePipeline*>(pipeline);
+    facePipeline->submit(image);
+    return facePipeline->poll(nullptr);
+}
+
+// Scale RGBA image into the window, with the overlay drawn in display space
+static void drawToWindow(JNIEnv* env, jobject surface, const Mat& image, FaceOverlay& overlay) {
+    FACE_TRACE_SCOPE("draw");
+    FACE_METRIC_SCOPE(DRAW);
     ANativeWindow* window = ANativeWindow_fromSurface(env, surface);
     if (window) {
         ANativeWindow_Buffer buffer = {0};
         if (ANativeWindow_lock(window, &buffer, 0) == 0) {
             assert(buffer.format == WINDOW_FORMAT_RGBA_8888);
             Mat display(buffer.height, buffer.width, CV_8UC4, buffer.bits, buffer.stride*4);
-            Mat image(height, width, CV_8UC4, env->GetDirectBufferAddress(byteBuffer), stride);
-            Mat center;
-            float ration;
-            if (buffer.width*height > buffer.height*width) {
-                ration = buffer.height/float(height);
-                int w = int(ration * width);
-                int h = buffer.height;
-                Rect roi((buffer.width-w)/2, 0, w, h);
-                center = display(roi);
-            } else {
-                ration = buffer.width/float(width);
-                int h = int(ration * height);
-                int w = buffer.width;
-                Rect roi(0, (buffer.height-h)/2, w, h);
-                center = display(roi);
-            }
-            resize(image, center, center.size());
+            overlay.compose(image, display);
             ANativeWindow_unlockAndPost(window);
         }
         ANativeWindow_release(window);
     }
 }
+
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeDraw(JNIEnv* env, jclass cls,
+    jlong handle, jobject surface, jobject byteBuffer, jint width, jint height, jint stride) {
+    Mat image(height, width, CV_8UC4, env->GetDirectBufferAddress(byteBuffer), stride);
+    FaceDetector* faceDetector = reinterpret_cast<FaceDetector*>(handle);
+    drawToWindow(env, surface, image, faceDetector->overlay());
+}
+
+//
+// com.hangsheng,face.NativeBuffer
+//
+JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeDraw(JNIEnv* env, jclass cls,
+    jobject surface, jobject byteBuffer, jint width, jint height, jint stride) {
+    Mat image(height, width, CV_8UC4, env->GetDirectBufferAddress(byteBuffer), stride);
+    // Without results, the overlay only keeps the letterbox of the window
+    static thread_local FaceOverlay overlay;
+    drawToWindow(env, surface, image, overlay);
+}
 JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeFlip(JNIEnv* env, jclass cls,
     jobject srcBuffer, jint srcWidth, jint srcHeight, jint srcStride, jobject dstBuffer, jint dstStride, jint flipCode) {
     Mat src(srcHeight, srcWidth, CV_8UC4, env->GetDirectBufferAddress(srcBuffer), srcStride);
     Mat dst(srcHeight, srcWidth, CV_8UC4, env->GetDirectBufferAddress(dstBuffer), dstStride);
     // flipCode: 0 - No flipping, 1 - Horizontal flipping  2 - Vertical flipping, 3 - Horizontal & Vertical flipping
-    if (flipCode == 1) {
-        // OpenCV flip: Horizontal flipping if flipCode > 0
-        flip(src, dst, 1);
-    } else if (flipCode == 2) {
-        // OpenCV flip: Vertical flipping if flipCode == 0
-        flip(src, dst, 0);
-    } else if (flipCode == 3) {
-        // OpenCV flip: Horizontal flipping if flipCode < 0
-        flip(src, dst, -1);
-    } else {
-        // No flipping, just copying
-        src.copyTo(dst);
-    }
+    flipImage(src, dst, flipCode);
 }
 JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeRotate(JNIEnv* env, jclass cls,
     jobject srcBuffer, jint srcWidth, jint srcHeight, jint srcStride, jobject dstBuffer, jint dstStride, jint rotateCode) {
     Mat src(srcHeight, srcWidth, CV_8UC4, env->GetDirectBufferAddress(srcBuffer), srcStride);
     // rotateCode - counterclockwise rotate degrees: 0, 90, 180, 270
-    if (rotateCode == 90) {
-        Mat dst(srcWidth, srcHeight, CV_8UC4, env->GetDirectBufferAddress(dstBuffer), dstStride);
-        rotate(src, dst, ROTATE_90_CLOCKWISE);
-    } else if (rotateCode == 180) {
-        Mat dst(srcHeight, srcWidth, CV_8UC4, env->GetDirectBufferAddress(dstBuffer), dstStride);
-        rotate(src, dst, ROTATE_180);
-    } else if (rotateCode == 270) {
+    if (rotateCode == 90 || rotateCode == 270) {
         Mat dst(srcWidth, srcHeight, CV_8UC4, env->GetDirectBufferAddress(dstBuffer), dstStride);
-        rotate(src, dst, ROTATE_90_COUNTERCLOCKWISE);
+        rotateImage(src, dst, rotateCode);
     } else {
-        // no rotating, just copying
         Mat dst(srcHeight, srcWidth, CV_8UC4, env->GetDirectBufferAddress(dstBuffer), dstStride);
-        src.copyTo(dst);
+        rotateImage(src, dst, rotateCode);
     }
 }
 
+// Data of a direct ByteBuffer from offset (its position()), null if it isn't direct
+static uchar* directData(JNIEnv* env, jobject byteBuffer, jint offset) {
+    uchar* data = (uchar*)env->GetDirectBufferAddress(byteBuffer);
+    return data ? data + offset : nullptr;
+}
+
 JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeDecode(JNIEnv* env, jclass cls,
-        jobject srcBuffer, jint srcSize, jobject dstBuffer, jint dstWidth, jint dstHeight, jint dstStride) {
-    Mat src(1, srcSize, CV_8UC1, env->GetDirectBufferAddress(srcBuffer), srcSize);
+        jobject srcBuffer, jint srcOffset, jint srcSize, jobject dstBuffer, jint dstWidth, jint dstHeight, jint dstStride) {
+    FACE_TRACE_BEGIN_FRAME();
+    FACE_TRACE_SCOPE("decode");
+    Mat src(1, srcSize, CV_8UC1, directData(env, srcBuffer, srcOffset), srcSize);
+    Mat dst(dstHeight, dstWidth, CV_8UC4, env->GetDirectBufferAddress(dstBuffer), dstStride);
+    // The decoded BGR image is kept for next frame of the same size
+    static thread_local Mat buffer;
+    decodeImage(src, dst, buffer);
+}
+
+JNIEXPORT jintArray JNICALL Java_com_hangsheng_face_NativeBuffer_nativeJpegSize(JNIEnv* env, jclass cls,
+        jobject srcBuffer, jint srcOffset, jint srcSize, jint minWidth, jint minHeight) {
+    const uchar* data = directData(env, srcBuffer, srcOffset);
+    if (!data) {
+        return nullptr;
+    }
+    Size size = jpegSize(data, size_t(srcSize));
+    if (size.empty()) {
+        return nullptr;
+    }
+    size = jpegScaledSize(size, jpegScale(size, Size(minWidth, minHeight)));
+    const jint values[] = { size.width, size.height };
+    jintArray array = env->NewIntArray(2);
+    if (array) {
+        env->SetIntArrayRegion(array, 0, 2, values);
+    }
+    return array;
+}
+
+JNIEXPORT jboolean JNICALL Java_com_hangsheng_face_NativeBuffer_nativeDecodeScaled(JNIEnv* env, jclass cls,
+        jobject srcBuffer, jint srcOffset, jint srcSize, jobject dstBuffer, jint dstWidth, jint dstHeight, jint dstStride) {
+    FACE_TRACE_BEGIN_FRAME();
+    FACE_TRACE_SCOPE("decode");
+    Mat src(1, srcSize, CV_8UC1, directData(env, srcBuffer, srcOffset), srcSize);
     Mat dst(dstHeight, dstWidth, CV_8UC4, env->GetDirectBufferAddress(dstBuffer), dstStride);
-    Mat img = imdecode(src, IMREAD_COLOR);
-    cvtColor(img, dst, COLOR_BGR2RGBA);
+    // The decoded BGR image is kept for next image of the same size
+    static thread_local Mat buffer;
+    return decodeImageScaled(src, dst, buffer);
+}
+
+JNIEXPORT jbooleanArray JNICALL Java_com_hangsheng_face_NativeBuffer_nativeDecodeBatch(JNIEnv* env, jclass cls,
+        jobjectArray srcBuffers, jintArray srcOffsets, jintArray srcSizes, jobjectArray dstBuffers,
+        jintArray dstWidths, jintArray dstHeights) {
+    const jsize n = env->GetArrayLength(srcBuffers);
+    vector<jint> offsets(n), sizes(n), widths(n), heights(n);
+    env->GetIntArrayRegion(srcOffsets, 0, n, offsets.data());
+    env->GetIntArrayRegion(srcSizes, 0, n, sizes.data());
+    env->GetIntArrayRegion(dstWidths, 0, n, widths.data());
+    env->GetIntArrayRegion(dstHeights, 0, n, heights.data());
+    // Buffer addresses are taken on this thread, images are decoded in parallel without JNI
+    vector<Mat> srcs(n), dsts(n);
+    for (jsize i = 0; i < n; ++i) {
+        jobject src = env->GetObjectArrayElement(srcBuffers, i);
+        jobject dst = env->GetObjectArrayElement(dstBuffers, i);
+        srcs[i] = Mat(1, sizes[i], CV_8UC1, directData(env, src, offsets[i]), sizes[i]);
+        dsts[i] = Mat(heights[i], widths[i], CV_8UC4, env->GetDirectBufferAddress(dst), widths[i]*4);
+        env->DeleteLocalRef(src);
+        env->DeleteLocalRef(dst);
+    }
+    vector<uchar> decoded;
+    {
+        FACE_TRACE_SCOPE("decode_batch");
+        decodeImagesScaled(srcs, dsts, decoded);
+    }
+    jbooleanArray array = env->NewBooleanArray(n);
+    if (array) {
+        env->SetBooleanArrayRegion(array, 0, n, (const jboolean*)decoded.data());
+    }
+    return array;
 }
 
 JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeNV21ToRGBA(JNIEnv* env, jclass cls,
     jbyteArray srcBuffer, jobject dstBuffer, jint dstWidth, jint dstHeight, jint dstStride) {
+    FACE_TRACE_BEGIN_FRAME();
+    FACE_TRACE_SCOPE("convert");
+    FACE_METRIC_SCOPE(CONVERT);
     Mat rgba(dstHeight, dstWidth, CV_8UC4, env->GetDirectBufferAddress(dstBuffer), dstStride);
     void* src = env->GetPrimitiveArrayCritical(srcBuffer, 0);
     Mat nv21(dstHeight + dstHeight/2, dstWidth, CV_8UC1, src);
-    cvtColor(nv21, rgba, COLOR_YUV2RGBA_NV21);
+    nv21ToRGBA(nv21, rgba);
     env->ReleasePrimitiveArrayCritical(srcBuffer, src, JNI_ABORT);
 }
+
+JNIEXPORT jobject JNICALL Java_com_hangsheng_face_NativeBuffer_nativeObtain(JNIEnv* env, jclass cls, jint capacity) {
+    void* data = gBufferPool.obtain(size_t(capacity));
+    return env->NewDirectByteBuffer(data, capacity);
+}
+
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_NativeBuffer_nativeAddress(JNIEnv* env, jclass cls, jobject byteBuffer) {
+    return reinterpret_cast<jlong>(env->GetDirectBufferAddress(byteBuffer));
+}
+
+JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeRecycle(JNIEnv* env, jclass cls, jlong address) {
+    gBufferPool.recycle(reinterpret_cast<void*>(address));
+}
+
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_NativeBuffer_nativeAllocations(JNIEnv* env, jclass cls) {
+    return gBufferPool.allocations();
+}
+
+JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeTransformYUV(JNIEnv* env, jclass cls,
+    jobject yBuffer, jobject uBuffer, jobject vBuffer, jint yStride, jint uvStride, jint uvPixelStride, jint width, jint height,
+    jobject dstBuffer, jint dstStride, jint rotateCode, jint flipCode, jint scale) {
+    FACE_TRACE_BEGIN_FRAME();
+    FACE_TRACE_SCOPE("convert");
+    FACE_METRIC_SCOPE(CONVERT);
+    YUVPlanes yuv;
+    yuv.y = (const uchar*)env->GetDirectBufferAddress(yBuffer);
+    yuv.u = (const uchar*)env->GetDirectBufferAddress(uBuffer);
+    yuv.v = (const uchar*)env->GetDirectBufferAddress(vBuffer);
+    yuv.yStride = yStride;
+    yuv.uvStride = uvStride;
+    yuv.uvPixelStride = uvPixelStride;
+    yuv.width = width;
+    yuv.height = height;
+    Mat dst(transformedSize(width, height, rotateCode, scale), CV_8UC4, env->GetDirectBufferAddress(dstBuffer), dstStride);
+    transformYUV(yuv, dst, rotateCode, flipCode, scale);
+}
+
+JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeTransformNV21(JNIEnv* env, jclass cls,
+    jbyteArray srcBuffer, jint width, jint height, jobject dstBuffer, jint dstStride, jint rotateCode, jint flipCode, jint scale) {
+    FACE_TRACE_BEGIN_FRAME();
+    FACE_TRACE_SCOPE("convert");
+    FACE_METRIC_SCOPE(CONVERT);
+    Mat dst(transformedSize(width, height, rotateCode, scale), CV_8UC4, env->GetDirectBufferAddress(dstBuffer), dstStride);
+    void* src = env->GetPrimitiveArrayCritical(srcBuffer, 0);
+    transformYUV(nv21Planes((const uchar*)src, width, height), dst, rotateCode, flipCode, scale);
+    env->ReleasePrimitiveArrayCritical(srcBuffer, src, JNI_ABORT);
+}
+
+JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeTransformRGBA(JNIEnv* env, jclass cls,
+    jobject srcBuffer, jint srcWidth, jint srcHeight, jint srcStride, jobject dstBuffer, jint dstStride,
+    jint rotateCode, jint flipCode, jint scale) {
+    FACE_TRACE_BEGIN_FRAME();
+    FACE_TRACE_SCOPE("convert");
+    FACE_METRIC_SCOPE(CONVERT);
+    Mat src(srcHeight, srcWidth, CV_8UC4, env->GetDirectBufferAddress(srcBuffer), srcStride);
+    Mat dst(transformedSize(srcWidth, srcHeight, rotateCode, scale), CV_8UC4, env->GetDirectBufferAddress(dstBuffer), dstStride);
+    transformRGBA(src, dst, rotateCode, flipCode, scale);
+}
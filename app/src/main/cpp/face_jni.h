@@ -10,15 +10,67 @@ extern "C" {
 //
 // com.hangsheng,face.FaceDetector
 //
-JNIEXPORT jlong JNICALL Java_com_hangsheng_face_FaceDetector_nativeCreate(JNIEnv* env, jclass cls, jstring modelDir);
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_FaceDetector_nativeCreate(JNIEnv* env, jclass cls, jstring modelDir, jboolean warmUp);
 JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeDestroy(JNIEnv* env, jclass cls, jlong handle);
 JNIEXPORT jobjectArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeDetect(JNIEnv *env, jclass cls,
     jlong handle, jobject byteBuffer, jint width, jint height, jint stride);
+JNIEXPORT jobjectArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeDetectNV21(JNIEnv *env, jclass cls,
+    jlong handle, jbyteArray nv21, jint width, jint height);
 JNIEXPORT jobjectArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetMarks(JNIEnv *env, jclass cls,
     jlong handle, jobject byteBuffer, jint width, jint height, jint stride, jobject roi);
+// Fit landmarks on the Y plane of a YUV_420_888 or NV21 frame, see FaceLandmark
+JNIEXPORT jfloatArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetMarksY(JNIEnv *env, jclass cls,
+    jlong handle, jobject yPlane, jint width, jint height, jint rowStride, jintArray faceArray);
+JNIEXPORT jfloatArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetMarksNV21(JNIEnv *env, jclass cls,
+    jlong handle, jbyteArray nv21, jint width, jint height, jintArray faceArray);
+// Aligned face chips from landmarks, warped into a direct buffer as a NxHxWxC tensor, see FaceChips
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetChipParams(JNIEnv *env, jclass cls,
+    jlong handle, jint width, jint height, jint channels, jboolean swapRB, jboolean normalize, jfloat mean, jfloat scale);
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_FaceDetector_nativeChipBytes(JNIEnv *env, jclass cls, jlong handle, jint faces);
+JNIEXPORT jint JNICALL Java_com_hangsheng_face_FaceDetector_nativeExtractChips(JNIEnv *env, jclass cls,
+    jlong handle, jobject byteBuffer, jint width, jint height, jint stride, jfloatArray landmarkArray, jint points,
+    jobject chipBuffer);
+// Detect faces & fit landmarks into a packed result buffer
+JNIEXPORT jint JNICALL Java_com_hangsheng_face_FaceDetector_nativeAnalyze(JNIEnv *env, jclass cls,
+    jlong handle, jobject byteBuffer, jint width, jint height, jint stride, jobject resultBuffer, jboolean landmarks);
+JNIEXPORT jint JNICALL Java_com_hangsheng_face_FaceDetector_nativeLandmarkCount(JNIEnv *env, jclass cls, jlong handle);
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_FaceDetector_nativeAllocations(JNIEnv *env, jclass cls, jlong handle);
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetMultiScale(JNIEnv *env, jclass cls,
+    jlong handle, jboolean enabled, jint tileSize, jfloat overlap, jfloatArray scales, jboolean globalView,
+    jfloat confidenceThreshold, jfloat nmsThreshold);
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetLandmarkStages(JNIEnv *env, jclass cls,
+    jlong handle, jint stages, jint warmStages);
+JNIEXPORT jboolean JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetPrecision(JNIEnv *env, jclass cls,
+    jlong handle, jint precision, jstring calibrationDir);
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetTracking(JNIEnv *env, jclass cls,
+    jlong handle, jboolean enabled, jint detectInterval, jfloat minConfidence, jboolean detectOnLoss,
+    jfloat matchThreshold, jint gridSize, jfloat maxError);
+// Landmark cache of tracked faces & its hit/miss counters
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetLandmarkCache(JNIEnv *env, jclass cls,
+    jlong handle, jboolean enabled, jfloat threshold);
+JNIEXPORT jlongArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetLandmarkCacheStats(JNIEnv *env, jclass cls, jlong handle);
+// Latency-budget governor & its current decisions
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeSetGovernor(JNIEnv *env, jclass cls,
+    jlong handle, jboolean enabled, jfloat budgetMs);
+JNIEXPORT jfloatArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetGovernor(JNIEnv *env, jclass cls, jlong handle);
+// Pipeline trace, dumped as Chrome trace JSON
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeStartTrace(JNIEnv* env, jclass cls, jint eventsPerThread);
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeStopTrace(JNIEnv* env, jclass cls);
+JNIEXPORT jboolean JNICALL Java_com_hangsheng_face_FaceDetector_nativeDumpTrace(JNIEnv* env, jclass cls, jstring file);
+// Stage metrics: packed snapshot (see FaceMetrics) & the names of histograms then counters
+JNIEXPORT jlongArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetMetrics(JNIEnv* env, jclass cls, jboolean reset);
+JNIEXPORT jobjectArray JNICALL Java_com_hangsheng_face_FaceDetector_nativeGetMetricNames(JNIEnv* env, jclass cls);
 // Process all face-related stuff
 JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeProcess(JNIEnv *env, jclass cls,
     jlong handle, jobject byteBuffer, jint width, jint height, jint stride);
+// Asynchronous pipeline of all face-related stuff
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_FaceDetector_nativeCreatePipeline(JNIEnv* env, jclass cls, jlong handle);
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeDestroyPipeline(JNIEnv* env, jclass cls, jlong pipeline);
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_FaceDetector_nativeProcessAsync(JNIEnv *env, jclass cls,
+    jlong pipeline, jobject byteBuffer, jint width, jint height, jint stride);
+// Draw RGBA image into the surface with the face overlay
+JNIEXPORT void JNICALL Java_com_hangsheng_face_FaceDetector_nativeDraw(JNIEnv* env, jclass cls,
+    jlong handle, jobject surface, jobject byteBuffer, jint width, jint height, jint stride);
 //
 // com.hangsheng,face.NativeBuffer
 //
@@ -28,10 +80,33 @@ JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeFlip(JNIEnv* e
     jobject srcBuffer, jint srcWidth, jint srcHeight, jint srcStride, jobject dstBuffer, jint dstStride, jint flipCode);
 JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeRotate(JNIEnv* env, jclass cls,
     jobject srcBuffer, jint srcWidth, jint srcHeight, jint srcStride, jobject dstBuffer, jint dstStride, jint rotateCode);
+// JPEG data starts at srcOffset (position() of the ByteBuffer) and is srcSize bytes long
 JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeDecode(JNIEnv* env, jclass cls,
-    jobject srcBuffer, jint srcSize, jobject dstBuffer, jint dstWidth, jint dstHeight, jint dstStride);
+    jobject srcBuffer, jint srcOffset, jint srcSize, jobject dstBuffer, jint dstWidth, jint dstHeight, jint dstStride);
+// Reduced-resolution JPEG decode, single & batch (parallel)
+JNIEXPORT jintArray JNICALL Java_com_hangsheng_face_NativeBuffer_nativeJpegSize(JNIEnv* env, jclass cls,
+        jobject srcBuffer, jint srcOffset, jint srcSize, jint minWidth, jint minHeight);
+JNIEXPORT jboolean JNICALL Java_com_hangsheng_face_NativeBuffer_nativeDecodeScaled(JNIEnv* env, jclass cls,
+        jobject srcBuffer, jint srcOffset, jint srcSize, jobject dstBuffer, jint dstWidth, jint dstHeight, jint dstStride);
+JNIEXPORT jbooleanArray JNICALL Java_com_hangsheng_face_NativeBuffer_nativeDecodeBatch(JNIEnv* env, jclass cls,
+        jobjectArray srcBuffers, jintArray srcOffsets, jintArray srcSizes, jobjectArray dstBuffers,
+        jintArray dstWidths, jintArray dstHeights);
 JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeNV21ToRGBA(JNIEnv* env, jclass cls,
     jbyteArray srcBuffer, jobject dstBuffer, jint dstWidth, jint dstHeight, jint dstStride);
+// Fused convert + rotate + flip + downscale
+JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeTransformYUV(JNIEnv* env, jclass cls,
+    jobject yBuffer, jobject uBuffer, jobject vBuffer, jint yStride, jint uvStride, jint uvPixelStride, jint width, jint height,
+    jobject dstBuffer, jint dstStride, jint rotateCode, jint flipCode, jint scale);
+JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeTransformNV21(JNIEnv* env, jclass cls,
+    jbyteArray srcBuffer, jint width, jint height, jobject dstBuffer, jint dstStride, jint rotateCode, jint flipCode, jint scale);
+JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeTransformRGBA(JNIEnv* env, jclass cls,
+    jobject srcBuffer, jint srcWidth, jint srcHeight, jint srcStride, jobject dstBuffer, jint dstStride,
+    jint rotateCode, jint flipCode, jint scale);
+// Pooled native memory
+JNIEXPORT jobject JNICALL Java_com_hangsheng_face_NativeBuffer_nativeObtain(JNIEnv* env, jclass cls, jint capacity);
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_NativeBuffer_nativeAddress(JNIEnv* env, jclass cls, jobject byteBuffer);
+JNIEXPORT void JNICALL Java_com_hangsheng_face_NativeBuffer_nativeRecycle(JNIEnv* env, jclass cls, jlong address);
+JNIEXPORT jlong JNICALL Java_com_hangsheng_face_NativeBuffer_nativeAllocations(JNIEnv* env, jclass cls);
 #ifdef __cplusplus
 }
 #endif
@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <opencv2/imgproc.hpp>
-#include "utils.h"
+#include "log.h"
 #include "face_landmark.h"
+#include "face_metrics.h"
+#include "face_trace.h"
 
 
 #undef  LOG_TAG
@@ -9,31 +12,108 @@
 using namespace std;
 using namespace cv;
 
-FaceLandmark::FaceLandmark() {
-    mFacemark = face::FacemarkLBF::create(face::FacemarkLBF::Params());
-}
-
 bool FaceLandmark::load(const string& modelFile) {
-    mFacemark->loadModel(modelFile);
-    if (mFacemark->empty()) {
+    shared_ptr<LBFModel> model(new LBFModel());
+    if (!model->load(modelFile)) {
         LOGE("failed to load model file: %s", modelFile.c_str());
         return false;
     }
+    mModel = model;
     return true;
 }
 
-bool FaceLandmark::fit(const Mat& image, const vector<Rect>& faces, vector<vector<Point2f>>& landmarks) {
-    bool ret = mFacemark->fit(image, faces, landmarks);
-    if (!mFacemark->fit(image, faces, landmarks)) {
-        LOGE("fit failed");
+void FaceLandmark::setModel(const shared_ptr<const LBFModel>& model) {
+    mModel = model;
+}
+
+void FaceLandmark::setStages(int stages, int warmStages) {
+    mStages = max(0, stages);
+    mWarmStages = max(0, warmStages);
+}
+
+bool FaceLandmark::fit(const Mat& image, const vector<Rect>& faces, vector<vector<Point2f>>& landmarks,
+                       const vector<vector<Point2f>>* initials) {
+    if (!mModel || mModel->empty()) {
+        LOGE("fit failed: model isn't loaded");
         return false;
     }
-    // Just for debugging
-    for (int i=0; i < faces.size(); ++i){
-        for (int j = 0; j < landmarks[i].size(); ++j) {
-            circle(image, landmarks[i][j], 2, CV_RGB(0, 255, 0), -1);
-        }
+    // The image is converted once for all faces, by true luma weights (not BGR2GRAY as FacemarkLBF, see LBFModel)
+    const Mat* gray = &image;
+    if (image.channels() == 4) {
+        FACE_TRACE_SCOPE("gray");
+        FACE_METRIC_SCOPE(CONVERT);
+        cvtColor(image, mGray, COLOR_RGBA2GRAY);
+        gray = &mGray;
+    } else if (image.channels() == 3) {
+        FACE_TRACE_SCOPE("gray");
+        FACE_METRIC_SCOPE(CONVERT);
+        cvtColor(image, mGray, COLOR_RGB2GRAY);
+        gray = &mGray;
     }
-    return ret;
+    return fitGray(*gray, false, faces, landmarks, initials);
 }
 
+bool FaceLandmark::fit(const YUVPlanes& yuv, const vector<Rect>& faces, vector<vector<Point2f>>& landmarks,
+                       const vector<vector<Point2f>>* initials) {
+    if (!mModel || mModel->empty()) {
+        LOGE("fit failed: model isn't loaded");
+        return false;
+    }
+    const Mat luma(yuv.height, yuv.width, CV_8UC1, (void*)yuv.y, size_t(yuv.yStride));
+    return fitGray(luma, true, faces, landmarks, initials);
+}
+
+bool FaceLandmark::fitGray(const Mat& gray, bool luma, const vector<Rect>& faces, vector<vector<Point2f>>& landmarks,
+                           const vector<vector<Point2f>>* initials) {
+    FACE_TRACE_SCOPE("landmark");
+    FACE_METRIC_SCOPE(LANDMARK);
+    const LBFModel& model = *mModel;
+    const int stages = model.stages();
+    const int coldStages = (mStages > 0) ? min(mStages, stages) : stages;
+    const int warmStages = min(mWarmStages, stages);
+    const Rect bounds(0, 0, gray.cols, gray.rows);
+    landmarks.resize(faces.size());
+    parallel_for_(Range(0, int(faces.size())), [&](const Range& range) {
+        for (int i = range.start; i < range.end; ++i) {
+            const Rect& face = faces[i];
+            // Faces (e.g. tracked boxes) may be partially out of image, but not entirely
+            const Rect visible = face & bounds;
+            if (visible.width < 2 || visible.height < 2) {
+                landmarks[i].assign(model.landmarks(), Point2f());
+                continue;
+            }
+            const vector<Point2f>* initial = (initials && i < int(initials->size()) && !(*initials)[i].empty() &&
+                                              warmStages > 0) ? &(*initials)[i] : nullptr;
+            if (!luma) {
+                if (initial) {
+                    model.fit(gray, face, landmarks[i], initial, stages - warmStages, stages);
+                } else {
+                    model.fit(gray, face, landmarks[i], nullptr, 0, coldStages);
+                }
+                continue;
+            }
+
+            // The crop is one pixel wider & taller than the sample region, so the sample region of the face
+            // within the crop is the same pixels (see LBFModel::sampleRegion())
+            Rect region = LBFModel::sampleRegion(face, gray.size());
+            region = Rect(region.x, region.y, region.width + 1, region.height + 1) & bounds;
+            static thread_local Mat tCrop;
+            static thread_local vector<Point2f> tInitial;
+            gray(region).convertTo(tCrop, CV_8U, 1.164, -16*1.164);
+            const Point2f offset(float(region.x), float(region.y));
+            if (initial) {
+                tInitial.resize(initial->size());
+                for (size_t j = 0; j < initial->size(); ++j) {
+                    tInitial[j] = (*initial)[j] - offset;
+                }
+                model.fit(tCrop, face - region.tl(), landmarks[i], &tInitial, stages - warmStages, stages);
+            } else {
+                model.fit(tCrop, face - region.tl(), landmarks[i], nullptr, 0, coldStages);
+            }
+            for (Point2f& point: landmarks[i]) {
+                point += offset;
+            }
+        }
+    });
+    return true;
+}
@@ -1,18 +1,48 @@
 #ifndef FACE_FACE_LANDMARK_H
 #define FACE_FACE_LANDMARK_H
 
+#include <memory>
 #include <string>
 #include <vector>
-#include <opencv2/face.hpp>
+#include <opencv2/core.hpp>
+#include "face_lbf.h"
+#include "face_preprocess.h"
 
+// NOTES:
+// Faces are fitted in parallel (one face per task of cv::parallel_for_), each face is fitted only once.
+// A face with an initial shape (e.g. its landmarks of last frame, see FaceDetector::analyze()) runs only the
+// last warmStages cascade stages, the early stages mostly correct the coarse pose of the mean shape.
+// The Y plane of a NV21/YUV_420_888 frame is already the gray image LBF needs: it's wrapped (with its row
+// stride) as a gray Mat without a copy, so no full frame is converted to RGBA, nor from RGBA to gray.
+// Only the sample region of each face (LBFModel::sampleRegion()) is copied, expanded from video range to
+// 1.164*(Y - 16), i.e. the gray level of the RGBA frame of nv21ToRGBA()/transformYUV(), so the LBF
+// thresholds see the same contrast and the landmarks match those fitted on the RGBA frame.
 class FaceLandmark {
 public:
-    FaceLandmark();
     bool load(const std::string& modelFile);
-    bool fit(const cv::Mat& image, const std::vector<cv::Rect>& faces, std::vector<std::vector<cv::Point2f>>& landmarks);
+    // Use a model shared with other FaceLandmark instances, fitting doesn't modify the model
+    void setModel(const std::shared_ptr<const LBFModel>& model);
+    // Cascade stages of a face fitted from the mean shape (0: all stages),
+    // and of a face fitted from an initial shape (the last stages)
+    void setStages(int stages, int warmStages);
+    // initials (optional) is the initial shape of each face, an empty shape means the mean shape
+    bool fit(const cv::Mat& image, const std::vector<cv::Rect>& faces, std::vector<std::vector<cv::Point2f>>& landmarks,
+             const std::vector<std::vector<cv::Point2f>>* initials = nullptr);
+    // Fit landmarks on the Y plane of a camera frame, see the notes below
+    bool fit(const YUVPlanes& yuv, const std::vector<cv::Rect>& faces, std::vector<std::vector<cv::Point2f>>& landmarks,
+             const std::vector<std::vector<cv::Point2f>>* initials = nullptr);
+    int landmarks() const { return mModel ? mModel->landmarks() : 0; }
 
 private:
-    cv::Ptr<cv::face::Facemark> mFacemark;
+    // Fit faces of a gray image, or of a video-range (16-235) luma plane if luma is set
+    bool fitGray(const cv::Mat& gray, bool luma, const std::vector<cv::Rect>& faces,
+                 std::vector<std::vector<cv::Point2f>>& landmarks, const std::vector<std::vector<cv::Point2f>>* initials);
+
+    std::shared_ptr<const LBFModel> mModel;
+    int mStages = 0;
+    int mWarmStages = 2;
+    // Gray image reused across frames
+    cv::Mat mGray;
 };
 
 
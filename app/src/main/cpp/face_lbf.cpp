@@ -0,0 +1,370 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <opencv2/core/hal/intrin.hpp>
+#include "log.h"
+#include "face_lbf.h"
+
+#undef  LOG_TAG
+#define LOG_TAG "LBFModel"
+
+using namespace std;
+using namespace cv;
+
+static const char LBF_MAGIC[4] = { 'L', 'B', 'F', 'B' };
+static const int LBF_VERSION = 1;
+static const size_t LBF_ALIGN = 64;
+
+static size_t alignSize(size_t size) {
+    return (size + LBF_ALIGN - 1)/LBF_ALIGN*LBF_ALIGN;
+}
+
+bool LBFModel::load(const string& modelFile) {
+    shared_ptr<MappedFile> file(new MappedFile());
+    if (file->open(modelFile) && file->size() >= sizeof(LBFHeader) && memcmp(file->data(), LBF_MAGIC, sizeof(LBF_MAGIC)) == 0) {
+        return loadBinary(file);
+    }
+    file.reset();
+    return loadYAML(modelFile);
+}
+
+bool LBFModel::loadBinary(const shared_ptr<MappedFile>& file) {
+    LBFHeader header;
+    memcpy(&header, file->data(), sizeof(header));
+    const int n = header.landmarks;
+    const int nodes = (header.depth > 1 && header.depth < 16) ? 1 << (header.depth - 1) : 0;
+    if (header.version != LBF_VERSION || header.stages <= 0 || header.trees <= 0 || nodes == 0 || n <= 0) {
+        LOGE("invalid binary model");
+        return false;
+    }
+    const size_t rows = size_t(header.stages)*n*header.trees*nodes;
+    const size_t leaves = size_t(n)*header.trees*nodes;
+    const size_t meanOffset = alignSize(sizeof(LBFHeader));
+    const size_t featsOffset = meanOffset + alignSize(n*2*sizeof(double));
+    const size_t thresholdsOffset = featsOffset + alignSize(rows*4*sizeof(float));
+    const size_t weightsOffset = thresholdsOffset + alignSize(rows*sizeof(int32_t));
+    const size_t weightsSize = leaves*2*n*(header.halfWeights ? sizeof(float16_t) : sizeof(float));
+    if (file->size() < weightsOffset + header.stages*weightsSize) {
+        LOGE("truncated binary model: %zu bytes", file->size());
+        return false;
+    }
+
+    // NOTES:
+    // Mats are headers of the read-only mapping, they must never be written
+    uchar* data = const_cast<uchar*>(file->data());
+    mTrees = header.trees;
+    mDepth = header.depth;
+    mLandmarks = n;
+    mNodes = nodes;
+    mMeanShape = Mat(n, 2, CV_64F, data + meanOffset);
+    mFeats = Mat(int(rows), 4, CV_32F, data + featsOffset);
+    mThresholds = Mat(int(rows), 1, CV_32S, data + thresholdsOffset);
+    mWeights.resize(header.stages);
+    for (int k = 0; k < header.stages; ++k) {
+        mWeights[k] = Mat(int(leaves), 2*n, header.halfWeights ? CV_16F : CV_32F, data + weightsOffset + k*weightsSize);
+    }
+    mFile = file;
+    setup(header.stages);
+    return true;
+}
+
+bool LBFModel::save(const string& modelFile) const {
+    if (empty()) {
+        return false;
+    }
+    FILE* fp = fopen(modelFile.c_str(), "wb");
+    if (!fp) {
+        LOGE("failed to create file: %s", modelFile.c_str());
+        return false;
+    }
+    LBFHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LBF_MAGIC, sizeof(LBF_MAGIC));
+    header.version = LBF_VERSION;
+    header.stages = mStages;
+    header.trees = mTrees;
+    header.depth = mDepth;
+    header.landmarks = mLandmarks;
+    header.halfWeights = halfWeights() ? 1 : 0;
+
+    // Each section is padded to the alignment
+    static const char padding[LBF_ALIGN] = {};
+    bool ok = true;
+    auto write = [&](const void* data, size_t size) {
+        ok = ok && fwrite(data, 1, size, fp) == size;
+        ok = ok && fwrite(padding, 1, alignSize(size) - size, fp) == alignSize(size) - size;
+    };
+    write(&header, sizeof(header));
+    write(mMeanShape.ptr(), mMeanShape.total()*mMeanShape.elemSize());
+    write(mFeats.ptr(), mFeats.total()*mFeats.elemSize());
+    write(mThresholds.ptr(), mThresholds.total()*mThresholds.elemSize());
+    // Weights of all stages are one section
+    for (const Mat& weights: mWeights) {
+        ok = ok && fwrite(weights.ptr(), 1, weights.total()*weights.elemSize(), fp) == weights.total()*weights.elemSize();
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {
+        LOGE("failed to write file: %s", modelFile.c_str());
+    }
+    return ok;
+}
+
+bool LBFModel::loadYAML(const string& modelFile) {
+    // Mats of a mapped model must not be reused as buffers
+    mStages = 0;
+    mMeanShape.release();
+    mFeats.release();
+    mThresholds.release();
+    mWeights.clear();
+    mFile.reset();
+    FileStorage fs(modelFile, FileStorage::READ);
+    if (!fs.isOpened()) {
+        LOGE("failed to open model file: %s", modelFile.c_str());
+        return false;
+    }
+    int stages = 0;
+    fs["stages_n"] >> stages;
+    fs["tree_n"] >> mTrees;
+    fs["tree_depth"] >> mDepth;
+    fs["n_landmarks"] >> mLandmarks;
+    fs["regressor_meanshape"] >> mMeanShape;
+    mNodes = 1 << (mDepth - 1);
+    if (stages <= 0 || mTrees <= 0 || mDepth <= 1 || mMeanShape.rows != mLandmarks || mMeanShape.cols != 2) {
+        LOGE("invalid model file: %s", modelFile.c_str());
+        return false;
+    }
+    mMeanShape.convertTo(mMeanShape, CV_64F);
+
+    // Random forests, each tree of each landmark of each stage
+    const int n = mLandmarks;
+    const int trees = stages*n*mTrees;
+    mFeats.create(trees*mNodes, 4, CV_32F);
+    mThresholds.create(trees*mNodes, 1, CV_32S);
+    Mat feats;
+    vector<int> thresholds;
+    for (int k = 0; k < stages; ++k) {
+        for (int i = 0; i < n; ++i) {
+            for (int j = 0; j < mTrees; ++j) {
+                const int row = ((k*n + i)*mTrees + j)*mNodes;
+                fs[format("tree_%d_%d_%d", k, i, j)] >> feats;
+                fs[format("thresholds_%d_%d_%d", k, i, j)] >> thresholds;
+                // FacemarkLBF allocates 1 << depth nodes per tree, but only the split nodes [1, mNodes) are used
+                if (feats.rows < mNodes || feats.cols != 4 || int(thresholds.size()) < mNodes) {
+                    LOGE("invalid tree %d_%d_%d of model file: %s", k, i, j, modelFile.c_str());
+                    return false;
+                }
+                Mat dst = mFeats.rowRange(row, row + mNodes);
+                feats.rowRange(0, mNodes).convertTo(dst, CV_32F);
+                copy(thresholds.begin(), thresholds.begin() + mNodes, mThresholds.ptr<int>(row));
+            }
+        }
+    }
+
+    // Global regression, transposed to leaf-major
+    mWeights.resize(stages);
+    Mat weights;
+    for (int k = 0; k < stages; ++k) {
+        fs[format("weights_%d", k)] >> weights;
+        if (weights.rows != 2*n || weights.cols != n*mTrees*mNodes) {
+            LOGE("invalid weights %d of model file: %s", k, modelFile.c_str());
+            return false;
+        }
+        transpose(weights, weights);
+        weights.convertTo(mWeights[k], CV_32F);
+    }
+
+    setup(stages);
+    LOGI("LBF model: stages=%d, trees=%d, depth=%d, landmarks=%d", mStages, mTrees, mDepth, mLandmarks);
+    return true;
+}
+
+void LBFModel::setHalfWeights() {
+    for (Mat& weights: mWeights) {
+        if (weights.depth() != CV_16F) {
+            // A mapped Mat isn't written, the converted weights are a new buffer
+            Mat half;
+            weights.convertTo(half, CV_16F);
+            weights = half;
+        }
+    }
+}
+
+void LBFModel::setup(int stages) {
+    const int n = mLandmarks;
+    // Mean shape is the target of every similarity transform
+    Scalar center = mean(mMeanShape.reshape(2));
+    mMeanCentered = mMeanShape.reshape(2) - center;
+    mMeanCentered = mMeanCentered.reshape(1);
+    mMeanNorm = 0;
+    for (int i = 0; i < n; ++i) {
+        double d = mMeanCentered.at<double>(i, 0) - mMeanCentered.at<double>(i, 1);
+        mMeanNorm += d*d;
+    }
+    mMeanNorm = sqrt(mMeanNorm/2);
+    mStages = stages;
+}
+
+// NOTES:
+// Similarity transform (scale & rotation) from shape to the mean shape, the same as FacemarkLBF:
+// the norm of a centered shape is sqrt(|covariance|) as given by calcCovarMatrix(..., COVAR_COLS),
+// which is sqrt(sum((x - y)^2)/2).
+static void similarityTransform(const Point2d* shape, const Mat& meanCentered, double meanNorm, int n,
+                                double& scale, double& cosTheta, double& sinTheta) {
+    double cx = 0, cy = 0;
+    for (int i = 0; i < n; ++i) {
+        cx += shape[i].x;
+        cy += shape[i].y;
+    }
+    cx /= n;
+    cy /= n;
+    double norm = 0, num = 0, den = 0;
+    for (int i = 0; i < n; ++i) {
+        double x = shape[i].x - cx;
+        double y = shape[i].y - cy;
+        const double* m = meanCentered.ptr<double>(i);
+        norm += (x - y)*(x - y);
+        num += y*m[0] - x*m[1];
+        den += x*m[0] + y*m[1];
+    }
+    norm = sqrt(norm/2);
+    scale = norm/meanNorm;
+    // num & den are divided by both norms in FacemarkLBF, which is cancelled out by the normalization
+    double r = sqrt(num*num + den*den);
+    sinTheta = r > 0 ? num/r : 0;
+    cosTheta = r > 0 ? den/r : 1;
+}
+
+// dst += src, n floats
+static void addRow(const float* src, float* dst, int n) {
+    int i = 0;
+#if CV_SIMD128
+    for (; i <= n - 8; i += 8) {
+        v_store(dst + i, v_load(dst + i) + v_load(src + i));
+        v_store(dst + i + 4, v_load(dst + i + 4) + v_load(src + i + 4));
+    }
+    for (; i <= n - 4; i += 4) {
+        v_store(dst + i, v_load(dst + i) + v_load(src + i));
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] += src[i];
+    }
+}
+
+// dst += src, n FP16 expanded to float
+static void addRow(const float16_t* src, float* dst, int n) {
+    int i = 0;
+#if CV_SIMD128
+    for (; i <= n - 8; i += 8) {
+        v_store(dst + i, v_load(dst + i) + v_load_expand(src + i));
+        v_store(dst + i + 4, v_load(dst + i + 4) + v_load_expand(src + i + 4));
+    }
+    for (; i <= n - 4; i += 4) {
+        v_store(dst + i, v_load(dst + i) + v_load_expand(src + i));
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] += float(src[i]);
+    }
+}
+
+// NOTES:
+// Like FacemarkLBF, the face is fitted within a crop region of twice the face box size,
+// pixels are sampled in the crop region only.
+Rect LBFModel::sampleRegion(const Rect& face, const Size& imageSize) {
+    const int minX = max(0, face.x - face.width/2);
+    const int minY = max(0, face.y - face.height/2);
+    const int maxX = min(imageSize.width - 1, face.x + face.width + face.width/2);
+    const int maxY = min(imageSize.height - 1, face.y + face.height + face.height/2);
+    return Rect(minX, minY, max(1, maxX - minX), max(1, maxY - minY));
+}
+
+void LBFModel::fit(const Mat& gray, const Rect& face, vector<Point2f>& landmarks,
+                   const vector<Point2f>* initial, int firstStage, int lastStage) const {
+    CV_Assert(gray.type() == CV_8UC1 && !empty());
+    const int n = mLandmarks;
+    firstStage = max(0, firstStage);
+    lastStage = min(mStages, lastStage);
+
+    const Rect region = sampleRegion(face, gray.size());
+    const Mat crop = gray(region);
+    const int minX = region.x;
+    const int minY = region.y;
+    // Face box in crop coordinates: center & half size
+    const double xScale = face.width/2.0;
+    const double yScale = face.height/2.0;
+    const double xCenter = face.x - minX + xScale;
+    const double yCenter = face.y - minY + yScale;
+
+    // Current shape in crop coordinates, and relative to face box
+    AutoBuffer<Point2d, 128> shape(n), relative(n);
+    if (initial && int(initial->size()) == n) {
+        for (int i = 0; i < n; ++i) {
+            shape[i] = Point2d((*initial)[i].x - minX, (*initial)[i].y - minY);
+        }
+    } else {
+        for (int i = 0; i < n; ++i) {
+            const double* m = mMeanShape.ptr<double>(i);
+            shape[i] = Point2d(m[0]*xScale + xCenter, m[1]*yScale + yCenter);
+        }
+    }
+
+    const int cols = 2*n;
+    AutoBuffer<float, 256> delta(cols);
+    for (int k = firstStage; k < lastStage; ++k) {
+        for (int i = 0; i < n; ++i) {
+            relative[i] = Point2d((shape[i].x - xCenter)/xScale, (shape[i].y - yCenter)/yScale);
+        }
+        double scale, c, s;
+        similarityTransform(relative.data(), mMeanCentered, mMeanNorm, n, scale, c, s);
+
+        // Local binary features: each tree gives one leaf, the weights of the leaves are summed up.
+        // A feature (fx, fy) of landmark i is sampled at (ax*fx - bx*fy + px, by*fx + ay*fy + py)
+        const float ax = float(scale*c*xScale), bx = float(scale*s*xScale);
+        const float ay = float(scale*c*yScale), by = float(scale*s*yScale);
+        const float maxX = float(crop.cols - 1), maxY = float(crop.rows - 1);
+        fill(delta.data(), delta.data() + cols, 0.0f);
+        const Mat& weights = mWeights[k];
+        const bool half = weights.depth() == CV_16F;
+        for (int i = 0; i < n; ++i) {
+            const float px = float(shape[i].x);
+            const float py = float(shape[i].y);
+            for (int j = 0; j < mTrees; ++j) {
+                const int tree = (k*n + i)*mTrees + j;
+                const float* feats = mFeats.ptr<float>(tree*mNodes);
+                const int* thresholds = mThresholds.ptr<int>(tree*mNodes);
+                int idx = 1;
+                for (int d = 1; d < mDepth; ++d) {
+                    const float* f = feats + idx*4;
+                    const float x1 = max(0.0f, min(maxX, ax*f[0] - bx*f[1] + px));
+                    const float y1 = max(0.0f, min(maxY, by*f[0] + ay*f[1] + py));
+                    const float x2 = max(0.0f, min(maxX, ax*f[2] - bx*f[3] + px));
+                    const float y2 = max(0.0f, min(maxY, by*f[2] + ay*f[3] + py));
+                    int density = crop.at<uchar>(int(y1), int(x1)) - crop.at<uchar>(int(y2), int(x2));
+                    idx = 2*idx + (density < thresholds[idx] ? 0 : 1);
+                }
+                // Leaf code is the path of the tree
+                const int leaf = tree%(n*mTrees)*mNodes + idx - mNodes;
+                if (half) {
+                    addRow(weights.ptr<float16_t>(leaf), delta.data(), cols);
+                } else {
+                    addRow(weights.ptr<float>(leaf), delta.data(), cols);
+                }
+            }
+        }
+
+        // Shape increment is in mean shape space, transform it back by the similarity transform
+        for (int i = 0; i < n; ++i) {
+            double dx = delta[2*i];
+            double dy = delta[2*i + 1];
+            shape[i].x += scale*(dx*c - dy*s)*xScale;
+            shape[i].y += scale*(dx*s + dy*c)*yScale;
+        }
+    }
+
+    landmarks.resize(n);
+    for (int i = 0; i < n; ++i) {
+        landmarks[i] = Point2f(float(shape[i].x + minX), float(shape[i].y + minY));
+    }
+}
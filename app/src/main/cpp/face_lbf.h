@@ -0,0 +1,95 @@
+#ifndef FACE_FACE_LBF_H
+#define FACE_FACE_LBF_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "mapped_file.h"
+
+// NOTES:
+// Face alignment by Local Binary Features (LBF) cascaded regression.
+// The model is the one trained by cv::face::FacemarkLBF (lbfmodel.yaml), and fitting a gray image gives the
+// same result as FacemarkLBF::fit() of that gray image up to float rounding (see face_bench -l), but:
+//  - model data is kept in flat float Mats, global regression weights are transposed (leaf-major),
+//    so each binary feature adds one contiguous row to the shape increment
+//  - fitting can start from a given shape (e.g. landmarks of last frame) instead of the mean shape,
+//    and run only some of the cascade stages
+//  - fitting is re-entrant (const), so faces can be fitted in parallel
+//  - pixel-difference features are positioned in float (the similarity transform of a stage is folded into
+//    4 coefficients), and leaf weight rows are accumulated with SIMD
+//  - global regression weights can be stored in FP16 (setHalfWeights()): half the memory, and half the
+//    memory bandwidth of fitting, which is dominated by reading one scattered weight row per tree.
+//    They're expanded to float while accumulated, landmarks move by a small fraction of a pixel
+// FacemarkLBF::fit() converts a color image by COLOR_BGR2GRAY, so an RGBA frame given as is gets the R & B
+// weights swapped. FaceLandmark converts RGBA by COLOR_RGBA2GRAY instead (true luma, like the Y plane of a
+// camera frame), so landmarks of a color frame may differ slightly from FacemarkLBF::fit() of that frame.
+//
+// Besides lbfmodel.yaml (tens of MB of text), the model can be loaded from a binary file converted by save()
+// (see face_convert), which is memory mapped and used in place: no parsing, no copy into the heap.
+// Binary layout (native byte order), each section starts at a multiple of 64 bytes:
+//   header:     LBFHeader
+//   mean shape: double[n*2]
+//   feats:      float[rows*4], rows = stages*n*trees*nodes
+//   thresholds: int32[rows]
+//   weights:    float[stages*(n*trees*nodes)*2n], or FP16 if header.halfWeights is set
+class LBFModel {
+public:
+    // Load lbfmodel.yaml or a binary model (by its magic)
+    bool load(const std::string& modelFile);
+    // Save as binary model
+    bool save(const std::string& modelFile) const;
+    bool empty() const { return mStages == 0; }
+    int stages() const { return mStages; }
+    int landmarks() const { return mLandmarks; }
+    // Convert the regression weights to FP16, save() keeps them in FP16
+    void setHalfWeights();
+    bool halfWeights() const { return !mWeights.empty() && mWeights[0].depth() == CV_16F; }
+
+    // Fit landmarks of face (in gray image), with cascade stages [firstStage, lastStage).
+    // If initial is not null, it's the initial shape (image coordinates), otherwise the mean shape is used.
+    void fit(const cv::Mat& gray, const cv::Rect& face, std::vector<cv::Point2f>& landmarks,
+             const std::vector<cv::Point2f>* initial, int firstStage, int lastStage) const;
+    // Region of a gray image of size imageSize where the pixels of face are sampled by fit()
+    static cv::Rect sampleRegion(const cv::Rect& face, const cv::Size& imageSize);
+
+private:
+    struct LBFHeader {
+        char magic[4];
+        int32_t version;
+        int32_t stages;
+        int32_t trees;
+        int32_t depth;
+        int32_t landmarks;
+        // Weights are FP16 if set (0 in files saved before FP16 weights)
+        int32_t halfWeights;
+        int32_t reserved[9];
+    };
+
+    bool loadYAML(const std::string& modelFile);
+    bool loadBinary(const std::shared_ptr<MappedFile>& file);
+    // Derived data of mean shape, once the model is loaded
+    void setup(int stages);
+
+    // Mapping of binary model, model Mats point into it
+    std::shared_ptr<MappedFile> mFile;
+    int mStages = 0;
+    int mTrees = 0;
+    int mDepth = 0;
+    int mLandmarks = 0;
+    // Nodes (and leaves) of each tree
+    int mNodes = 0;
+    // Mean shape relative to face box: n x 2 (CV_64F), and its centered version & norm for similarity transform
+    cv::Mat mMeanShape;
+    cv::Mat mMeanCentered;
+    double mMeanNorm = 0;
+    // Split features (x1, y1, x2, y2) & thresholds of all nodes:
+    // row ((stage*n + landmark)*trees + tree)*nodes + node
+    cv::Mat mFeats;
+    cv::Mat mThresholds;
+    // Global regression weights of each stage: (n*trees*nodes) leaves x 2n (CV_32F or CV_16F)
+    std::vector<cv::Mat> mWeights;
+};
+
+#endif //FACE_FACE_LBF_H
@@ -0,0 +1,101 @@
+#include <atomic>
+#include "face_metrics.h"
+
+using namespace std;
+using namespace cv;
+
+namespace {
+
+struct HistogramData {
+    atomic<int64> count;
+    atomic<int64> sum;
+    atomic<int64> max;
+    atomic<int64> buckets[FaceMetrics::BUCKETS];
+};
+
+// Zero-initialized statics, no constructor runs
+HistogramData gHistograms[FaceMetrics::HISTOGRAMS];
+atomic<int64> gCounters[FaceMetrics::COUNTERS];
+atomic<int64> gWindowStart(0);
+
+const char* const HISTOGRAM_NAMES[] = {
+    "convert", "blob", "forward", "parse", "landmark", "chips", "jni", "draw", "frame", "latency", "faces_per_frame"
+};
+const char* const COUNTER_NAMES[] = {
+    "frames", "frames_dropped", "frames_skipped", "faces", "allocations", "allocated_bytes"
+};
+static_assert(sizeof(HISTOGRAM_NAMES)/sizeof(HISTOGRAM_NAMES[0]) == FaceMetrics::HISTOGRAMS, "histogram names");
+static_assert(sizeof(COUNTER_NAMES)/sizeof(COUNTER_NAMES[0]) == FaceMetrics::COUNTERS, "counter names");
+
+int64 nowMs() {
+    return int64(getTickCount()*1000.0/getTickFrequency());
+}
+
+int bucket(int64 value) {
+    if (value <= 0) {
+        return 0;
+    }
+    // Bit length of value, i.e. value in [2^(k-1), 2^k)
+    const int k = 64 - __builtin_clzll(uint64_t(value));
+    return k < FaceMetrics::BUCKETS ? k : FaceMetrics::BUCKETS - 1;
+}
+
+int64 take(atomic<int64>& value, bool reset) {
+    return reset ? value.exchange(0, memory_order_relaxed) : value.load(memory_order_relaxed);
+}
+
+}
+
+void FaceMetrics::record(Histogram histogram, int64 value) {
+    HistogramData& h = gHistograms[histogram];
+    h.count.fetch_add(1, memory_order_relaxed);
+    h.sum.fetch_add(value, memory_order_relaxed);
+    h.buckets[bucket(value)].fetch_add(1, memory_order_relaxed);
+    int64 max = h.max.load(memory_order_relaxed);
+    while (value > max && !h.max.compare_exchange_weak(max, value, memory_order_relaxed)) {
+    }
+}
+
+void FaceMetrics::add(Counter counter, int64 n) {
+    gCounters[counter].fetch_add(n, memory_order_relaxed);
+}
+
+void FaceMetrics::snapshot(vector<int64>& packed, bool reset) {
+    packed.resize(packedSize());
+    int64* p = packed.data();
+    const int64 now = nowMs();
+    int64 start = gWindowStart.load(memory_order_relaxed);
+    if (start == 0) {
+        // The first window starts at the first snapshot
+        gWindowStart.compare_exchange_strong(start, now, memory_order_relaxed);
+        start = gWindowStart.load(memory_order_relaxed);
+    }
+    *p++ = VERSION;
+    *p++ = HISTOGRAMS;
+    *p++ = BUCKETS;
+    *p++ = COUNTERS;
+    *p++ = start;
+    *p++ = now - start;
+    for (HistogramData& h: gHistograms) {
+        *p++ = take(h.count, reset);
+        *p++ = take(h.sum, reset);
+        *p++ = take(h.max, reset);
+        for (atomic<int64>& b: h.buckets) {
+            *p++ = take(b, reset);
+        }
+    }
+    for (atomic<int64>& counter: gCounters) {
+        *p++ = take(counter, reset);
+    }
+    if (reset) {
+        gWindowStart.store(now, memory_order_relaxed);
+    }
+}
+
+const char* FaceMetrics::name(Histogram histogram) {
+    return HISTOGRAM_NAMES[histogram];
+}
+
+const char* FaceMetrics::name(Counter counter) {
+    return COUNTER_NAMES[counter];
+}
@@ -0,0 +1,92 @@
+#ifndef FACE_FACE_METRICS_H
+#define FACE_FACE_METRICS_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+// NOTES:
+// Always-on aggregate metrics of the face pipeline, process wide: latency histograms of the stages and counters
+// of frames, faces & allocations, cheap enough to be collected in the field and shipped to dashboards.
+// Every histogram & counter is a fixed set of atomics updated with relaxed atomic adds (no lock, no allocation).
+// Histograms have fixed log2 buckets: bucket 0 counts values < 1, bucket k counts [2^(k-1), 2^k), the last
+// bucket counts everything above. Latencies are in microseconds, FACES_PER_FRAME in faces.
+// snapshot() packs all of them into an int64 buffer, and optionally resets them to start a new window
+// (an update racing with the reset may land in either window):
+//   header:     { VERSION, HISTOGRAMS, BUCKETS, COUNTERS, window start (ms, steady clock), window length (ms) }
+//   histograms: HISTOGRAMS x { count, sum, max, buckets[BUCKETS] }
+//   counters:   COUNTERS values
+class FaceMetrics {
+public:
+    enum Histogram {
+        // Color conversion: NV21/YUV/RGBA frame transform, RGBA to gray of landmark fitting
+        CONVERT,
+        // Network input blob
+        BLOB,
+        // Network forward
+        FORWARD,
+        // Network output parsing & NMS
+        PARSE,
+        // Landmark fitting of all faces of a frame
+        LANDMARK,
+        // Aligned chips of all faces of a frame, see FaceChips
+        CHIPS,
+        // JNI marshalling of results (Java arrays, packed buffers)
+        JNI,
+        // Overlay composition into the window
+        DRAW,
+        // FaceDetector::analyze()/process() of a frame
+        FRAME,
+        // End-to-end latency of a pipeline frame
+        LATENCY,
+        FACES_PER_FRAME,
+        HISTOGRAMS
+    };
+    enum Counter {
+        // Frames processed by analyze()/process() or the pipeline
+        FRAMES,
+        // Frames dropped by the pipeline (a newer frame replaced them)
+        FRAMES_DROPPED,
+        // Frames skipped by the latency-budget governor
+        FRAMES_SKIPPED,
+        FACES,
+        // Buffer (re)allocations of frame processing (see FrameArena, a lower bound) & NativeBuffer heap blocks,
+        // and their bytes
+        ALLOCATIONS,
+        ALLOCATED_BYTES,
+        COUNTERS
+    };
+    static constexpr int VERSION = 1;
+    static constexpr int BUCKETS = 24;
+    static constexpr int HEADER_WORDS = 6;
+    static constexpr int HISTOGRAM_WORDS = 3 + BUCKETS;
+
+    static void record(Histogram histogram, int64 value);
+    static void add(Counter counter, int64 n = 1);
+    // Pack all metrics into packed (resized to packedSize()), then reset them if reset is set
+    static void snapshot(std::vector<int64>& packed, bool reset);
+    static size_t packedSize() { return HEADER_WORDS + HISTOGRAMS*HISTOGRAM_WORDS + COUNTERS; }
+    static const char* name(Histogram histogram);
+    static const char* name(Counter counter);
+};
+
+// Records the lifetime of the scope (microseconds) into a histogram
+class MetricScope {
+public:
+    explicit MetricScope(FaceMetrics::Histogram histogram) : mHistogram(histogram), mStart(cv::getTickCount()) {}
+    ~MetricScope() {
+        static const double usPerTick = 1e6/cv::getTickFrequency();
+        FaceMetrics::record(mHistogram, int64((cv::getTickCount() - mStart)*usPerTick));
+    }
+    MetricScope(const MetricScope&) = delete;
+    MetricScope& operator=(const MetricScope&) = delete;
+
+private:
+    FaceMetrics::Histogram mHistogram;
+    int64 mStart;
+};
+
+#define FACE_METRIC_CONCAT_(a, b)   a##b
+#define FACE_METRIC_CONCAT(a, b)    FACE_METRIC_CONCAT_(a, b)
+#define FACE_METRIC_SCOPE(histogram) MetricScope FACE_METRIC_CONCAT(metricScope, __LINE__)(FaceMetrics::histogram)
+
+#endif //FACE_FACE_METRICS_H
@@ -0,0 +1,149 @@
+#include <cstdio>
+#include <opencv2/imgproc.hpp>
+#include "face_overlay.h"
+#include "face_trace.h"
+
+using namespace std;
+using namespace cv;
+
+static const int labelFont = FONT_HERSHEY_SIMPLEX;
+static const double labelScale = 0.5;
+static const Scalar boxColor(0, 255, 0, 255);
+static const Scalar labelColor(0, 0, 0, 255);
+static const Scalar labelBackground(255, 255, 255, 255);
+
+void FaceOverlay::update(const vector<Rect>& boxes, const vector<float>& scores, const vector<int>* ids,
+                         const vector<vector<Point2f>>& landmarks) {
+    lock_guard<mutex> lock(mMutex);
+    // Buffers of the pending results are reused
+    mPendingBoxes.assign(boxes.begin(), boxes.end());
+    mPendingScores.assign(scores.begin(), scores.end());
+    if (ids) {
+        mPendingIds.assign(ids->begin(), ids->end());
+    } else {
+        mPendingIds.clear();
+    }
+    mPendingMarks.resize(landmarks.size());
+    for (size_t i = 0; i < landmarks.size(); ++i) {
+        mPendingMarks[i].assign(landmarks[i].begin(), landmarks[i].end());
+    }
+    mUpdated = true;
+}
+
+void FaceOverlay::clear() {
+    lock_guard<mutex> lock(mMutex);
+    mPendingBoxes.clear();
+    mPendingScores.clear();
+    mPendingIds.clear();
+    mPendingMarks.clear();
+    mUpdated = true;
+}
+
+const FaceOverlay::Letterbox& FaceOverlay::layout(const Size& frameSize, const Size& displaySize) {
+    if (frameSize == mLetterbox.frameSize && displaySize == mLetterbox.displaySize) {
+        return mLetterbox;
+    }
+    mLetterbox.frameSize = frameSize;
+    mLetterbox.displaySize = displaySize;
+    if (frameSize.area() == 0 || displaySize.area() == 0) {
+        mLetterbox.area = Rect();
+        mLetterbox.scale = 0;
+    } else if (displaySize.width*frameSize.height > displaySize.height*frameSize.width) {
+        // Bars on the left & right
+        mLetterbox.scale = displaySize.height/float(frameSize.height);
+        int w = min(int(mLetterbox.scale*frameSize.width), displaySize.width);
+        mLetterbox.area = Rect((displaySize.width - w)/2, 0, w, displaySize.height);
+    } else {
+        // Bars on the top & bottom
+        mLetterbox.scale = displaySize.width/float(frameSize.width);
+        int h = min(int(mLetterbox.scale*frameSize.height), displaySize.height);
+        mLetterbox.area = Rect(0, (displaySize.height - h)/2, displaySize.width, h);
+    }
+    return mLetterbox;
+}
+
+const FaceOverlay::Glyph& FaceOverlay::glyph(char c) {
+    if (mGlyphs.empty()) {
+        mGlyphs.resize(128);
+        // Text height & baseline of Hershey fonts don't depend on the text
+        int baseline = 0;
+        mLabelHeight = getTextSize("0", labelFont, labelScale, 1, &baseline).height;
+        mLabelBaseline = baseline;
+    }
+    if (c < ' ' || c > '~') {
+        c = ' ';
+    }
+    Glyph& glyph = mGlyphs[int(c)];
+    if (glyph.advance == 0) {
+        const char text[] = { c, 0 };
+        int baseline = 0;
+        glyph.advance = max(1, getTextSize(text, labelFont, labelScale, 1, &baseline).width);
+        glyph.mask = Mat::zeros(mLabelHeight + mLabelBaseline, glyph.advance, CV_8UC1);
+        putText(glyph.mask, text, Point(0, mLabelHeight), labelFont, labelScale, Scalar::all(255));
+    }
+    return glyph;
+}
+
+void FaceOverlay::drawLabel(Mat& display, const char* label, Point origin) {
+    int width = 0;
+    for (const char* c = label; *c; ++c) {
+        width += glyph(*c).advance;
+    }
+    const Rect bounds(0, 0, display.cols, display.rows);
+    origin.y = max(origin.y, mLabelHeight);
+    rectangle(display, Point(origin.x, origin.y - mLabelHeight), Point(origin.x + width, origin.y + mLabelBaseline),
+              labelBackground, FILLED);
+    int x = origin.x;
+    for (const char* c = label; *c; ++c) {
+        const Glyph& g = glyph(*c);
+        Rect rect(x, origin.y - mLabelHeight, g.mask.cols, g.mask.rows);
+        Rect visible = rect & bounds;
+        if (!visible.empty()) {
+            display(visible).setTo(labelColor, g.mask(visible - rect.tl()));
+        }
+        x += g.advance;
+    }
+}
+
+void FaceOverlay::compose(const Mat& frame, Mat& display) {
+    FACE_TRACE_SCOPE("compose");
+    const Letterbox& letterbox = layout(frame.size(), display.size());
+    if (letterbox.area.empty()) {
+        return;
+    }
+    // Overlays are drawn into the letterbox area, so they're clipped to the frame
+    Mat area = display(letterbox.area);
+    resize(frame, area, area.size());
+
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (mUpdated) {
+            mBoxes.swap(mPendingBoxes);
+            mScores.swap(mPendingScores);
+            mIds.swap(mPendingIds);
+            mMarks.swap(mPendingMarks);
+            mUpdated = false;
+        }
+    }
+
+    // Labels are formatted into a stack buffer, short strings don't allocate
+    char label[32];
+    const float scale = letterbox.scale;
+    for (size_t i = 0; i < mBoxes.size(); ++i) {
+        const Rect& box = mBoxes[i];
+        Point tl(cvRound(box.x*scale), cvRound(box.y*scale));
+        Point br(cvRound((box.x + box.width)*scale), cvRound((box.y + box.height)*scale));
+        rectangle(area, tl, br, boxColor);
+        if (i < mIds.size()) {
+            snprintf(label, sizeof(label), "#%d %.2f", mIds[i], i < mScores.size() ? mScores[i] : 0.0f);
+        } else {
+            snprintf(label, sizeof(label), "%.2f", i < mScores.size() ? mScores[i] : 0.0f);
+        }
+        drawLabel(area, label, tl);
+        if (i < mMarks.size()) {
+            for (const Point2f& p: mMarks[i]) {
+                circle(area, Point(cvRound(p.x*scale), cvRound(p.y*scale)), 2, boxColor, FILLED);
+            }
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef FACE_FACE_OVERLAY_H
+#define FACE_FACE_OVERLAY_H
+
+#include <mutex>
+#include <vector>
+#include <opencv2/core.hpp>
+
+// NOTES:
+// Face overlays (boxes, labels, landmarks) rendered in display space while the frame is blitted,
+// instead of being drawn into the input frame: the input frame stays untouched for other consumers,
+// and overlays only write their own pixels of the display (no extra full-frame write).
+// The frame is scaled into the letterboxed (aspect-preserving, centered) area of the display by one
+// cv::resize (vectorized), the letterbox geometry is cached until the frame or display size changes.
+// Label glyphs are rendered once into masks and blitted with Mat::setTo(color, mask).
+// Results are updated by the analysis thread and composed by the display thread, update() is cheap
+// (buffers are reused) and compose() picks the latest results.
+// Works on any RGBA Mat, the window buffer is just wrapped into a Mat (see nativeDraw).
+class FaceOverlay {
+public:
+    // Area of the display the frame is scaled into
+    struct Letterbox {
+        cv::Size frameSize;
+        cv::Size displaySize;
+        cv::Rect area;
+        float scale = 0;
+    };
+
+    FaceOverlay() {}
+    FaceOverlay(const FaceOverlay&) = delete;
+    FaceOverlay& operator=(const FaceOverlay&) = delete;
+
+    // Results of the latest analyzed frame in frame coordinates, ids (optional) are tracking ids.
+    // landmarks may be empty
+    void update(const std::vector<cv::Rect>& boxes, const std::vector<float>& scores, const std::vector<int>* ids,
+                const std::vector<std::vector<cv::Point2f>>& landmarks);
+    void clear();
+
+    // Scale RGBA frame into display (RGBA) and draw the latest results on top
+    void compose(const cv::Mat& frame, cv::Mat& display);
+    // Letterbox of the last compose()
+    const Letterbox& letterbox() const { return mLetterbox; }
+
+private:
+    struct Glyph {
+        cv::Mat mask;
+        int advance = 0;
+    };
+
+    const Letterbox& layout(const cv::Size& frameSize, const cv::Size& displaySize);
+    void drawLabel(cv::Mat& display, const char* label, cv::Point origin);
+    const Glyph& glyph(char c);
+
+    // Latest results, written by update()
+    std::mutex mMutex;
+    bool mUpdated = false;
+    std::vector<cv::Rect> mPendingBoxes;
+    std::vector<float> mPendingScores;
+    std::vector<int> mPendingIds;
+    std::vector<std::vector<cv::Point2f>> mPendingMarks;
+    // Results being drawn, owned by the display thread
+    std::vector<cv::Rect> mBoxes;
+    std::vector<float> mScores;
+    std::vector<int> mIds;
+    std::vector<std::vector<cv::Point2f>> mMarks;
+
+    Letterbox mLetterbox;
+    // Glyphs of printable ASCII, rendered on first use
+    std::vector<Glyph> mGlyphs;
+    int mLabelHeight = 0;
+    int mLabelBaseline = 0;
+};
+
+#endif //FACE_FACE_OVERLAY_H
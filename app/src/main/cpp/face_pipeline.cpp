@@ -0,0 +1,234 @@
+#include <cstdio>
+#include <pthread.h>
+#include <opencv2/imgproc.hpp>
+#include "log.h"
+#include "face_detector.h"
+#include "face_metrics.h"
+#include "face_pipeline.h"
+#include "face_trace.h"
+
+#undef  LOG_TAG
+#define LOG_TAG "FacePipeline"
+
+using namespace std;
+using namespace cv;
+
+FacePipeline::FacePipeline(FaceDetector* detector)
+    : mFaceDetector(detector), mLatest(nullptr), mRunning(false), mNextId(0), mDropped(0) {
+    for (int i = 0; i < POOL_SIZE; ++i) {
+        mPool[i] = nullptr;
+    }
+}
+
+FacePipeline::~FacePipeline() {
+    stop();
+    delete mLatest;
+    for (int i = 0; i < POOL_SIZE; ++i) {
+        delete mPool[i].exchange(nullptr);
+    }
+}
+
+void FacePipeline::start() {
+    if (mRunning.exchange(true)) {
+        return;
+    }
+    for (int i = 0; i < STAGES; ++i) {
+        mStages[i].thread = thread(&FacePipeline::run, this, i);
+    }
+}
+
+void FacePipeline::stop() {
+    if (!mRunning.exchange(false)) {
+        return;
+    }
+    for (int i = 0; i < STAGES; ++i) {
+        {
+            lock_guard<mutex> lock(mStages[i].mutex);
+        }
+        mStages[i].cond.notify_all();
+    }
+    for (int i = 0; i < STAGES; ++i) {
+        mStages[i].thread.join();
+        recycle(mStages[i].input.take());
+    }
+}
+
+void FacePipeline::setCallback(const Callback& callback) {
+    lock_guard<mutex> lock(mCallbackMutex);
+    mCallback = callback;
+}
+
+int64 FacePipeline::submit(const Mat& rgba) {
+    FaceFrame* frame = obtain();
+    frame->id = mNextId++;
+    frame->timestamp = getTickCount();
+    FACE_TRACE_FRAME(frame->id);
+    FACE_TRACE_SCOPE("capture");
+    rgba.copyTo(frame->input);
+    push(mStages[CONVERT], frame);
+    return frame->id;
+}
+
+int64 FacePipeline::submitNV21(const uchar* nv21, int width, int height) {
+    FaceFrame* frame = obtain();
+    frame->id = mNextId++;
+    frame->timestamp = getTickCount();
+    FACE_TRACE_FRAME(frame->id);
+    FACE_TRACE_SCOPE("capture");
+    Mat(height + height/2, width, CV_8UC1, (void*)nv21).copyTo(frame->input);
+    push(mStages[CONVERT], frame);
+    return frame->id;
+}
+
+int64 FacePipeline::poll(Mat* image, vector<Rect>* faces, vector<vector<Point2f>>* landmarks) {
+    // NOTES:
+    // The latest result is kept, so polling faster than the pipeline still returns the last processed frame
+    FaceFrame* frame = mResult.take();
+    if (frame) {
+        recycle(mLatest);
+        mLatest = frame;
+    }
+    if (!mLatest) {
+        return -1;
+    }
+    if (image) {
+        mLatest->image.copyTo(*image);
+    }
+    if (faces) {
+        *faces = mLatest->faces;
+    }
+    if (landmarks) {
+        *landmarks = mLatest->landmarks;
+    }
+    return mLatest->id;
+}
+
+// Stage names, also the thread names & trace event names
+static const char* const STAGE_NAMES[] = { "convert", "detect", "landmark", "overlay" };
+
+void FacePipeline::run(int stage) {
+    // Thread names are at most 15 characters
+    char name[16];
+    snprintf(name, sizeof(name), "face-%s", STAGE_NAMES[stage]);
+    pthread_setname_np(pthread_self(), name);
+    LOGI("stage %d started", stage);
+    FaceFrame* frame;
+    while ((frame = wait(mStages[stage])) != nullptr) {
+        process(stage, frame);
+        if (stage + 1 < STAGES) {
+            push(mStages[stage + 1], frame);
+        } else {
+            publish(frame);
+        }
+    }
+    LOGI("stage %d stopped", stage);
+}
+
+void FacePipeline::process(int stage, FaceFrame* frame) {
+    FACE_TRACE_FRAME(frame->id);
+    FACE_TRACE_SCOPE(STAGE_NAMES[stage]);
+    switch (stage) {
+    case CONVERT:
+        if (frame->input.type() == CV_8UC1) {
+            FACE_METRIC_SCOPE(CONVERT);
+            cvtColor(frame->input, frame->image, COLOR_YUV2RGBA_NV21);
+        } else {
+            // Swap buffers rather than copying, input buffer is reused by the next submit of this frame
+            swap(frame->input, frame->image);
+        }
+        break;
+    case DETECT:
+        frame->faces.clear();
+        frame->confidences.clear();
+        if (mFaceDetector->isTracking()) {
+            vector<FaceTracker::Track> tracks;
+            mFaceDetector->track(frame->image, tracks);
+            for (const FaceTracker::Track& t: tracks) {
+                frame->faces.push_back(t.box);
+                frame->confidences.push_back(t.confidence);
+            }
+        } else {
+            mFaceDetector->detect(frame->image, frame->faces, frame->confidences);
+        }
+        break;
+    case LANDMARK:
+        // All faces of the frame are fitted in parallel
+        mFaceDetector->fit(frame->image, frame->faces, frame->landmarks);
+        break;
+    case OVERLAY:
+        // Results are drawn at display time, the frame itself is left untouched
+        mFaceDetector->overlay().update(frame->faces, frame->confidences, nullptr, frame->landmarks);
+        break;
+    default:
+        break;
+    }
+}
+
+FaceFrame* FacePipeline::wait(Stage& stage) {
+    FaceFrame* frame = stage.input.take();
+    while (!frame && mRunning) {
+        unique_lock<mutex> lock(stage.mutex);
+        stage.cond.wait(lock, [&] { return !stage.input.empty() || !mRunning; });
+        frame = stage.input.take();
+    }
+    return frame;
+}
+
+void FacePipeline::push(Stage& stage, FaceFrame* frame) {
+    FaceFrame* dropped = stage.input.put(frame);
+    if (dropped) {
+        ++mDropped;
+        FaceMetrics::add(FaceMetrics::FRAMES_DROPPED);
+        recycle(dropped);
+    }
+    // NOTES:
+    // The mutex is only used for sleeping/waking up, taking it before notifying avoids a lost wake-up
+    {
+        lock_guard<mutex> lock(stage.mutex);
+    }
+    stage.cond.notify_one();
+}
+
+void FacePipeline::publish(FaceFrame* frame) {
+    {
+        lock_guard<mutex> lock(mCallbackMutex);
+        if (mCallback) {
+            mCallback(*frame);
+        }
+    }
+    const double latencyMs = 1000.0*(getTickCount() - frame->timestamp)/getTickFrequency();
+    LOGD("frame %lld: faces=%d, latency=%.1fms", (long long)frame->id, (int)frame->faces.size(), latencyMs);
+    FaceMetrics::record(FaceMetrics::LATENCY, int64(latencyMs*1000));
+    FaceMetrics::record(FaceMetrics::FACES_PER_FRAME, int(frame->faces.size()));
+    FaceMetrics::add(FaceMetrics::FRAMES);
+    FaceMetrics::add(FaceMetrics::FACES, int(frame->faces.size()));
+    FaceFrame* dropped = mResult.put(frame);
+    if (dropped) {
+        ++mDropped;
+        FaceMetrics::add(FaceMetrics::FRAMES_DROPPED);
+        recycle(dropped);
+    }
+}
+
+FaceFrame* FacePipeline::obtain() {
+    for (int i = 0; i < POOL_SIZE; ++i) {
+        FaceFrame* frame = mPool[i].exchange(nullptr);
+        if (frame) {
+            return frame;
+        }
+    }
+    return new FaceFrame();
+}
+
+void FacePipeline::recycle(FaceFrame* frame) {
+    if (!frame) {
+        return;
+    }
+    for (int i = 0; i < POOL_SIZE; ++i) {
+        FaceFrame* expected = nullptr;
+        if (mPool[i].compare_exchange_strong(expected, frame)) {
+            return;
+        }
+    }
+    delete frame;
+}
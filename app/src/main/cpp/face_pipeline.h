@@ -0,0 +1,104 @@
+#ifndef FACE_FACE_PIPELINE_H
+#define FACE_FACE_PIPELINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+
+class FaceDetector;
+
+// Frame flowing through the pipeline stages
+struct FaceFrame {
+    int64 id;
+    // Tick count when the frame is submitted
+    int64 timestamp;
+    // Submitted data: RGBA (CV_8UC4) or NV21 (CV_8UC1, height*3/2 rows)
+    cv::Mat input;
+    // RGBA image, never drawn: the overlay stage passes the results to FaceDetector::overlay()
+    cv::Mat image;
+    std::vector<cv::Rect> faces;
+    std::vector<float> confidences;
+    std::vector<std::vector<cv::Point2f>> landmarks;
+};
+
+// NOTES:
+// Lock-free single-slot mailbox between two stages.
+// A newer frame replaces an unconsumed older one (latest frame wins), the replaced one is returned to be recycled.
+class FrameSlot {
+public:
+    FrameSlot() : mFrame(nullptr) {}
+    ~FrameSlot() { delete mFrame.exchange(nullptr); }
+    FaceFrame* put(FaceFrame* frame) { return mFrame.exchange(frame, std::memory_order_acq_rel); }
+    FaceFrame* take() { return mFrame.exchange(nullptr, std::memory_order_acq_rel); }
+    bool empty() const { return mFrame.load(std::memory_order_acquire) == nullptr; }
+private:
+    std::atomic<FaceFrame*> mFrame;
+};
+
+// NOTES:
+// Asynchronous face processing pipeline, each stage runs on its own thread:
+//   convert (NV21 -> RGBA) -> detect (or track) -> landmark -> overlay -> result
+// so the caller (camera callback) only copies the frame in and the latest result out.
+// Stages are connected by FrameSlot, frames which can't keep up are dropped instead of piling up,
+// so end-to-end latency is bounded by the pipeline depth.
+// The detector must not be used by others while the pipeline is running: its stages use the tracker, network
+// buffers & results of the detector without locks. The Java FaceDetector enforces it, its other calls do nothing
+// while async mode is on (only process() & draw(), which reads the overlay, go through).
+class FacePipeline {
+public:
+    typedef std::function<void(const FaceFrame&)> Callback;
+
+    explicit FacePipeline(FaceDetector* detector);
+    ~FacePipeline();
+
+    void start();
+    void stop();
+    // Called on overlay thread for each processed frame
+    void setCallback(const Callback& callback);
+
+    // Submit a frame, the data is copied. Returns frame id
+    int64 submit(const cv::Mat& rgba);
+    int64 submitNV21(const uchar* nv21, int width, int height);
+
+    // Get the latest processed frame (image optional). Returns its id, or -1 if nothing is processed yet
+    int64 poll(cv::Mat* image, std::vector<cv::Rect>* faces = nullptr,
+               std::vector<std::vector<cv::Point2f>>* landmarks = nullptr);
+    // Number of frames dropped by the stages
+    int64 dropped() const { return mDropped.load(); }
+
+private:
+    enum { CONVERT, DETECT, LANDMARK, OVERLAY, STAGES };
+    struct Stage {
+        FrameSlot input;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::thread thread;
+    };
+
+    void run(int stage);
+    void process(int stage, FaceFrame* frame);
+    FaceFrame* wait(Stage& stage);
+    void push(Stage& stage, FaceFrame* frame);
+    void publish(FaceFrame* frame);
+    FaceFrame* obtain();
+    void recycle(FaceFrame* frame);
+
+    FaceDetector* mFaceDetector;
+    Stage mStages[STAGES];
+    FrameSlot mResult;
+    FaceFrame* mLatest;
+    // Recycled frames, so their buffers are reused
+    static constexpr int POOL_SIZE = 8;
+    std::atomic<FaceFrame*> mPool[POOL_SIZE];
+    std::mutex mCallbackMutex;
+    Callback mCallback;
+    std::atomic<bool> mRunning;
+    std::atomic<int64> mNextId;
+    std::atomic<int64> mDropped;
+};
+
+#endif //FACE_FACE_PIPELINE_H
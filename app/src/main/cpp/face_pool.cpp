@@ -0,0 +1,236 @@
+#include <algorithm>
+#include "log.h"
+#include "face_pool.h"
+
+#undef  LOG_TAG
+#define LOG_TAG "FacePool"
+
+using namespace std;
+using namespace cv;
+
+bool DetectorPool::load(const string& modelDir, int contexts) {
+    if (!mModels.load(modelDir)) {
+        return false;
+    }
+    if (contexts <= 0) {
+        contexts = max(1, getNumberOfCPUs());
+    }
+    lock_guard<mutex> lock(mMutex);
+    mDetectors.clear();
+    mFree.clear();
+    for (int i = 0; i < contexts; ++i) {
+        unique_ptr<FaceDetector> detector(new FaceDetector());
+        if (!detector->load(mModels)) {
+            return false;
+        }
+        mFree.push_back(detector.get());
+        mDetectors.push_back(move(detector));
+    }
+    LOGI("detector pool: contexts=%d", contexts);
+    return true;
+}
+
+FaceDetector* DetectorPool::acquire() {
+    unique_lock<mutex> lock(mMutex);
+    mCond.wait(lock, [this] { return !mFree.empty(); });
+    FaceDetector* detector = mFree.back();
+    mFree.pop_back();
+    return detector;
+}
+
+FaceDetector* DetectorPool::tryAcquire() {
+    lock_guard<mutex> lock(mMutex);
+    if (mFree.empty()) {
+        return nullptr;
+    }
+    FaceDetector* detector = mFree.back();
+    mFree.pop_back();
+    return detector;
+}
+
+void DetectorPool::release(FaceDetector* detector) {
+    if (!detector) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(mMutex);
+        mFree.push_back(detector);
+    }
+    mCond.notify_one();
+}
+
+FaceScheduler::FaceScheduler(DetectorPool* pool, int queueSize)
+    : mPool(pool), mQueueSize(max(1, queueSize)) {
+}
+
+FaceScheduler::~FaceScheduler() {
+    stop();
+}
+
+void FaceScheduler::start() {
+    lock_guard<mutex> lock(mMutex);
+    if (mRunning) {
+        return;
+    }
+    mRunning = true;
+    for (int i = 0; i < mPool->size(); ++i) {
+        mWorkers.push_back(thread(&FaceScheduler::run, this));
+    }
+}
+
+void FaceScheduler::stop() {
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (!mRunning) {
+            return;
+        }
+        mRunning = false;
+    }
+    mCond.notify_all();
+    for (thread& worker: mWorkers) {
+        worker.join();
+    }
+    mWorkers.clear();
+    // Pending frames are dropped
+    lock_guard<mutex> lock(mMutex);
+    for (const shared_ptr<Stream>& stream: mStreams) {
+        stream->queue.clear();
+    }
+    mDone.notify_all();
+}
+
+int FaceScheduler::addStream(const Callback& callback, bool landmarks) {
+    shared_ptr<Stream> stream(new Stream());
+    stream->callback = callback;
+    stream->landmarks = landmarks;
+    lock_guard<mutex> lock(mMutex);
+    stream->id = mNextStream++;
+    mStreams.push_back(stream);
+    return stream->id;
+}
+
+void FaceScheduler::removeStream(int stream) {
+    {
+        lock_guard<mutex> lock(mMutex);
+        for (size_t i = 0; i < mStreams.size(); ++i) {
+            if (mStreams[i]->id == stream) {
+                mStreams[i]->queue.clear();
+                mStreams[i]->removed = true;
+                mStreams.erase(mStreams.begin() + i);
+                if (mCursor > i) {
+                    --mCursor;
+                }
+                break;
+            }
+        }
+    }
+    mDone.notify_all();
+}
+
+int64 FaceScheduler::submit(int stream, const Mat& rgba) {
+    shared_ptr<Stream> s;
+    Mat buffer;
+    {
+        lock_guard<mutex> lock(mMutex);
+        auto it = find_if(mStreams.begin(), mStreams.end(), [stream](const shared_ptr<Stream>& s) { return s->id == stream; });
+        if (it == mStreams.end()) {
+            return -1;
+        }
+        s = *it;
+        if (!s->buffers.empty()) {
+            buffer = s->buffers.back();
+            s->buffers.pop_back();
+        }
+    }
+    // NOTES:
+    // The frame is copied outside the lock (the buffer is owned by this call only), and queued after the copy,
+    // so workers aren't blocked by the copy and never see a partially copied frame.
+    rgba.copyTo(buffer);
+    int64 id;
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (s->removed) {
+            return -1;
+        }
+        if (int(s->queue.size()) >= mQueueSize) {
+            // Backpressure: the oldest pending frame is dropped, its buffer is recycled
+            s->buffers.push_back(s->queue.front().image);
+            s->queue.pop_front();
+            ++s->dropped;
+            ++mDropped;
+        }
+        id = s->nextId++;
+        s->queue.push_back({ id, buffer });
+    }
+    mCond.notify_one();
+    return id;
+}
+
+void FaceScheduler::flush() {
+    unique_lock<mutex> lock(mMutex);
+    mDone.wait(lock, [this] { return idle() || !mRunning; });
+}
+
+int64 FaceScheduler::dropped(int stream) {
+    lock_guard<mutex> lock(mMutex);
+    if (stream < 0) {
+        return mDropped;
+    }
+    for (const shared_ptr<Stream>& s: mStreams) {
+        if (s->id == stream) {
+            return s->dropped;
+        }
+    }
+    return 0;
+}
+
+shared_ptr<FaceScheduler::Stream> FaceScheduler::next() {
+    const size_t n = mStreams.size();
+    for (size_t i = 0; i < n; ++i) {
+        size_t index = (mCursor + i)%n;
+        const shared_ptr<Stream>& stream = mStreams[index];
+        if (!stream->busy && !stream->queue.empty()) {
+            mCursor = (index + 1)%n;
+            return stream;
+        }
+    }
+    return nullptr;
+}
+
+bool FaceScheduler::idle() const {
+    for (const shared_ptr<Stream>& stream: mStreams) {
+        if (stream->busy || !stream->queue.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void FaceScheduler::run() {
+    unique_lock<mutex> lock(mMutex);
+    while (true) {
+        shared_ptr<Stream> stream;
+        mCond.wait(lock, [&] { return !mRunning || (stream = next()) != nullptr; });
+        if (!mRunning) {
+            break;
+        }
+        Job job = stream->queue.front();
+        stream->queue.pop_front();
+        stream->busy = true;
+        lock.unlock();
+
+        FaceDetector* detector = mPool->acquire();
+        const FaceResults& results = detector->analyze(job.image, stream->landmarks);
+        if (stream->callback) {
+            stream->callback(stream->id, job.id, results);
+        }
+        mPool->release(detector);
+
+        lock.lock();
+        stream->busy = false;
+        stream->buffers.push_back(job.image);
+        // The stream may have another pending frame for another worker
+        mCond.notify_one();
+        mDone.notify_all();
+    }
+}
@@ -0,0 +1,111 @@
+#ifndef FACE_FACE_POOL_H
+#define FACE_FACE_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "face_detector.h"
+
+// NOTES:
+// Pool of inference contexts (FaceDetector) sharing the same models (see FaceModels), so serving more streams
+// doesn't load the models again. A context is used by one thread at a time: acquire() it, use it, release() it.
+// Contexts keep no per-stream state between acquisitions that matters (tracking is off), since any stream
+// may get any context.
+class DetectorPool {
+public:
+    // Load models once & create contexts, 0 contexts means one per CPU
+    bool load(const std::string& modelDir, int contexts = 0);
+    int size() const { return int(mDetectors.size()); }
+    const FaceModels& models() const { return mModels; }
+
+    // Get a free context, blocks until one is released
+    FaceDetector* acquire();
+    // Get a free context, or nullptr if all are busy
+    FaceDetector* tryAcquire();
+    void release(FaceDetector* detector);
+
+private:
+    FaceModels mModels;
+    std::vector<std::unique_ptr<FaceDetector>> mDetectors;
+    std::vector<FaceDetector*> mFree;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+};
+
+// NOTES:
+// Schedules frames of multiple streams (e.g. cameras) to the contexts of a DetectorPool, one worker thread per context.
+//  - Fairness: streams with pending frames are served round-robin, and a stream has at most one frame in flight,
+//    so a fast stream can't starve the others, and the results of a stream are in order.
+//  - Backpressure: each stream queues at most queueSize frames, a new frame replaces the oldest pending one
+//    (latest frame wins, like FacePipeline), so a stream faster than its share only drops its own frames.
+// Frame buffers are recycled per stream, so a stream of the same resolution doesn't allocate once warmed up.
+class FaceScheduler {
+public:
+    // Called on a worker thread with the results of a frame, results are only valid during the call
+    typedef std::function<void(int stream, int64 frameId, const FaceResults& results)> Callback;
+
+    explicit FaceScheduler(DetectorPool* pool, int queueSize = 2);
+    ~FaceScheduler();
+
+    void start();
+    void stop();
+
+    // Add a stream, returns its id
+    int addStream(const Callback& callback, bool landmarks);
+    // Remove a stream, its pending frames are dropped (a frame in flight still gets its callback)
+    void removeStream(int stream);
+
+    // Submit a RGBA frame of stream, the data is copied. Returns frame id, or -1 if the stream doesn't exist
+    int64 submit(int stream, const cv::Mat& rgba);
+    // Wait until all submitted frames are processed (or dropped)
+    void flush();
+
+    // Frames dropped by backpressure, of one stream or all streams (-1)
+    int64 dropped(int stream = -1);
+
+private:
+    struct Job {
+        int64 id;
+        cv::Mat image;
+    };
+    struct Stream {
+        int id;
+        Callback callback;
+        bool landmarks;
+        std::deque<Job> queue;
+        // A frame of the stream is being processed
+        bool busy = false;
+        bool removed = false;
+        int64 nextId = 0;
+        int64 dropped = 0;
+        // Recycled frame buffers
+        std::vector<cv::Mat> buffers;
+    };
+
+    void run();
+    // Next stream with a pending frame in round-robin order, mutex must be held
+    std::shared_ptr<Stream> next();
+    bool idle() const;
+
+    DetectorPool* mPool;
+    const int mQueueSize;
+    std::vector<std::shared_ptr<Stream>> mStreams;
+    // Round-robin position in mStreams
+    size_t mCursor = 0;
+    int mNextStream = 0;
+    int64 mDropped = 0;
+    std::vector<std::thread> mWorkers;
+    bool mRunning = false;
+    std::mutex mMutex;
+    // Signals pending frames to workers, and processed frames to flush()
+    std::condition_variable mCond;
+    std::condition_variable mDone;
+};
+
+#endif //FACE_FACE_POOL_H
@@ -0,0 +1,255 @@
+#include <opencv2/core/hal/intrin.hpp>
+#include "face_preprocess.h"
+
+using namespace std;
+using namespace cv;
+
+// Max network input width supported by the on-stack row buffers
+static constexpr int MAX_BLOB_WIDTH = 512;
+
+YUVPlanes nv21Planes(const uchar* data, int width, int height) {
+    YUVPlanes yuv;
+    yuv.y = data;
+    yuv.v = data + width*height;
+    yuv.u = yuv.v + 1;
+    yuv.yStride = width;
+    yuv.uvStride = width;
+    yuv.uvPixelStride = 2;
+    yuv.width = width;
+    yuv.height = height;
+    return yuv;
+}
+
+// Bilinear sampling position of one axis, the same as resize(..., INTER_LINEAR)
+// scale is source/destination ratio, beta is the weight of p1
+static inline void linearPos(int i, int srcSize, double scale, int& p0, int& p1, float& beta) {
+    double f = (i + 0.5)*scale - 0.5;
+    p0 = cvFloor(f);
+    beta = float(f - p0);
+    if (p0 < 0) {
+        p0 = 0;
+        beta = 0.f;
+    }
+    if (p0 >= srcSize - 1) {
+        p0 = srcSize - 1;
+        beta = 0.f;
+    }
+    p1 = min(p0 + 1, srcSize - 1);
+}
+
+// NOTES:
+// Sampling table of a whole row: ofs[2*i] and ofs[2*i+1] are the byte offsets of the two neighbour samples,
+// alpha[i] is the weight of the 2nd one. pixelStep is the distance of two samples in bytes.
+static void linearTable(int srcSize, int dstSize, double scale, int pixelStep, int* ofs, float* alpha) {
+    for (int i = 0; i < dstSize; ++i) {
+        int x0, x1;
+        linearPos(i, srcSize, scale, x0, x1, alpha[i]);
+        ofs[2*i] = x0*pixelStep;
+        ofs[2*i + 1] = x1*pixelStep;
+    }
+}
+
+// Horizontal interpolation of a 8-bit plane with given sampling table
+static void hline(const uchar* src, const int* ofs, const float* alpha, int n, float* dst) {
+    int i = 0;
+#if CV_SIMD128
+    // Samples are gathered 4 at a time, then interpolated in one vector
+    for (; i <= n - 4; i += 4) {
+        const int* o = ofs + 2*i;
+        v_float32x4 p0 = v_cvt_f32(v_int32x4(src[o[0]], src[o[2]], src[o[4]], src[o[6]]));
+        v_float32x4 p1 = v_cvt_f32(v_int32x4(src[o[1]], src[o[3]], src[o[5]], src[o[7]]));
+        v_store(dst + i, p0 + (p1 - p0)*v_load(alpha + i));
+    }
+#endif
+    for (; i < n; ++i) {
+        float p0 = src[ofs[2*i]];
+        float p1 = src[ofs[2*i + 1]];
+        dst[i] = p0 + (p1 - p0)*alpha[i];
+    }
+}
+
+// Horizontal interpolation of a RGBA row into planar B/G/R rows
+static void hlineRGBA(const uchar* src, const int* ofs, const float* alpha, int n, float* b, float* g, float* r) {
+    int i = 0;
+#if CV_SIMD128
+    // Each pixel is one RGBA vector, 4 interpolated pixels are transposed into R/G/B/A vectors
+    for (; i <= n - 4; i += 4) {
+        v_float32x4 p[4];
+        for (int k = 0; k < 4; ++k) {
+            v_float32x4 p0 = v_cvt_f32(v_reinterpret_as_s32(v_load_expand_q(src + ofs[2*(i + k)])));
+            v_float32x4 p1 = v_cvt_f32(v_reinterpret_as_s32(v_load_expand_q(src + ofs[2*(i + k) + 1])));
+            p[k] = p0 + (p1 - p0)*v_setall_f32(alpha[i + k]);
+        }
+        v_float32x4 vr, vg, vb, va;
+        v_transpose4x4(p[0], p[1], p[2], p[3], vr, vg, vb, va);
+        v_store(r + i, vr);
+        v_store(g + i, vg);
+        v_store(b + i, vb);
+    }
+#endif
+    for (; i < n; ++i) {
+        const uchar* p0 = src + ofs[2*i];
+        const uchar* p1 = src + ofs[2*i + 1];
+        float a = alpha[i];
+        r[i] = p0[0] + (p1[0] - p0[0])*a;
+        g[i] = p0[1] + (p1[1] - p0[1])*a;
+        b[i] = p0[2] + (p1[2] - p0[2])*a;
+    }
+}
+
+// NOTES:
+// Two horizontally interpolated source rows, cached by their row index: consecutive output rows sharing
+// a source row (upscaling, or chroma rows which cover two luma rows) interpolate it only once.
+// fetch() makes rows[0] & rows[1] hold source rows y0 & y1, fill(y, row) interpolates a missing one.
+struct RowCache {
+    float* rows[2];
+    int held[2];
+
+    RowCache(float* row0, float* row1) {
+        rows[0] = row0;
+        rows[1] = row1;
+        held[0] = held[1] = -1;
+    }
+
+    template<typename Fill>
+    void fetch(int y0, int y1, const Fill& fill) {
+        if (held[0] != y0) {
+            if (held[1] == y0) {
+                swap(rows[0], rows[1]);
+                swap(held[0], held[1]);
+            } else {
+                fill(y0, rows[0]);
+                held[0] = y0;
+            }
+        }
+        if (held[1] != y1) {
+            fill(y1, rows[1]);
+            held[1] = y1;
+        }
+    }
+};
+
+// dst = r0 + (r1 - r0)*beta - mean
+static void vline(const float* r0, const float* r1, float beta, float mean, float* dst, int n) {
+    int i = 0;
+#if CV_SIMD128
+    v_float32x4 vb = v_setall_f32(beta);
+    v_float32x4 vm = v_setall_f32(mean);
+    for (; i <= n - 4; i += 4) {
+        v_float32x4 a = v_load(r0 + i);
+        v_store(dst + i, a + (v_load(r1 + i) - a)*vb - vm);
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = r0[i] + (r1[i] - r0[i])*beta - mean;
+    }
+}
+
+// NOTES:
+// ITU-R BT.601 YUV->RGB, the same coefficients as cvtColor(..., COLOR_YUV2RGBA_NV21)
+// As the conversion is affine, interpolating YUV and then converting gives the same result as
+// converting and then interpolating (except for clamping).
+static void yuvToBlob(const float* y, const float* u, const float* v, const Scalar& mean, float* b, float* g, float* r, int n) {
+    constexpr float CY = 1.164f, CVR = 1.596f, CVG = -0.813f, CUG = -0.391f, CUB = 2.018f;
+    const float mb = float(mean[0]), mg = float(mean[1]), mr = float(mean[2]);
+    int i = 0;
+#if CV_SIMD128
+    v_float32x4 vzero = v_setzero_f32(), vmax = v_setall_f32(255.f);
+    v_float32x4 v16 = v_setall_f32(16.f), v128 = v_setall_f32(128.f);
+    v_float32x4 vcy = v_setall_f32(CY), vcvr = v_setall_f32(CVR), vcvg = v_setall_f32(CVG);
+    v_float32x4 vcug = v_setall_f32(CUG), vcub = v_setall_f32(CUB);
+    v_float32x4 vmb = v_setall_f32(mb), vmg = v_setall_f32(mg), vmr = v_setall_f32(mr);
+    for (; i <= n - 4; i += 4) {
+        v_float32x4 yy = v_max(v_load(y + i) - v16, vzero)*vcy;
+        v_float32x4 uu = v_load(u + i) - v128;
+        v_float32x4 vv = v_load(v + i) - v128;
+        v_store(r + i, v_min(v_max(yy + vv*vcvr, vzero), vmax) - vmr);
+        v_store(g + i, v_min(v_max(yy + vv*vcvg + uu*vcug, vzero), vmax) - vmg);
+        v_store(b + i, v_min(v_max(yy + uu*vcub, vzero), vmax) - vmb);
+    }
+#endif
+    for (; i < n; ++i) {
+        float yy = max(y[i] - 16.f, 0.f)*CY;
+        float uu = u[i] - 128.f;
+        float vv = v[i] - 128.f;
+        r[i] = min(max(yy + vv*CVR, 0.f), 255.f) - mr;
+        g[i] = min(max(yy + vv*CVG + uu*CUG, 0.f), 255.f) - mg;
+        b[i] = min(max(yy + uu*CUB, 0.f), 255.f) - mb;
+    }
+}
+
+void blobFromRGBA(const Mat& rgba, const Size& size, const Scalar& mean, float* blob) {
+    CV_Assert(rgba.type() == CV_8UC4 && size.width <= MAX_BLOB_WIDTH);
+    const int dw = size.width;
+    const int dh = size.height;
+    const double sx = double(rgba.cols)/dw;
+    const double sy = double(rgba.rows)/dh;
+
+    AutoBuffer<int, 2*MAX_BLOB_WIDTH> xofs(2*dw);
+    AutoBuffer<float, MAX_BLOB_WIDTH> xalpha(dw);
+    AutoBuffer<float, 6*MAX_BLOB_WIDTH> rows(6*dw);
+    linearTable(rgba.cols, dw, sx, 4, xofs.data(), xalpha.data());
+
+    // Two source rows, each one is split to B/G/R
+    RowCache cache(rows.data(), rows.data() + 3*dw);
+    auto fill = [&](int y, float* row) {
+        hlineRGBA(rgba.ptr(y), xofs.data(), xalpha.data(), dw, row, row + dw, row + 2*dw);
+    };
+    float* planes[3] = { blob, blob + dw*dh, blob + 2*dw*dh };
+    for (int dy = 0; dy < dh; ++dy) {
+        int y0, y1;
+        float beta;
+        linearPos(dy, rgba.rows, sy, y0, y1, beta);
+        cache.fetch(y0, y1, fill);
+        for (int c = 0; c < 3; ++c) {
+            vline(cache.rows[0] + c*dw, cache.rows[1] + c*dw, beta, float(mean[c]), planes[c] + dy*dw, dw);
+        }
+    }
+}
+
+void blobFromYUV(const YUVPlanes& yuv, const Size& size, const Scalar& mean, float* blob) {
+    CV_Assert(size.width <= MAX_BLOB_WIDTH);
+    const int dw = size.width;
+    const int dh = size.height;
+    const double sx = double(yuv.width)/dw;
+    const double sy = double(yuv.height)/dh;
+
+    // NOTES:
+    // Chroma is sampled at the same positions as luma, a chroma sample covers 2x2 luma samples,
+    // which is the same upsampling as cvtColor(..., COLOR_YUV2RGBA_NV21).
+    AutoBuffer<int, 4*MAX_BLOB_WIDTH> xofs(4*dw);
+    AutoBuffer<float, MAX_BLOB_WIDTH> xalpha(dw);
+    AutoBuffer<float, 9*MAX_BLOB_WIDTH> rows(9*dw);
+    int* yofs = xofs.data();
+    int* cofs = xofs.data() + 2*dw;
+    float* alpha = xalpha.data();
+    linearTable(yuv.width, dw, sx, 1, yofs, alpha);
+    for (int i = 0; i < 2*dw; ++i) {
+        cofs[i] = (yofs[i] >> 1)*yuv.uvPixelStride;
+    }
+
+    // Two source rows of Y, two chroma rows of U/V (cached by chroma row), and the vertically interpolated Y/U/V
+    float* buf = rows.data();
+    RowCache luma(buf, buf + dw);
+    RowCache chroma(buf + 2*dw, buf + 4*dw);
+    auto fillLuma = [&](int y, float* row) {
+        hline(yuv.y + y*yuv.yStride, yofs, alpha, dw, row);
+    };
+    auto fillChroma = [&](int y, float* row) {
+        hline(yuv.u + y*yuv.uvStride, cofs, alpha, dw, row);
+        hline(yuv.v + y*yuv.uvStride, cofs, alpha, dw, row + dw);
+    };
+    float* out[3] = { buf + 6*dw, buf + 7*dw, buf + 8*dw };
+    float* planes[3] = { blob, blob + dw*dh, blob + 2*dw*dh };
+    for (int dy = 0; dy < dh; ++dy) {
+        int y0, y1;
+        float beta;
+        linearPos(dy, yuv.height, sy, y0, y1, beta);
+        luma.fetch(y0, y1, fillLuma);
+        chroma.fetch(y0 >> 1, y1 >> 1, fillChroma);
+        vline(luma.rows[0], luma.rows[1], beta, 0.f, out[0], dw);
+        vline(chroma.rows[0], chroma.rows[1], beta, 0.f, out[1], dw);
+        vline(chroma.rows[0] + dw, chroma.rows[1] + dw, beta, 0.f, out[2], dw);
+        yuvToBlob(out[0], out[1], out[2], mean, planes[0] + dy*dw, planes[1] + dy*dw, planes[2] + dy*dw, dw);
+    }
+}
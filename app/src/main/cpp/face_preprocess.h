@@ -0,0 +1,33 @@
+#ifndef FACE_FACE_PREPROCESS_H
+#define FACE_FACE_PREPROCESS_H
+
+#include <opencv2/core.hpp>
+
+// NOTES:
+// Describes a YUV 4:2:0 frame as separate planes, so both NV21 (camera1 preview) and
+// YUV_420_888 (camera2 ImageReader) can be consumed without repacking.
+// For NV21, v points to the interleaved VU plane, u = v + 1 and uvPixelStride = 2.
+struct YUVPlanes {
+    const uchar* y;
+    const uchar* u;
+    const uchar* v;
+    int yStride;
+    int uvStride;
+    int uvPixelStride;
+    int width;
+    int height;
+};
+
+// Describe a NV21 buffer (width*height Y plane followed by interleaved VU plane)
+YUVPlanes nv21Planes(const uchar* data, int width, int height);
+
+// NOTES:
+// The following kernels produce the same 3xHxW planar BGR float data as
+//   cvtColor(..., COLOR_RGBA2BGR) + dnn::blobFromImage(..., 1.0, size, mean)
+// in one pass: only the source pixels needed by the bilinear resize are sampled,
+// and no full-resolution intermediate image is created.
+// blob must point to 3*size.area() floats, e.g. blob.ptr<float>(n) of a NxCxHxW Mat
+void blobFromRGBA(const cv::Mat& rgba, const cv::Size& size, const cv::Scalar& mean, float* blob);
+void blobFromYUV(const YUVPlanes& yuv, const cv::Size& size, const cv::Scalar& mean, float* blob);
+
+#endif //FACE_FACE_PREPROCESS_H
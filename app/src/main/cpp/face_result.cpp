@@ -0,0 +1,60 @@
+#include <algorithm>
+#include <cstring>
+#include "face_result.h"
+
+using namespace std;
+using namespace cv;
+
+void FaceResults::clear() {
+    ids.clear();
+    boxes.clear();
+    scores.clear();
+    tracking.clear();
+    ages.clear();
+    landmarks.clear();
+}
+
+int packFaceResults(const FaceResults& results, void* buffer, size_t capacity) {
+    using namespace FaceResultLayout;
+    const size_t words = capacity/sizeof(int32_t);
+    if (!buffer || words < HEADER_WORDS) {
+        return 0;
+    }
+    const int total = int(results.size());
+    const int m = results.landmarks.empty() ? 0 : int(results.landmarks[0].size());
+    const int n = min(total, int((words - HEADER_WORDS)/faceWords(m)));
+
+    int32_t* header = (int32_t*)buffer;
+    header[COUNT] = n;
+    header[LANDMARKS] = m;
+    header[TOTAL] = total;
+    header[RESERVED] = 0;
+
+    int32_t* ids = header + HEADER_WORDS;
+    int32_t* boxes = ids + n;
+    float* scores = (float*)(boxes + n*4);
+    float* tracking = scores + n;
+    int32_t* ages = (int32_t*)(tracking + n);
+    float* landmarks = (float*)(ages + n);
+    for (int i = 0; i < n; ++i) {
+        const Rect& box = results.boxes[i];
+        ids[i] = results.ids[i];
+        boxes[i*4 + 0] = box.x;
+        boxes[i*4 + 1] = box.y;
+        boxes[i*4 + 2] = box.x + box.width;
+        boxes[i*4 + 3] = box.y + box.height;
+        scores[i] = results.scores[i];
+        tracking[i] = results.tracking[i];
+        ages[i] = results.ages[i];
+    }
+    for (int i = 0; i < n && m > 0; ++i) {
+        // Point2f is 2 packed floats
+        const vector<Point2f>& points = results.landmarks[i];
+        if (int(points.size()) == m) {
+            memcpy(landmarks + i*m*2, points.data(), m*sizeof(Point2f));
+        } else {
+            fill(landmarks + i*m*2, landmarks + (i + 1)*m*2, 0.0f);
+        }
+    }
+    return n;
+}
@@ -0,0 +1,44 @@
+#ifndef FACE_FACE_RESULT_H
+#define FACE_FACE_RESULT_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+// Faces of a frame, see FaceDetector::analyze()
+struct FaceResults {
+    std::vector<int> ids;
+    std::vector<cv::Rect> boxes;
+    std::vector<float> scores;
+    // Tracking confidence & frames since the last detection, see FaceTracker::Track
+    std::vector<float> tracking;
+    std::vector<int> ages;
+    // Empty if landmarks aren't fitted
+    std::vector<std::vector<cv::Point2f>> landmarks;
+
+    void clear();
+    size_t size() const { return boxes.size(); }
+};
+
+// NOTES:
+// Packed struct-of-arrays layout of FaceResults, shared with com.hangsheng.face.FaceResults.
+// All fields are 32-bit words (int32 or float32) in native byte order:
+//   header:    [count, landmarks per face (m), total faces, reserved]
+//   ids:       int32[count]
+//   boxes:     int32[count*4] as left, top, right, bottom
+//   scores:    float[count]
+//   tracking:  float[count]
+//   ages:      int32[count]
+//   landmarks: float[count*m*2] as x, y
+// If the buffer is too small, only the first count faces are packed, total faces tells the actual number.
+// Faces are in the order of FaceResults: by score for detections, but in track order in detect-then-track mode,
+// so a truncated buffer may drop better scored faces there.
+namespace FaceResultLayout {
+    enum { COUNT, LANDMARKS, TOTAL, RESERVED, HEADER_WORDS };
+    // Words taken by each face with m landmarks
+    inline size_t faceWords(int m) { return 1 + 4 + 1 + 1 + 1 + size_t(m)*2; }
+}
+
+// Pack results into buffer of capacity bytes. Returns the number of packed faces
+int packFaceResults(const FaceResults& results, void* buffer, size_t capacity);
+
+#endif //FACE_FACE_RESULT_H
@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "log.h"
+#include "face_trace.h"
+
+#undef  LOG_TAG
+#define LOG_TAG "FaceTrace"
+
+using namespace std;
+using namespace cv;
+
+int64 FaceTrace::now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef FACE_TRACE
+
+namespace {
+
+// Fields are relaxed atomics so a concurrent dump is well defined, they're plain loads & stores on ARM/x86
+struct TraceEvent {
+    // 2*index + 1 while the event is written, 2*index + 2 once it's written
+    atomic<uint64_t> seq{0};
+    atomic<const char*> name{nullptr};
+    atomic<int> tid{0};
+    atomic<int64> frame{0};
+    atomic<int64> begin{0};
+    atomic<int64> end{0};
+};
+
+struct TraceRing {
+    explicit TraceRing(size_t capacity) : events(new TraceEvent[capacity]), mask(capacity - 1) {}
+    unique_ptr<TraceEvent[]> events;
+    const size_t mask;
+    // Events written so far, only written by the owner thread
+    atomic<uint64_t> next{0};
+    // Set while a thread owns the ring, the ring of an exited thread is reused by a new thread
+    atomic<bool> owned{true};
+};
+
+struct ThreadState {
+    TraceRing* ring = nullptr;
+    int tid = 0;
+    int64 frame = -1;
+    // The frame is begun but not claimed yet
+    bool open = false;
+    ~ThreadState() {
+        if (ring) {
+            ring->owned.store(false, memory_order_release);
+        }
+    }
+};
+
+struct Event {
+    const char* name;
+    int tid;
+    int64 frame;
+    int64 begin;
+    int64 end;
+};
+
+atomic<bool> gEnabled(false);
+atomic<int64> gStart(0);
+atomic<int> gCapacity(4096);
+atomic<int64> gNextFrame(0);
+// Guards the ring list & thread names, taken once by each thread & by dumps
+mutex gMutex;
+vector<unique_ptr<TraceRing>> gRings;
+vector<pair<int, string>> gThreads;
+thread_local ThreadState tState;
+
+TraceRing* acquireRing(int& tid) {
+    tid = int(syscall(SYS_gettid));
+    char name[17] = {};
+    prctl(PR_GET_NAME, name);
+
+    lock_guard<mutex> lock(gMutex);
+    const size_t capacity = size_t(gCapacity.load());
+    TraceRing* ring = nullptr;
+    for (const unique_ptr<TraceRing>& r: gRings) {
+        if (r->mask + 1 == capacity && !r->owned.load(memory_order_acquire)) {
+            ring = r.get();
+            ring->owned.store(true, memory_order_relaxed);
+            break;
+        }
+    }
+    if (!ring) {
+        gRings.push_back(unique_ptr<TraceRing>(new TraceRing(capacity)));
+        ring = gRings.back().get();
+    }
+    auto thread = find_if(gThreads.begin(), gThreads.end(), [&](const pair<int, string>& t) { return t.first == tid; });
+    if (thread != gThreads.end()) {
+        thread->second = name;
+    } else {
+        gThreads.push_back(make_pair(tid, string(name)));
+    }
+    return ring;
+}
+
+// NOTES:
+// Seqlock read: an event is copied only if its sequence number is the expected one before & after the copy,
+// i.e. it's completely written and not overwritten meanwhile
+void readRing(const TraceRing& ring, int64 start, vector<Event>& events) {
+    const uint64_t n = ring.next.load(memory_order_acquire);
+    const uint64_t capacity = ring.mask + 1;
+    for (uint64_t i = n > capacity ? n - capacity : 0; i < n; ++i) {
+        const TraceEvent& e = ring.events[i & ring.mask];
+        const uint64_t seq = e.seq.load(memory_order_acquire);
+        if (seq != 2*i + 2) {
+            continue;
+        }
+        Event event;
+        event.name = e.name.load(memory_order_relaxed);
+        event.tid = e.tid.load(memory_order_relaxed);
+        event.frame = e.frame.load(memory_order_relaxed);
+        event.begin = e.begin.load(memory_order_relaxed);
+        event.end = e.end.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (e.seq.load(memory_order_relaxed) == seq && event.begin >= start) {
+            events.push_back(event);
+        }
+    }
+}
+
+void appendEscaped(string& s, const string& text) {
+    for (char c: text) {
+        if (c == '"' || c == '\\') {
+            s += '\\';
+        }
+        if (c >= 0x20) {
+            s += c;
+        }
+    }
+}
+
+}
+
+void FaceTrace::start(int eventsPerThread) {
+    int capacity = 16;
+    while (capacity < eventsPerThread && capacity < (1 << 24)) {
+        capacity *= 2;
+    }
+    gCapacity = capacity;
+    gStart = now();
+    gEnabled.store(true, memory_order_release);
+    LOGI("trace started: %d events per thread", capacity);
+}
+
+void FaceTrace::stop() {
+    gEnabled.store(false, memory_order_release);
+}
+
+bool FaceTrace::enabled() {
+    return gEnabled.load(memory_order_relaxed);
+}
+
+void FaceTrace::setFrame(int64 frame) {
+    tState.frame = frame;
+    tState.open = false;
+}
+
+int64 FaceTrace::frame() {
+    return tState.frame;
+}
+
+void FaceTrace::beginFrame() {
+    tState.frame = gNextFrame++;
+    tState.open = true;
+}
+
+void FaceTrace::claimFrame() {
+    if (!tState.open) {
+        tState.frame = gNextFrame++;
+    }
+    tState.open = false;
+}
+
+void FaceTrace::record(const char* name, int64 begin, int64 end) {
+    ThreadState& state = tState;
+    if (!state.ring) {
+        state.ring = acquireRing(state.tid);
+    }
+    TraceRing& ring = *state.ring;
+    const uint64_t i = ring.next.load(memory_order_relaxed);
+    TraceEvent& e = ring.events[i & ring.mask];
+    e.seq.store(2*i + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    e.name.store(name, memory_order_relaxed);
+    e.tid.store(state.tid, memory_order_relaxed);
+    e.frame.store(state.frame, memory_order_relaxed);
+    e.begin.store(begin, memory_order_relaxed);
+    e.end.store(end, memory_order_relaxed);
+    e.seq.store(2*i + 2, memory_order_release);
+    ring.next.store(i + 1, memory_order_release);
+}
+
+// NOTES:
+// Chrome trace event format: each event is a complete event ("ph":"X") with its frame id in args,
+// timestamps are microseconds since start(). Thread names are metadata events ("ph":"M").
+string FaceTrace::json() {
+    const int64 start = gStart.load();
+    vector<Event> events;
+    vector<pair<int, string>> threads;
+    {
+        lock_guard<mutex> lock(gMutex);
+        for (const unique_ptr<TraceRing>& ring: gRings) {
+            readRing(*ring, start, events);
+        }
+        threads = gThreads;
+    }
+    sort(events.begin(), events.end(), [](const Event& a, const Event& b) { return a.begin < b.begin; });
+
+    const int pid = int(getpid());
+    string s = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    char line[256];
+    snprintf(line, sizeof(line), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"face\"}}", pid);
+    s += line;
+    for (const pair<int, string>& thread: threads) {
+        snprintf(line, sizeof(line), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"", pid, thread.first);
+        s += line;
+        appendEscaped(s, thread.second);
+        s += "\"}}";
+    }
+    for (const Event& event: events) {
+        snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"cat\":\"face\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                 event.name, pid, event.tid, (event.begin - start)/1000.0, (event.end - event.begin)/1000.0);
+        s += line;
+        if (event.frame >= 0) {
+            snprintf(line, sizeof(line), ",\"args\":{\"frame\":%lld}", (long long)event.frame);
+            s += line;
+        }
+        s += '}';
+    }
+    s += "\n]}\n";
+    return s;
+}
+
+bool FaceTrace::dump(const string& file) {
+    const string trace = json();
+    FILE* fp = fopen(file.c_str(), "w");
+    if (!fp) {
+        LOGE("failed to create trace file: %s", file.c_str());
+        return false;
+    }
+    bool ok = fwrite(trace.data(), 1, trace.size(), fp) == trace.size();
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok) {
+        LOGE("failed to write trace file: %s", file.c_str());
+    } else {
+        LOGI("trace dumped: %s, %zu bytes", file.c_str(), trace.size());
+    }
+    return ok;
+}
+
+#else
+
+void FaceTrace::start(int eventsPerThread) {
+    LOGW("trace is compiled out");
+}
+
+void FaceTrace::stop() {
+}
+
+bool FaceTrace::enabled() {
+    return false;
+}
+
+void FaceTrace::setFrame(int64 frame) {
+}
+
+int64 FaceTrace::frame() {
+    return -1;
+}
+
+void FaceTrace::beginFrame() {
+}
+
+void FaceTrace::claimFrame() {
+}
+
+void FaceTrace::record(const char* name, int64 begin, int64 end) {
+}
+
+string FaceTrace::json() {
+    return string();
+}
+
+bool FaceTrace::dump(const string& file) {
+    LOGW("trace is compiled out");
+    return false;
+}
+
+#endif
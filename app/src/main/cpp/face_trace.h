@@ -0,0 +1,79 @@
+#ifndef FACE_FACE_TRACE_H
+#define FACE_FACE_TRACE_H
+
+#include <string>
+#include <opencv2/core.hpp>
+
+// NOTES:
+// Pipeline trace recorder: a timeline of the stages of every frame, across threads, dumped in the Chrome
+// trace event format (JSON), which is opened by chrome://tracing and ui.perfetto.dev.
+// Stages are marked by FACE_TRACE_SCOPE("name") (name must be a string literal), each scope is one complete
+// event of the calling thread, tagged with the frame id of the thread:
+//  - a frame is begun by FACE_TRACE_BEGIN_FRAME() where it enters native code (e.g. color conversion of a
+//    camera frame), and claimed by FACE_TRACE_CLAIM_FRAME() of FaceDetector::analyze()/process(), which
+//    begins a new frame if the thread has no unclaimed one
+//  - pipeline stages set the id of the FaceFrame they process by FACE_TRACE_FRAME(id)
+//  - parallel_for_ bodies run on worker threads, whose frame id is whatever they ran last: a body with scopes
+//    sets the frame id of the caller, taken by FaceTrace::frame() before parallel_for_, by FACE_TRACE_FRAME(id)
+// Recording is lock-free: each thread writes its own ring buffer of the last eventsPerThread events (the ring
+// is allocated by the first event of the thread, under a mutex once), and a dump reads the rings concurrently,
+// an event being overwritten while it's read is skipped (sequence number per event, like a seqlock).
+// When the recorder isn't started, a scope only checks enabled() (a relaxed atomic load).
+// Comment out FACE_TRACE to compile all markers out, start()/dump() do nothing then.
+#define FACE_TRACE
+
+class FaceTrace {
+public:
+    // Start recording, events recorded before are dropped from dumps. eventsPerThread (rounded up to a power
+    // of 2) applies to the rings of threads which haven't recorded yet
+    static void start(int eventsPerThread = 4096);
+    static void stop();
+    static bool enabled();
+    // Write the events recorded since start() as a Chrome trace JSON file, returns false if it can't be written
+    static bool dump(const std::string& file);
+    static std::string json();
+
+    // Frame id of the calling thread (-1 if none)
+    static void setFrame(int64 frame);
+    static int64 frame();
+    static void beginFrame();
+    static void claimFrame();
+
+    // Time in nanoseconds, steady clock
+    static int64 now();
+    // Record an event of the calling thread
+    static void record(const char* name, int64 begin, int64 end);
+};
+
+// Records the lifetime of the scope as an event
+class TraceScope {
+public:
+    explicit TraceScope(const char* name) : mName(name), mBegin(FaceTrace::enabled() ? FaceTrace::now() : 0) {}
+    ~TraceScope() {
+        if (mBegin) {
+            FaceTrace::record(mName, mBegin, FaceTrace::now());
+        }
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* mName;
+    int64 mBegin;
+};
+
+#ifdef FACE_TRACE
+#define FACE_TRACE_CONCAT_(a, b)    a##b
+#define FACE_TRACE_CONCAT(a, b)     FACE_TRACE_CONCAT_(a, b)
+#define FACE_TRACE_SCOPE(name)      TraceScope FACE_TRACE_CONCAT(traceScope, __LINE__)(name)
+#define FACE_TRACE_FRAME(frame)     FaceTrace::setFrame(frame)
+#define FACE_TRACE_BEGIN_FRAME()    FaceTrace::beginFrame()
+#define FACE_TRACE_CLAIM_FRAME()    FaceTrace::claimFrame()
+#else
+#define FACE_TRACE_SCOPE(name)      ((void)0)
+#define FACE_TRACE_FRAME(frame)     ((void)(frame))
+#define FACE_TRACE_BEGIN_FRAME()    ((void)0)
+#define FACE_TRACE_CLAIM_FRAME()    ((void)0)
+#endif
+
+#endif //FACE_FACE_TRACE_H
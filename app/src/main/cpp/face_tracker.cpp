@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+#include "log.h"
+#include "face_detector.h"
+#include "face_tracker.h"
+#include "frame_arena.h"
+
+#undef  LOG_TAG
+#define LOG_TAG "FaceTracker"
+
+using namespace std;
+using namespace cv;
+
+FaceTracker::Params::Params() {
+    detectInterval = 5;
+    minConfidence = 0.5f;
+    detectOnLoss = true;
+    matchThreshold = 0.3f;
+    gridSize = 5;
+    maxError = 2.0f;
+}
+
+FaceTracker::FaceTracker(const Params& params)
+    : mPyramidReady(false), mFrames(0), mNextId(0), mDetected(false), mLost(false) {
+    setParams(params);
+}
+
+void FaceTracker::setParams(const Params& params) {
+    mParams = params;
+    mParams.detectInterval = max(1, mParams.detectInterval);
+    mParams.gridSize = max(1, mParams.gridSize);
+}
+
+void FaceTracker::reset() {
+    mTracks.clear();
+    mPrevGray.release();
+    mPyramidReady = false;
+    mFrames = 0;
+    mDetected = false;
+    mLost = false;
+}
+
+static float median(vector<float>& values) {
+    auto middle = values.begin() + values.size()/2;
+    nth_element(values.begin(), middle, values.end());
+    return *middle;
+}
+
+static float distance(const Point2f& a, const Point2f& b) {
+    return hypot(a.x - b.x, a.y - b.y);
+}
+
+bool FaceTracker::needDetect() const {
+    if (mFrames >= mParams.detectInterval) {
+        return true;
+    }
+    if (mLost && mParams.detectOnLoss) {
+        return true;
+    }
+    for (const Track& t: mTracks) {
+        if (t.tracking < mParams.minConfidence) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void FaceTracker::watch(FrameArena& arena) const {
+    arena.add(mPrevGray);
+    arena.add(mGray);
+    arena.add(mPrevPyramid);
+    arena.add(mPyramid);
+    arena.add(mFaces);
+    arena.add(mConfidences);
+    arena.add(mTracks);
+    arena.add(mNextTracks);
+    arena.add(mMatched);
+    arena.add(mPoints);
+    arena.add(mNextPoints);
+    arena.add(mBackPoints);
+    arena.add(mStatus);
+    arena.add(mBackStatus);
+    arena.add(mErrors);
+    arena.add(mDx);
+    arena.add(mDy);
+    arena.add(mScales);
+    arena.add(mValid);
+}
+
+void FaceTracker::track(const Mat& image, FaceDetector& detector, vector<Track>& tracks) {
+    cvtColor(image, mGray, COLOR_RGBA2GRAY);
+    mDetected = mPrevGray.size() != mGray.size() || needDetect();
+    if (mDetected) {
+        mFaces.clear();
+        mConfidences.clear();
+        detector.detect(image, mFaces, mConfidences);
+        associate(mFaces, mConfidences);
+        mFrames = 1;
+    } else {
+        propagate();
+        ++mFrames;
+    }
+    // The previous gray buffer (& pyramid) is reused by next frame,
+    // the pyramid is only built by propagate() if there is anything to track
+    swap(mPrevGray, mGray);
+    swap(mPrevPyramid, mPyramid);
+    mPyramidReady = !mDetected && !mPoints.empty();
+    tracks = mTracks;
+}
+
+void FaceTracker::associate(const vector<Rect>& faces, const vector<float>& confidences) {
+    // NOTES:
+    // Greedy matching by IoU, faces are already sorted by confidence (NMS output)
+    vector<Track>& tracks = mNextTracks;
+    vector<uchar>& matched = mMatched;
+    tracks.clear();
+    matched.assign(mTracks.size(), 0);
+    for (size_t i = 0; i < faces.size(); ++i) {
+        int best = -1;
+        float bestIoU = mParams.matchThreshold;
+        for (size_t j = 0; j < mTracks.size(); ++j) {
+            if (matched[j]) {
+                continue;
+            }
+            float overlap = (faces[i] & mTracks[j].box).area();
+            float iou = overlap/(faces[i].area() + mTracks[j].box.area() - overlap);
+            if (iou > bestIoU) {
+                bestIoU = iou;
+                best = int(j);
+            }
+        }
+        Track t;
+        if (best >= 0) {
+            matched[best] = 1;
+            t.id = mTracks[best].id;
+        } else {
+            t.id = mNextId++;
+        }
+        t.box = faces[i];
+        t.confidence = confidences[i];
+        t.tracking = 1.0f;
+        t.age = 0;
+        tracks.push_back(t);
+    }
+    mTracks.swap(tracks);
+    mLost = false;
+}
+
+void FaceTracker::propagate() {
+    const int n = mParams.gridSize;
+    vector<Point2f>& points = mPoints;
+    points.clear();
+    for (const Track& t: mTracks) {
+        for (int i = 1; i <= n; ++i) {
+            for (int j = 1; j <= n; ++j) {
+                points.push_back(Point2f(t.box.x + t.box.width*j/float(n + 1), t.box.y + t.box.height*i/float(n + 1)));
+            }
+        }
+    }
+    if (points.empty()) {
+        return;
+    }
+
+    // NOTES:
+    // Forward-backward check: a point is valid only if tracking it back lands near its origin.
+    // Pyramids are built once per frame and shared by both directions, the previous one is kept from last frame.
+    const Size winSize(15, 15);
+    constexpr int maxLevel = 2;
+    if (!mPyramidReady) {
+        buildOpticalFlowPyramid(mPrevGray, mPrevPyramid, winSize, maxLevel);
+    }
+    int levels = buildOpticalFlowPyramid(mGray, mPyramid, winSize, maxLevel);
+    vector<Point2f>& nextPoints = mNextPoints;
+    vector<Point2f>& backPoints = mBackPoints;
+    vector<uchar>& status = mStatus;
+    vector<uchar>& backStatus = mBackStatus;
+    vector<float>& errors = mErrors;
+    calcOpticalFlowPyrLK(mPrevPyramid, mPyramid, points, nextPoints, status, errors, winSize, levels);
+    calcOpticalFlowPyrLK(mPyramid, mPrevPyramid, nextPoints, backPoints, backStatus, errors, winSize, levels);
+
+    const Rect imageRect(0, 0, mGray.cols, mGray.rows);
+    vector<Track>& tracks = mNextTracks;
+    vector<int>& valid = mValid;
+    vector<float>& dx = mDx;
+    vector<float>& dy = mDy;
+    vector<float>& scales = mScales;
+    tracks.clear();
+    for (size_t k = 0; k < mTracks.size(); ++k) {
+        valid.clear();
+        for (int i = int(k)*n*n; i < int(k + 1)*n*n; ++i) {
+            if (status[i] && backStatus[i] && distance(points[i], backPoints[i]) < mParams.maxError) {
+                valid.push_back(i);
+            }
+        }
+        Track t = mTracks[k];
+        t.tracking = valid.size()/float(n*n);
+        t.age++;
+        if (valid.size() < 3) {
+            LOGI("face %d is lost", t.id);
+            mLost = true;
+            continue;
+        }
+
+        // Median translation & scale change of valid points
+        dx.clear();
+        dy.clear();
+        scales.clear();
+        for (size_t a = 0; a < valid.size(); ++a) {
+            int i = valid[a];
+            dx.push_back(nextPoints[i].x - points[i].x);
+            dy.push_back(nextPoints[i].y - points[i].y);
+            for (size_t b = a + 1; b < valid.size(); ++b) {
+                int j = valid[b];
+                float d = distance(points[i], points[j]);
+                if (d > 1.0f) {
+                    scales.push_back(distance(nextPoints[i], nextPoints[j])/d);
+                }
+            }
+        }
+        float scale = scales.empty() ? 1.0f : median(scales);
+        float cx = t.box.x + t.box.width*0.5f + median(dx);
+        float cy = t.box.y + t.box.height*0.5f + median(dy);
+        float w = t.box.width*scale;
+        float h = t.box.height*scale;
+        t.box = Rect(cvRound(cx - w*0.5f), cvRound(cy - h*0.5f), cvRound(w), cvRound(h)) & imageRect;
+        if (t.box.area() == 0) {
+            mLost = true;
+            continue;
+        }
+        tracks.push_back(t);
+    }
+    mTracks.swap(tracks);
+}
@@ -0,0 +1,83 @@
+#ifndef FACE_FACE_TRACKER_H
+#define FACE_FACE_TRACKER_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+class FaceDetector;
+class FrameArena;
+
+// NOTES:
+// Detect-then-track: the (expensive) detector is only run every N frames, or when tracking
+// becomes unreliable. In between, face boxes are propagated by pyramidal Lucas-Kanade optical flow
+// of a grid of points inside each box.
+class FaceTracker {
+public:
+    struct Params {
+        Params();
+        // Run detector at least every detectInterval frames
+        int detectInterval;
+        // Run detector if tracking confidence of any face is lower than this
+        float minConfidence;
+        // Run detector if any face is lost
+        bool detectOnLoss;
+        // Min IoU to associate a detected face with an existing track
+        float matchThreshold;
+        // Tracking points per box side (gridSize*gridSize points per face)
+        int gridSize;
+        // Max forward-backward error (in pixels) of a valid tracking point
+        float maxError;
+    };
+
+    struct Track {
+        int id;
+        cv::Rect box;
+        // Confidence of the last detection
+        float confidence;
+        // Fraction of points tracked in the last frame, 1 for a just detected face
+        float tracking;
+        // Frames since the last detection
+        int age;
+    };
+
+    explicit FaceTracker(const Params& params = Params());
+    void setParams(const Params& params);
+    const Params& getParams() const { return mParams; }
+    void reset();
+
+    // Track faces of RGBA image, the detector is run if needed
+    void track(const cv::Mat& image, FaceDetector& detector, std::vector<Track>& tracks);
+    // Whether the detector was run by the last track()
+    bool detected() const { return mDetected; }
+    // Register the buffers reused across frames to arena
+    void watch(FrameArena& arena) const;
+
+private:
+    bool needDetect() const;
+    void associate(const std::vector<cv::Rect>& faces, const std::vector<float>& confidences);
+    void propagate();
+
+    Params mParams;
+    std::vector<Track> mTracks;
+    cv::Mat mPrevGray;
+    cv::Mat mGray;
+    // Optical flow pyramids of mPrevGray & mGray, mPrevPyramid is only valid if mPyramidReady
+    std::vector<cv::Mat> mPrevPyramid;
+    std::vector<cv::Mat> mPyramid;
+    bool mPyramidReady;
+    // Buffers reused across frames
+    std::vector<cv::Rect> mFaces;
+    std::vector<float> mConfidences;
+    std::vector<Track> mNextTracks;
+    std::vector<uchar> mMatched;
+    std::vector<cv::Point2f> mPoints, mNextPoints, mBackPoints;
+    std::vector<uchar> mStatus, mBackStatus;
+    std::vector<float> mErrors, mDx, mDy, mScales;
+    std::vector<int> mValid;
+    int mFrames;
+    int mNextId;
+    bool mDetected;
+    bool mLost;
+};
+
+#endif //FACE_FACE_TRACKER_H
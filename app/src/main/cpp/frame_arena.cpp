@@ -0,0 +1,48 @@
+#include "frame_arena.h"
+
+using namespace std;
+using namespace cv;
+
+void FrameArena::add(const Mat& mat) {
+    mBuffers.push_back({ &mat, [](const void* p) { return (const void*)static_cast<const Mat*>(p)->datastart; },
+                         [](const void* p) { const Mat* m = static_cast<const Mat*>(p); return size_t(m->dataend - m->datastart); }, nullptr, 0 });
+}
+
+void FrameArena::beginFrame() {
+    for (Buffer& buffer: mBuffers) {
+        buffer.snapshot = buffer.data(buffer.owner);
+        buffer.snapshotBytes = buffer.bytes(buffer.owner);
+    }
+}
+
+void FrameArena::endFrame() {
+    // NOTES:
+    // Buffers may be swapped between each other (e.g. double buffering of previous/current frame),
+    // so a buffer is only counted if its data isn't any of the buffers' data (of the same size) at the frame begin.
+    // Only pointers & sizes are compared: a buffer freed and reallocated with the same size at the same address
+    // within a frame (which the heap may well do) isn't counted, so allocations() is a lower bound. face_bench
+    // counts operator new & Mat allocations directly for an exact number.
+    mLastAllocations = 0;
+    mLastBytes = 0;
+    for (const Buffer& buffer: mBuffers) {
+        const void* data = buffer.data(buffer.owner);
+        if (!data) {
+            continue;
+        }
+        const size_t bytes = buffer.bytes(buffer.owner);
+        bool reused = false;
+        for (const Buffer& other: mBuffers) {
+            if (other.snapshot == data && other.snapshotBytes == bytes) {
+                reused = true;
+                break;
+            }
+        }
+        if (!reused) {
+            ++mLastAllocations;
+            mLastBytes += bytes;
+        }
+    }
+    mAllocations += mLastAllocations;
+    mBytes += mLastBytes;
+    ++mFrames;
+}
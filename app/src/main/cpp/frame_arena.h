@@ -0,0 +1,59 @@
+#ifndef FACE_FRAME_ARENA_H
+#define FACE_FRAME_ARENA_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+// NOTES:
+// Intermediate buffers (Mats & vectors) of frame processing are owned by their user as members,
+// and kept across frames: a Mat is only reallocated when the frame resolution (or type) changes,
+// a vector is cleared but keeps its capacity. So once warmed up, processing a frame of the same
+// resolution doesn't touch the heap.
+// FrameArena watches the registered buffers and counts how many of them were (re)allocated by
+// each frame, i.e. allocations() must stop increasing after the warm-up, and the bytes of those
+// allocations (Mat data size, vector capacity).
+// It's a lower bound, not a proof of an allocation-free frame: only the outer data pointer & size of the
+// registered buffers are watched, so allocations of nested containers (e.g. the inner vectors of a
+// vector<vector<Point2f>>) and inside OpenCV (dnn forward, temporaries of imgproc calls) aren't seen.
+// The exact count is allocs_per_iter of face_bench, which counts operator new & cv::Mat allocations.
+class FrameArena {
+public:
+    void add(const cv::Mat& mat);
+    template<typename T>
+    void add(const std::vector<T>& vec) {
+        mBuffers.push_back({ &vec, [](const void* p) { return (const void*)static_cast<const std::vector<T>*>(p)->data(); },
+                             [](const void* p) { return static_cast<const std::vector<T>*>(p)->capacity()*sizeof(T); }, nullptr, 0 });
+    }
+
+    // Frame boundaries, the buffers whose data moved or resized in between are counted as allocations
+    void beginFrame();
+    void endFrame();
+
+    // Total buffer (re)allocations
+    int64 allocations() const { return mAllocations; }
+    // (Re)allocations of the last frame
+    int lastAllocations() const { return mLastAllocations; }
+    // Bytes (re)allocated in total & by the last frame
+    int64 bytes() const { return mBytes; }
+    size_t lastBytes() const { return mLastBytes; }
+    int64 frames() const { return mFrames; }
+
+private:
+    struct Buffer {
+        const void* owner;
+        const void* (*data)(const void* owner);
+        size_t (*bytes)(const void* owner);
+        // Data & bytes at the frame begin
+        const void* snapshot;
+        size_t snapshotBytes;
+    };
+
+    std::vector<Buffer> mBuffers;
+    int64 mAllocations = 0;
+    int mLastAllocations = 0;
+    int64 mBytes = 0;
+    size_t mLastBytes = 0;
+    int64 mFrames = 0;
+};
+
+#endif //FACE_FRAME_ARENA_H
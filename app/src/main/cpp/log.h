@@ -0,0 +1,38 @@
+#ifndef FACE_LOG_H
+#define FACE_LOG_H
+
+// NOTES:
+// Logging goes to logcat on Android, and to stderr on host builds (e.g. benchmarks)
+// Disabled levels still reference their arguments in an unevaluated sizeof: nothing runs, but the format is
+// checked and locals only used for logging (e.g. a start tick) don't trigger -Wunused-variable.
+#include <cstdio>
+#define FACE_LOG_NONE(...)  ((void)sizeof(fprintf(stderr, __VA_ARGS__)))
+#define DEBUG_FACE
+#ifdef  DEBUG_FACE
+    #define LOG_TAG     "Face"
+    #ifdef __ANDROID__
+    #include <android/log.h>
+    #define LOGD(...)   ((void)__android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__))
+    #define LOGI(...)   ((void)__android_log_print(ANDROID_LOG_INFO,  LOG_TAG, __VA_ARGS__))
+    #define LOGW(...)   ((void)__android_log_print(ANDROID_LOG_WARN,  LOG_TAG, __VA_ARGS__))
+    #define LOGE(...)   ((void)__android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__))
+    #else
+    #define FACE_LOG(level, ...) ((void)(fprintf(stderr, "%s/%s: ", level, LOG_TAG), fprintf(stderr, __VA_ARGS__), fputc('\n', stderr)))
+    #ifdef NDEBUG
+    #define LOGD(...)   FACE_LOG_NONE(__VA_ARGS__)
+    #define LOGI(...)   FACE_LOG_NONE(__VA_ARGS__)
+    #else
+    #define LOGD(...)   FACE_LOG("D", __VA_ARGS__)
+    #define LOGI(...)   FACE_LOG("I", __VA_ARGS__)
+    #endif
+    #define LOGW(...)   FACE_LOG("W", __VA_ARGS__)
+    #define LOGE(...)   FACE_LOG("E", __VA_ARGS__)
+    #endif
+#else
+    #define LOGD(...)   FACE_LOG_NONE(__VA_ARGS__)
+    #define LOGI(...)   FACE_LOG_NONE(__VA_ARGS__)
+    #define LOGW(...)   FACE_LOG_NONE(__VA_ARGS__)
+    #define LOGE(...)   FACE_LOG_NONE(__VA_ARGS__)
+#endif
+
+#endif //FACE_LOG_H
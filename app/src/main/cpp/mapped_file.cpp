@@ -0,0 +1,46 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "mapped_file.h"
+
+#undef  LOG_TAG
+#define LOG_TAG "MappedFile"
+
+using namespace std;
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+bool MappedFile::open(const string& file) {
+    close();
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return false;
+    }
+    void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after the file is closed
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        LOGE("failed to map file: %s", file.c_str());
+        return false;
+    }
+    mData = (uchar*)data;
+    mSize = size_t(st.st_size);
+    return true;
+}
+
+void MappedFile::close() {
+    if (mData) {
+        munmap(mData, mSize);
+        mData = nullptr;
+        mSize = 0;
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef FACE_MAPPED_FILE_H
+#define FACE_MAPPED_FILE_H
+
+#include <string>
+#include <opencv2/core.hpp>
+
+// NOTES:
+// Read-only memory mapping of a whole file. Model data is used in place from the mapping, so loading
+// doesn't copy (or parse) it into the heap, and the pages are shared with the page cache:
+// they're loaded on first access and can be dropped by the kernel under memory pressure.
+class MappedFile {
+public:
+    MappedFile() {}
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& file);
+    void close();
+    bool empty() const { return mData == nullptr; }
+    const uchar* data() const { return mData; }
+    size_t size() const { return mSize; }
+
+private:
+    uchar* mData = nullptr;
+    size_t mSize = 0;
+};
+
+#endif //FACE_MAPPED_FILE_H
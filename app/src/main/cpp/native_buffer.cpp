@@ -0,0 +1,399 @@
+#include <algorithm>
+#include <cstring>
+#include <opencv2/core/hal/intrin.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include "face_metrics.h"
+#include "native_buffer.h"
+
+using namespace std;
+using namespace cv;
+
+void flipImage(const Mat& src, Mat& dst, int flipCode) {
+    if (flipCode == 1) {
+        // OpenCV flip: Horizontal flipping if flipCode > 0
+        flip(src, dst, 1);
+    } else if (flipCode == 2) {
+        // OpenCV flip: Vertical flipping if flipCode == 0
+        flip(src, dst, 0);
+    } else if (flipCode == 3) {
+        // OpenCV flip: Horizontal flipping if flipCode < 0
+        flip(src, dst, -1);
+    } else {
+        // No flipping, just copying
+        src.copyTo(dst);
+    }
+}
+
+void rotateImage(const Mat& src, Mat& dst, int rotateCode) {
+    if (rotateCode == 90) {
+        rotate(src, dst, ROTATE_90_CLOCKWISE);
+    } else if (rotateCode == 180) {
+        rotate(src, dst, ROTATE_180);
+    } else if (rotateCode == 270) {
+        rotate(src, dst, ROTATE_90_COUNTERCLOCKWISE);
+    } else {
+        // no rotating, just copying
+        src.copyTo(dst);
+    }
+}
+
+void decodeImage(const Mat& src, Mat& dst, Mat& buffer) {
+    imdecode(src, IMREAD_COLOR, &buffer);
+    cvtColor(buffer, dst, COLOR_BGR2RGBA);
+}
+
+Size jpegSize(const uchar* data, size_t size) {
+    // SOI, then marker segments until the SOF (start of frame) segment which holds the size
+    if (!data || size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return Size();
+    }
+    size_t i = 2;
+    while (i + 9 <= size) {
+        if (data[i] != 0xFF) {
+            return Size();
+        }
+        const uchar marker = data[i + 1];
+        if (marker == 0xFF) {
+            // Fill byte
+            ++i;
+            continue;
+        }
+        // SOS or EOI before any SOF
+        if (marker == 0xDA || marker == 0xD9) {
+            return Size();
+        }
+        // SOF0..SOF15, except DHT (C4), JPG (C8) & DAC (CC)
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            const int height = (data[i + 5] << 8) | data[i + 6];
+            const int width = (data[i + 7] << 8) | data[i + 8];
+            return Size(width, height);
+        }
+        // Standalone markers have no length
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            i += 2;
+            continue;
+        }
+        i += 2 + ((data[i + 2] << 8) | data[i + 3]);
+    }
+    return Size();
+}
+
+Size jpegScaledSize(const Size& imageSize, int scale) {
+    return Size((imageSize.width + scale - 1)/scale, (imageSize.height + scale - 1)/scale);
+}
+
+int jpegScale(const Size& imageSize, const Size& minSize) {
+    int scale = 8;
+    while (scale > 1) {
+        Size size = jpegScaledSize(imageSize, scale);
+        if (size.width >= minSize.width && size.height >= minSize.height) {
+            break;
+        }
+        scale /= 2;
+    }
+    return scale;
+}
+
+bool decodeImageScaled(const Mat& src, Mat& dst, Mat& buffer) {
+    const Size size = jpegSize(src.data, src.total()*src.elemSize());
+    const int scale = size.empty() ? 1 : jpegScale(size, dst.size());
+    int flags = IMREAD_COLOR;
+    if (scale == 8) {
+        flags = IMREAD_REDUCED_COLOR_8;
+    } else if (scale == 4) {
+        flags = IMREAD_REDUCED_COLOR_4;
+    } else if (scale == 2) {
+        flags = IMREAD_REDUCED_COLOR_2;
+    }
+    imdecode(src, flags | IMREAD_IGNORE_ORIENTATION, &buffer);
+    if (buffer.empty()) {
+        return false;
+    }
+    if (buffer.size() == dst.size()) {
+        cvtColor(buffer, dst, COLOR_BGR2RGBA);
+    } else {
+        // Resized in BGR (3 channels), the BGR buffer of the resized image is kept for next time
+        static thread_local Mat resized;
+        resize(buffer, resized, dst.size(), 0, 0, INTER_AREA);
+        cvtColor(resized, dst, COLOR_BGR2RGBA);
+    }
+    return true;
+}
+
+void decodeImagesScaled(const vector<Mat>& srcs, vector<Mat>& dsts, vector<uchar>& decoded) {
+    decoded.assign(srcs.size(), 0);
+    parallel_for_(Range(0, int(srcs.size())), [&](const Range& range) {
+        static thread_local Mat buffer;
+        for (int i = range.start; i < range.end; ++i) {
+            decoded[i] = decodeImageScaled(srcs[i], dsts[i], buffer) ? 1 : 0;
+        }
+    });
+}
+
+void nv21ToRGBA(const Mat& nv21, Mat& dst) {
+    cvtColor(nv21, dst, COLOR_YUV2RGBA_NV21);
+}
+
+// NOTES:
+// Each block is prefixed by a header holding its capacity, so the data stays 64-byte aligned (fastMalloc)
+static constexpr size_t BLOCK_HEADER = 64;
+
+BufferPool::BufferPool() : mAllocations(0) {
+    mFree.reserve(MAX_FREE_BLOCKS);
+}
+
+BufferPool::~BufferPool() {
+    for (const Block& block: mFree) {
+        fastFree((uchar*)block.data - BLOCK_HEADER);
+    }
+}
+
+void* BufferPool::obtain(size_t capacity) {
+    {
+        lock_guard<mutex> lock(mMutex);
+        for (size_t i = 0; i < mFree.size(); ++i) {
+            if (mFree[i].capacity == capacity) {
+                void* data = mFree[i].data;
+                mFree[i] = mFree.back();
+                mFree.pop_back();
+                return data;
+            }
+        }
+        ++mAllocations;
+    }
+    FaceMetrics::add(FaceMetrics::ALLOCATIONS);
+    FaceMetrics::add(FaceMetrics::ALLOCATED_BYTES, int64(capacity + BLOCK_HEADER));
+    uchar* block = (uchar*)fastMalloc(capacity + BLOCK_HEADER);
+    *(size_t*)block = capacity;
+    return block + BLOCK_HEADER;
+}
+
+void BufferPool::recycle(void* data) {
+    if (!data) {
+        return;
+    }
+    uchar* block = (uchar*)data - BLOCK_HEADER;
+    {
+        lock_guard<mutex> lock(mMutex);
+        if (mFree.size() < MAX_FREE_BLOCKS) {
+            mFree.push_back({ data, *(size_t*)block });
+            return;
+        }
+    }
+    fastFree(block);
+}
+
+// Output tile side of the fused transform, a rotated tile reads TRANSFORM_TILE source rows
+static constexpr int TRANSFORM_TILE = 64;
+
+Size transformedSize(int width, int height, int rotateCode, int scale) {
+    scale = max(scale, 1);
+    if (rotateCode == 90 || rotateCode == 270) {
+        swap(width, height);
+    }
+    return Size(width/scale, height/scale);
+}
+
+// NOTES:
+// Affine map from an output pixel (x, y) to its source block:
+//   sx = x0 + x*xx + y*xy, sy = y0 + x*yx + y*yy
+// An output pixel is a scale*scale block of the rotated & flipped frame, which is an axis-aligned block of
+// the source frame too, whatever the rotation & flip: (sx, sy) is its top-left source pixel.
+struct TransformMap {
+    int x0, xx, xy;
+    int y0, yx, yy;
+
+    TransformMap(int width, int height, int rotateCode, int flipCode, int scale) {
+        const bool rotated = rotateCode == 90 || rotateCode == 270;
+        const int rw = rotated ? height : width;
+        const int rh = rotated ? width : height;
+        // (rx, ry) is a position in the rotated & flipped frame
+        auto map = [&](int rx, int ry, int& sx, int& sy) {
+            if (flipCode == 1 || flipCode == 3) {
+                rx = rw - 1 - rx;
+            }
+            if (flipCode == 2 || flipCode == 3) {
+                ry = rh - 1 - ry;
+            }
+            // Position in the source frame, rotateCode is the same as rotateImage()
+            if (rotateCode == 90) {
+                sx = ry;
+                sy = height - 1 - rx;
+            } else if (rotateCode == 180) {
+                sx = width - 1 - rx;
+                sy = height - 1 - ry;
+            } else if (rotateCode == 270) {
+                sx = width - 1 - ry;
+                sy = rx;
+            } else {
+                sx = rx;
+                sy = ry;
+            }
+        };
+        // Opposite corners of the block of output pixel (0, 0), and the origins of its neighbours
+        int ax, ay, bx, by, x1, y1, x2, y2;
+        map(0, 0, ax, ay);
+        map(scale - 1, scale - 1, bx, by);
+        map(scale, 0, x1, y1);
+        map(0, scale, x2, y2);
+        xx = x1 - ax;
+        yx = y1 - ay;
+        xy = x2 - ax;
+        yy = y2 - ay;
+        x0 = min(ax, bx);
+        y0 = min(ay, by);
+    }
+};
+
+// NOTES:
+// Downscaled pixels are the mean of their scale*scale block (rounded), the same as resize(..., INTER_AREA)
+// of an integer factor: nearest sampling would alias fine patterns (hair, textures, screens) into the
+// detector input. Every source pixel is read once then, still in one pass without intermediate image.
+// YUV is averaged before the conversion, chroma at every luma position of the block like the 2x2 upsampling
+// of cvtColor: the conversion is affine, so it's the same as converting then averaging except for clamping.
+
+// Mean of the scale*scale block of Y, U & V at (sx, sy)
+static inline void blockMeanYUV(const YUVPlanes& yuv, int sx, int sy, int scale, uchar& y, uchar& u, uchar& v) {
+    int sumY = 0, sumU = 0, sumV = 0;
+    for (int j = sy; j < sy + scale; ++j) {
+        const uchar* row = yuv.y + j*yuv.yStride;
+        const uchar* uRow = yuv.u + (j >> 1)*yuv.uvStride;
+        const uchar* vRow = yuv.v + (j >> 1)*yuv.uvStride;
+        for (int i = sx; i < sx + scale; ++i) {
+            const int uv = (i >> 1)*yuv.uvPixelStride;
+            sumY += row[i];
+            sumU += uRow[uv];
+            sumV += vRow[uv];
+        }
+    }
+    const int area = scale*scale;
+    y = uchar((sumY + area/2)/area);
+    u = uchar((sumU + area/2)/area);
+    v = uchar((sumV + area/2)/area);
+}
+
+// Mean of the scale*scale block of RGBA pixels at p, as one 32-bit word
+static inline unsigned blockMeanRGBA(const uchar* p, size_t step, int scale) {
+    int sum[4] = { 0, 0, 0, 0 };
+    for (int j = 0; j < scale; ++j, p += step) {
+        for (int i = 0; i < scale*4; i += 4) {
+            sum[0] += p[i];
+            sum[1] += p[i + 1];
+            sum[2] += p[i + 2];
+            sum[3] += p[i + 3];
+        }
+    }
+    const int area = scale*scale;
+    uchar mean[4];
+    for (int c = 0; c < 4; ++c) {
+        mean[c] = uchar((sum[c] + area/2)/area);
+    }
+    unsigned word;
+    memcpy(&word, mean, sizeof(word));
+    return word;
+}
+
+// NOTES:
+// BT.601 YUV->RGBA of n gathered samples, the same coefficients as face_preprocess.cpp
+static void yuvToRGBA(const uchar* y, const uchar* u, const uchar* v, int n, uchar* dst) {
+    constexpr float CY = 1.164f, CVR = 1.596f, CVG = -0.813f, CUG = -0.391f, CUB = 2.018f;
+    int i = 0;
+#if CV_SIMD128
+    v_float32x4 vzero = v_setzero_f32();
+    v_float32x4 v16 = v_setall_f32(16.f), v128 = v_setall_f32(128.f);
+    v_float32x4 vcy = v_setall_f32(CY), vcvr = v_setall_f32(CVR), vcvg = v_setall_f32(CVG);
+    v_float32x4 vcug = v_setall_f32(CUG), vcub = v_setall_f32(CUB);
+    v_uint8x16 alpha = v_setall_u8(255);
+    for (; i <= n - 16; i += 16) {
+        v_int32x4 r[4], g[4], b[4];
+        for (int k = 0; k < 4; ++k) {
+            v_float32x4 yy = v_cvt_f32(v_reinterpret_as_s32(v_load_expand_q(y + i + k*4)));
+            v_float32x4 uu = v_cvt_f32(v_reinterpret_as_s32(v_load_expand_q(u + i + k*4))) - v128;
+            v_float32x4 vv = v_cvt_f32(v_reinterpret_as_s32(v_load_expand_q(v + i + k*4))) - v128;
+            yy = v_max(yy - v16, vzero)*vcy;
+            r[k] = v_round(yy + vv*vcvr);
+            g[k] = v_round(yy + vv*vcvg + uu*vcug);
+            b[k] = v_round(yy + uu*vcub);
+        }
+        // Saturating packs clamp to [0, 255]
+        v_uint8x16 vr = v_pack_u(v_pack(r[0], r[1]), v_pack(r[2], r[3]));
+        v_uint8x16 vg = v_pack_u(v_pack(g[0], g[1]), v_pack(g[2], g[3]));
+        v_uint8x16 vb = v_pack_u(v_pack(b[0], b[1]), v_pack(b[2], b[3]));
+        v_store_interleave(dst + i*4, vr, vg, vb, alpha);
+    }
+#endif
+    for (; i < n; ++i) {
+        float yy = max(y[i] - 16.f, 0.f)*CY;
+        float uu = u[i] - 128.f;
+        float vv = v[i] - 128.f;
+        uchar* p = dst + i*4;
+        p[0] = saturate_cast<uchar>(yy + vv*CVR);
+        p[1] = saturate_cast<uchar>(yy + vv*CVG + uu*CUG);
+        p[2] = saturate_cast<uchar>(yy + uu*CUB);
+        p[3] = 255;
+    }
+}
+
+void transformYUV(const YUVPlanes& yuv, Mat& dst, int rotateCode, int flipCode, int scale) {
+    scale = max(scale, 1);
+    dst.create(transformedSize(yuv.width, yuv.height, rotateCode, scale), CV_8UC4);
+    const TransformMap m(yuv.width, yuv.height, rotateCode, flipCode, scale);
+
+    parallel_for_(Range(0, (dst.rows + TRANSFORM_TILE - 1)/TRANSFORM_TILE), [&](const Range& range) {
+        // Gathered samples of a tile row
+        uchar ys[TRANSFORM_TILE], us[TRANSFORM_TILE], vs[TRANSFORM_TILE];
+        for (int ty = range.start*TRANSFORM_TILE; ty < min(range.end*TRANSFORM_TILE, dst.rows); ty += TRANSFORM_TILE) {
+            for (int tx = 0; tx < dst.cols; tx += TRANSFORM_TILE) {
+                const int n = min(TRANSFORM_TILE, dst.cols - tx);
+                for (int y = ty; y < min(ty + TRANSFORM_TILE, dst.rows); ++y) {
+                    int sx = m.x0 + tx*m.xx + y*m.xy;
+                    int sy = m.y0 + tx*m.yx + y*m.yy;
+                    if (scale > 1) {
+                        for (int i = 0; i < n; ++i, sx += m.xx, sy += m.yx) {
+                            blockMeanYUV(yuv, sx, sy, scale, ys[i], us[i], vs[i]);
+                        }
+                    } else {
+                        for (int i = 0; i < n; ++i, sx += m.xx, sy += m.yx) {
+                            int uv = (sy >> 1)*yuv.uvStride + (sx >> 1)*yuv.uvPixelStride;
+                            ys[i] = yuv.y[sy*yuv.yStride + sx];
+                            us[i] = yuv.u[uv];
+                            vs[i] = yuv.v[uv];
+                        }
+                    }
+                    yuvToRGBA(ys, us, vs, n, dst.ptr<uchar>(y, tx));
+                }
+            }
+        }
+    });
+}
+
+void transformRGBA(const Mat& src, Mat& dst, int rotateCode, int flipCode, int scale) {
+    CV_Assert(src.type() == CV_8UC4 && src.data != dst.data);
+    scale = max(scale, 1);
+    dst.create(transformedSize(src.cols, src.rows, rotateCode, scale), CV_8UC4);
+    const TransformMap m(src.cols, src.rows, rotateCode, flipCode, scale);
+
+    parallel_for_(Range(0, (dst.rows + TRANSFORM_TILE - 1)/TRANSFORM_TILE), [&](const Range& range) {
+        for (int ty = range.start*TRANSFORM_TILE; ty < min(range.end*TRANSFORM_TILE, dst.rows); ty += TRANSFORM_TILE) {
+            for (int tx = 0; tx < dst.cols; tx += TRANSFORM_TILE) {
+                const int n = min(TRANSFORM_TILE, dst.cols - tx);
+                for (int y = ty; y < min(ty + TRANSFORM_TILE, dst.rows); ++y) {
+                    int sx = m.x0 + tx*m.xx + y*m.xy;
+                    int sy = m.y0 + tx*m.yx + y*m.yy;
+                    // A RGBA pixel is copied as one 32-bit word
+                    unsigned* out = dst.ptr<unsigned>(y, tx);
+                    if (scale > 1) {
+                        for (int i = 0; i < n; ++i, sx += m.xx, sy += m.yx) {
+                            out[i] = blockMeanRGBA(src.ptr(sy, sx), src.step, scale);
+                        }
+                    } else {
+                        for (int i = 0; i < n; ++i, sx += m.xx, sy += m.yx) {
+                            out[i] = src.ptr<unsigned>(sy)[sx];
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
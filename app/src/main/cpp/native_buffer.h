@@ -0,0 +1,83 @@
+#ifndef FACE_NATIVE_BUFFER_H
+#define FACE_NATIVE_BUFFER_H
+
+#include <mutex>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "face_preprocess.h"
+
+// NOTES:
+// Image kernels behind com.hangsheng.face.NativeBuffer, kept free of JNI so they can be benchmarked on host.
+// All images are RGBA_8888 unless otherwise noted, dst must be allocated by the caller.
+
+// flipCode: 0 - No flipping, 1 - Horizontal flipping  2 - Vertical flipping, 3 - Horizontal & Vertical flipping
+void flipImage(const cv::Mat& src, cv::Mat& dst, int flipCode);
+// rotateCode - counterclockwise rotate degrees: 0, 90, 180, 270
+void rotateImage(const cv::Mat& src, cv::Mat& dst, int rotateCode);
+// Decode JPEG/PNG/... encoded data to dst, the BGR image is decoded into buffer (reused if its size matches)
+void decodeImage(const cv::Mat& src, cv::Mat& dst, cv::Mat& buffer);
+
+// NOTES:
+// Reduced-resolution JPEG decode: libjpeg can decode at 1/2, 1/4 or 1/8 scale in the DCT domain
+// (IMREAD_REDUCED_COLOR_*), which skips most of the IDCT & color conversion work, instead of decoding
+// e.g. a 12MP photo at full size only to shrink it to the detector input size.
+// The scale is picked from the JPEG header (SOF marker) without decoding, as the largest one whose
+// decoded size still covers the requested size. A decoded size of a scale is rounded up, like libjpeg.
+// EXIF orientation isn't applied, so the decoded size is known in advance.
+
+// Size of JPEG data from its header, empty if data isn't a JPEG
+cv::Size jpegSize(const uchar* data, size_t size);
+// Largest DCT scale (1, 2, 4 or 8) whose decoded size covers minSize
+int jpegScale(const cv::Size& imageSize, const cv::Size& minSize);
+cv::Size jpegScaledSize(const cv::Size& imageSize, int scale);
+// Decode JPEG data to dst (RGBA, allocated by caller) at the scale picked for dst size. BGR is decoded into
+// buffer (reused if its size matches), and converted straight into dst if dst has the decoded size,
+// otherwise resized into it. Non-JPEG data is decoded at full size. Returns false if data can't be decoded
+bool decodeImageScaled(const cv::Mat& src, cv::Mat& dst, cv::Mat& buffer);
+// Decode many images in parallel, decoded[i] tells whether srcs[i] is decoded
+void decodeImagesScaled(const std::vector<cv::Mat>& srcs, std::vector<cv::Mat>& dsts, std::vector<uchar>& decoded);
+
+// nv21 is a CV_8UC1 Mat with height*3/2 rows
+void nv21ToRGBA(const cv::Mat& nv21, cv::Mat& dst);
+
+// NOTES:
+// Fused camera frame transform: the same result as nv21ToRGBA/rotateImage/flipImage applied in turn
+// (rotate first, then flip), plus an optional downscale by an integer factor (block mean, like INTER_AREA),
+// but each output pixel is written once and no intermediate image is created. Rows & columns of the
+// rotated & flipped frame left over by the downscale (size not a multiple of scale) are dropped.
+// The output is written tile by tile, so the source rows read by a rotated tile stay in cache.
+// dst is (re)allocated to transformedSize().
+cv::Size transformedSize(int width, int height, int rotateCode, int scale);
+void transformYUV(const YUVPlanes& yuv, cv::Mat& dst, int rotateCode, int flipCode, int scale = 1);
+void transformRGBA(const cv::Mat& src, cv::Mat& dst, int rotateCode, int flipCode, int scale = 1);
+
+// NOTES:
+// Pool of native memory backing the direct ByteBuffers of NativeBuffer.
+// Recycled blocks are kept by capacity (i.e. by frame resolution), so a steady stream of frames
+// reuses the same few blocks, without heap allocations nor Java GC of direct buffers.
+class BufferPool {
+public:
+    BufferPool();
+    ~BufferPool();
+
+    // Get a block of at least capacity bytes
+    void* obtain(size_t capacity);
+    // Give a block back to the pool, it's freed if the pool is full
+    void recycle(void* data);
+
+    // Total blocks allocated from the heap
+    int64 allocations() const { return mAllocations; }
+
+private:
+    struct Block {
+        void* data;
+        size_t capacity;
+    };
+    static constexpr int MAX_FREE_BLOCKS = 8;
+
+    std::mutex mMutex;
+    std::vector<Block> mFree;
+    int64 mAllocations;
+};
+
+#endif //FACE_NATIVE_BUFFER_H
@@ -1,5 +1,6 @@
 #include <pthread.h>
 #include "utils.h"
+#include "face_metrics.h"
 
 // NOTES:
 // Each Android application owns only one JavaVM
@@ -7,6 +8,49 @@
 static JavaVM* gJavaVM;
 static pthread_key_t gThreadKey;
 
+// NOTES:
+// Classes & member IDs are looked up once in JNI_OnLoad, rather than by every call.
+// Classes are kept as global references so their IDs stay valid.
+static struct {
+    jclass clazz;
+    jmethodID constructor;
+    jfieldID left;
+    jfieldID top;
+    jfieldID right;
+    jfieldID bottom;
+} gRectClass;
+
+static struct {
+    jclass clazz;
+    jmethodID constructor;
+} gPointFClass;
+
+static bool cacheClasses(JNIEnv* env) {
+    // Rect class: android.graphics.Rect
+    // Rect constructor: Rect(int left, int top, int right, int bottom);
+    jclass rectClass = env->FindClass("android/graphics/Rect");
+    if (!rectClass) {
+        return false;
+    }
+    gRectClass.clazz = (jclass)env->NewGlobalRef(rectClass);
+    gRectClass.constructor = env->GetMethodID(rectClass, "<init>", "(IIII)V");
+    gRectClass.left = env->GetFieldID(rectClass, "left", "I");
+    gRectClass.top = env->GetFieldID(rectClass, "top", "I");
+    gRectClass.right = env->GetFieldID(rectClass, "right", "I");
+    gRectClass.bottom = env->GetFieldID(rectClass, "bottom", "I");
+    env->DeleteLocalRef(rectClass);
+
+    // PointF class: android.graphics.PointF
+    // PointF constructor: PointF(float x, float y);
+    jclass pointfClass = env->FindClass("android/graphics/PointF");
+    if (!pointfClass) {
+        return false;
+    }
+    gPointFClass.clazz = (jclass)env->NewGlobalRef(pointfClass);
+    gPointFClass.constructor = env->GetMethodID(pointfClass, "<init>", "(FF)V");
+    env->DeleteLocalRef(pointfClass);
+    return true;
+}
 
 
 // NOTES:
@@ -29,6 +73,10 @@ JNIEXPORT jint JNI_OnLoad(JavaVM* vm, void* reserved) {
     if (pthread_key_create(&gThreadKey, onThreadExt)) {
         LOGE("Error initializing pthread key");
     }
+    if (!cacheClasses(env)) {
+        LOGE("Failed to find classes");
+        return -1;
+    }
     return JNI_VERSION_1_6;
 }
 
@@ -52,53 +100,41 @@ cv::Rect toRect(jobject javaRect, JNIEnv* env) {
         env = getJNIEnv();
     }
 
-    jclass rectClass = env->FindClass("android/graphics/Rect");
-    jfieldID leftID = env->GetFieldID(rectClass, "left", "I");
-    jfieldID topID = env->GetFieldID(rectClass, "top", "I");
-    jfieldID rightID = env->GetFieldID(rectClass, "right", "I");
-    jfieldID bottomID = env->GetFieldID(rectClass, "bottom", "I");
-
     cv::Rect rect;
-    rect.x = env->GetIntField(javaRect, leftID);
-    rect.y = env->GetIntField(javaRect, topID);
-    rect.width = env->GetIntField(javaRect, rightID) - rect.x;
-    rect.height = env->GetIntField(javaRect, bottomID) - rect.y;
+    rect.x = env->GetIntField(javaRect, gRectClass.left);
+    rect.y = env->GetIntField(javaRect, gRectClass.top);
+    rect.width = env->GetIntField(javaRect, gRectClass.right) - rect.x;
+    rect.height = env->GetIntField(javaRect, gRectClass.bottom) - rect.y;
     return rect;
 }
 
 jobjectArray newRectArray(const std::vector<cv::Rect>& rects, JNIEnv* env) {
+    FACE_METRIC_SCOPE(JNI);
     if (!env) {
         env = getJNIEnv();
     }
 
-    // Rect class: android.graphics.Rect
-    // Rect constructor: Rect(int left, int top, int right, int bottom);
-    jclass rectClass = env->FindClass("android/graphics/Rect");
-    jmethodID rectConstructor =  env->GetMethodID(rectClass, "<init>", "(IIII)V");
-    jobject rectObject = env->NewObject(rectClass, rectConstructor, 0, 0, 0, 0);
-    jobjectArray rectArray = env->NewObjectArray(rects.size(), rectClass, rectObject);
+    jobjectArray rectArray = env->NewObjectArray(rects.size(), gRectClass.clazz, nullptr);
     for (int i=0; i < rects.size(); ++i) {
-        jobject faceObject = env->NewObject(rectClass, rectConstructor,
+        jobject faceObject = env->NewObject(gRectClass.clazz, gRectClass.constructor,
                 rects[i].x, rects[i].y, rects[i].x + rects[i].width, rects[i].y + rects[i].height);
         env->SetObjectArrayElement(rectArray, i, faceObject);
+        env->DeleteLocalRef(faceObject);
     }
     return rectArray;
 }
 
 jobjectArray newPointFArray(const std::vector<cv::Point2f>& points, JNIEnv* env) {
+    FACE_METRIC_SCOPE(JNI);
     if (!env) {
         env = getJNIEnv();
     }
-    // RointF class: android.graphics.RointF
-    // Rect constructor: RointF(float x, float y);
-    jclass pointfClass = env->FindClass("android/graphics/PointF");
-    jmethodID pointfConstructor =  env->GetMethodID(pointfClass, "<init>", "(FF)V");
-    jobject pointfObject = env->NewObject(pointfClass, pointfConstructor, 0.0f, 0.0f);
-    jobjectArray pointfArray = env->NewObjectArray(points.size(), pointfClass, pointfObject);
+
+    jobjectArray pointfArray = env->NewObjectArray(points.size(), gPointFClass.clazz, nullptr);
     for (int i=0; i < points.size(); ++i) {
-        jobject mark = env->NewObject(pointfClass, pointfConstructor, points[i].x, points[i].y);
+        jobject mark = env->NewObject(gPointFClass.clazz, gPointFClass.constructor, points[i].x, points[i].y);
         env->SetObjectArrayElement(pointfArray, i, mark);
+        env->DeleteLocalRef(mark);
     }
     return pointfArray;
 }
-
@@ -5,20 +5,7 @@
 #include <vector>
 #include <opencv2/core.hpp>
 
-#define DEBUG_FACE
-#ifdef  DEBUG_FACE
-    #include <android/log.h>
-    #define LOG_TAG     "Face"
-    #define LOGD(...)   ((void)__android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__))
-    #define LOGI(...)   ((void)__android_log_print(ANDROID_LOG_INFO,  LOG_TAG, __VA_ARGS__))
-    #define LOGW(...)   ((void)__android_log_print(ANDROID_LOG_WARN,  LOG_TAG, __VA_ARGS__))
-    #define LOGE(...)   ((void)__android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__))
-#else
-    #define LOGD(...)
-    #define LOGI(...)
-    #define LOGW(...)
-    #define LOGE(...)
-#endif
+#include "log.h"
 
 
 JNIEnv* getJNIEnv();
@@ -10,6 +10,7 @@ import android.graphics.PointF;
 import android.graphics.Rect;
 import android.media.Image;
 import android.os.Environment;
+import android.view.Surface;
 
 import java.io.File;
 import java.io.FileOutputStream;
@@ -17,54 +18,512 @@ import java.io.IOException;
 import java.io.InputStream;
 import java.io.OutputStream;
 import java.nio.ByteBuffer;
+import java.util.concurrent.locks.ReentrantReadWriteLock;
 import java.util.logging.Handler;
 
 public class FaceDetector {
+    // Inference precision of face detection, see setPrecision()
+    public static final int PRECISION_FP32 = 0;
+    public static final int PRECISION_FP16 = 1;
+    public static final int PRECISION_INT8 = 2;
 
-    // Native face detector handle
-    private long mNativeHandle = 0;
+    // Native face detector handle, set by the loader thread of openAsync()
+    private volatile long mNativeHandle = 0;
+    private boolean mClosed = false;
+    // Native asynchronous pipeline handle
+    private long mPipelineHandle = 0;
+    // NOTES:
+    // Calls using the native handles hold the read lock (see acquire()), close() & setAsync() which delete them
+    // hold the write lock: close() waits for the calls in flight, and no call runs on a deleted detector.
+    // Calls still run concurrently with each other, as before.
+    private final ReentrantReadWriteLock mLock = new ReentrantReadWriteLock();
 
 
     public boolean open() {
-        mNativeHandle = nativeCreate(Environment.getExternalStorageDirectory() + "/Face");
+        mNativeHandle = nativeCreate(Environment.getExternalStorageDirectory() + "/Face", false);
         return (mNativeHandle != 0);
     }
 
-    public void close() {
-        if (mNativeHandle != 0) {
-            nativeDestroy(mNativeHandle);
+    // NOTES:
+    // Load models on a background thread, optionally with a warm-up inference, so neither the caller
+    // nor the first frame waits for it. Frames are ignored (process() returns false) until it's opened,
+    // then onOpened (if not null) is run on the loader thread.
+    public void openAsync(final boolean warmUp, final Runnable onOpened) {
+        final String modelDir = Environment.getExternalStorageDirectory() + "/Face";
+        new Thread(new Runnable() {
+            @Override
+            public void run() {
+                long handle = nativeCreate(modelDir, warmUp);
+                synchronized (FaceDetector.this) {
+                    if (mClosed) {
+                        if (handle != 0) {
+                            nativeDestroy(handle);
+                        }
+                        return;
+                    }
+                    mNativeHandle = handle;
+                }
+                if (handle != 0 && onOpened != null) {
+                    onOpened.run();
+                }
+            }
+        }, "FaceDetectorLoader").start();
+    }
+
+    public synchronized void close() {
+        mLock.writeLock().lock();
+        try {
+            setAsync(false);
+            mClosed = true;
+            if (mNativeHandle != 0) {
+                nativeDestroy(mNativeHandle);
+                mNativeHandle = 0;
+            }
+        } finally {
+            mLock.writeLock().unlock();
+        }
+    }
+
+    // Native handle with the read lock held, to be released by release(). Returns 0 (no lock held) if not opened
+    private long acquire() {
+        mLock.readLock().lock();
+        long handle = mNativeHandle;
+        if (handle == 0) {
+            mLock.readLock().unlock();
+        }
+        return handle;
+    }
+
+    private void release() {
+        mLock.readLock().unlock();
+    }
+
+    // Same as acquire(), but also returns 0 while the async pipeline is running: its stages use the native detector
+    // (tracker, network buffers, results) without locks, so no other call may use it until setAsync(false)
+    private long acquireDetector() {
+        long handle = acquire();
+        if (handle != 0 && mPipelineHandle != 0) {
+            release();
+            return 0;
+        }
+        return handle;
+    }
+
+    // NOTES:
+    // In async mode, process() returns immediately after the frame is submitted to the native pipeline,
+    // draw() shows the frame with the results of the latest processed frame (which may be a few frames behind).
+    // The pipeline owns the native detector while it runs: the other calls (settings, findFaces(), analyze(),
+    // getMarks(), ...) do nothing and return their "not opened" value until async mode is turned off.
+    public void setAsync(boolean async) {
+        mLock.writeLock().lock();
+        try {
+            if (async && mPipelineHandle == 0 && mNativeHandle != 0) {
+                mPipelineHandle = nativeCreatePipeline(mNativeHandle);
+            } else if (!async && mPipelineHandle != 0) {
+                nativeDestroyPipeline(mPipelineHandle);
+                mPipelineHandle = 0;
+            }
+        } finally {
+            mLock.writeLock().unlock();
         }
     }
 
     public boolean process(NativeBuffer nativeBuffer) {
-        if (mNativeHandle == 0 || nativeBuffer.getFormat() != PixelFormat.RGBA_8888) {
+        if (nativeBuffer.getFormat() != PixelFormat.RGBA_8888) {
             return false;
         }
-       nativeProcess(mNativeHandle,  nativeBuffer.getByteBuffer(),
-               nativeBuffer.getWidth(), nativeBuffer.getHeight(), nativeBuffer.getStride());
-        return true;
+        long handle = acquire();
+        if (handle == 0) {
+            return false;
+        }
+        try {
+            if (mPipelineHandle != 0) {
+                nativeProcessAsync(mPipelineHandle, nativeBuffer.getByteBuffer(),
+                        nativeBuffer.getWidth(), nativeBuffer.getHeight(), nativeBuffer.getStride());
+                return true;
+            }
+            nativeProcess(handle, nativeBuffer.getByteBuffer(),
+                    nativeBuffer.getWidth(), nativeBuffer.getHeight(), nativeBuffer.getStride());
+            return true;
+        } finally {
+            release();
+        }
+    }
+
+    // NOTES:
+    // Draw the frame into the surface with the results of the latest process()/analyze() on top.
+    // The results are drawn in display space while the frame is scaled into the surface,
+    // process() never draws into the frame itself.
+    public void draw(NativeBuffer nativeBuffer, Surface output) {
+        long handle = acquire();
+        if (handle == 0) {
+            nativeBuffer.draw(output);
+            return;
+        }
+        try {
+            if (nativeBuffer.getFormat() == PixelFormat.RGBA_8888) {
+                nativeDraw(handle, output, nativeBuffer.getByteBuffer(),
+                        nativeBuffer.getWidth(), nativeBuffer.getHeight(), nativeBuffer.getStride());
+            }
+        } finally {
+            release();
+        }
+    }
+
+    // NOTES:
+    // Detect-then-track mode: run the detector only every detectInterval frames (or when tracking is lost),
+    // and track the detected faces in between. The detector also runs when the tracking confidence of any face
+    // drops below minConfidence, or (detectOnLoss) when a face is lost. A detection is associated with a track
+    // if their IoU is at least matchThreshold. Each face is tracked with gridSize*gridSize points, a point is
+    // dropped if its forward-backward error is above maxError pixels.
+    public void setTracking(boolean enabled, int detectInterval, float minConfidence, boolean detectOnLoss,
+                            float matchThreshold, int gridSize, float maxError) {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return;
+        }
+        try {
+            nativeSetTracking(handle, enabled, detectInterval, minConfidence, detectOnLoss,
+                    matchThreshold, gridSize, maxError);
+        } finally {
+            release();
+        }
+    }
+
+    public void setTracking(boolean enabled, int detectInterval) {
+        setTracking(enabled, detectInterval, 0.5f, true, 0.3f, 5, 2.0f);
+    }
+
+    // NOTES:
+    // Multi-scale mode for high resolution images: the image is scaled by each of scales, and split into
+    // overlapping tiles of tileSize pixels (overlap is a fraction of tileSize), optionally plus the whole image.
+    // Smaller tiles & more scales find smaller faces, at the cost of more network runs.
+    // Scales must be > 0. Without the global view, overlap is at least 0.1 (the smallest face of the network).
+    // Detections below confidenceThreshold are dropped, the others are merged by NMS of nmsThreshold (IoU).
+    public void setMultiScale(boolean enabled, int tileSize, float overlap, float[] scales, boolean globalView,
+                              float confidenceThreshold, float nmsThreshold) {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return;
+        }
+        try {
+            nativeSetMultiScale(handle, enabled, tileSize, overlap, scales, globalView,
+                    confidenceThreshold, nmsThreshold);
+        } finally {
+            release();
+        }
+    }
+
+    public void setMultiScale(boolean enabled, int tileSize, float overlap, float[] scales, boolean globalView) {
+        setMultiScale(enabled, tileSize, overlap, scales, globalView, 0.5f, 0.4f);
+    }
+
+    // NOTES:
+    // Inference precision of face detection: PRECISION_FP16 runs FP16 arithmetic (fast on ARMv8.2+),
+    // PRECISION_INT8 quantizes the network, calibrated with the images of <model dir>/calibration.
+    // Once INT8 is set, the precision can't be changed again. Returns false if the precision isn't supported.
+    public boolean setPrecision(int precision) {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return false;
+        }
+        try {
+            return nativeSetPrecision(handle, precision, Environment.getExternalStorageDirectory() + "/Face/calibration");
+        } finally {
+            release();
+        }
+    }
+
+    // NOTES:
+    // Landmark cache of tracked faces (detect-then-track mode, analyze()): a face whose downscaled crop
+    // barely changed since its landmarks were fitted reuses them, moved along with its box.
+    // threshold is the max mean absolute difference of gray levels (0-255), 0 for the default.
+    public void setLandmarkCache(boolean enabled, float threshold) {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return;
+        }
+        try {
+            nativeSetLandmarkCache(handle, enabled, threshold);
+        } finally {
+            release();
+        }
+    }
+
+    // Landmark cache counters: { hits, misses }
+    public long[] getLandmarkCacheStats() {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return null;
+        }
+        try {
+            return nativeGetLandmarkCacheStats(handle);
+        } finally {
+            release();
+        }
+    }
+
+    // NOTES:
+    // Latency budget (ms per frame) of process()/analyze(), 0 disables it. To stay within the budget,
+    // the detector input size is reduced first (300 -> 224 -> 160), then landmarks are fitted less often
+    // (in detect-then-track mode), then frames are skipped (a skipped frame returns the last results).
+    public void setLatencyBudget(float budgetMs) {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return;
+        }
+        try {
+            nativeSetGovernor(handle, budgetMs > 0, budgetMs);
+        } finally {
+            release();
+        }
+    }
+
+    // Current decisions of the latency budget: { level, inputSize, landmarkInterval, frameSkip, frameMs, costMs },
+    // level 0 is the best quality
+    public float[] getGovernorDecision() {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return null;
+        }
+        try {
+            return nativeGetGovernor(handle);
+        } finally {
+            release();
+        }
+    }
+
+    // Start recording the timeline of the native stages of every frame (capture, convert, detect, landmark, draw)
+    // on all threads, keeping the last eventsPerThread events of each thread. Tracing is process wide
+    public static void startTrace(int eventsPerThread) {
+        nativeStartTrace(eventsPerThread);
+    }
+
+    public static void stopTrace() {
+        nativeStopTrace();
+    }
+
+    // Write the events recorded since startTrace() to file, in the Chrome trace format (JSON) which is opened by
+    // chrome://tracing or ui.perfetto.dev. Returns false if it can't be written or tracing is compiled out
+    public static boolean dumpTrace(String file) {
+        return nativeDumpTrace(file);
+    }
+
+    // NOTES:
+    // Always-on stage metrics, process wide, packed as (all values are longs):
+    //   header:     { version, histograms, buckets, counters, window start (ms), window length (ms) }
+    //   histograms: { count, sum, max, buckets[buckets] } per histogram, latencies in microseconds
+    //   counters:   one value per counter
+    // Bucket 0 counts values < 1, bucket k values in [2^(k-1), 2^k), the last bucket everything above.
+    // Histograms & counters are in the order of getMetricNames(). reset starts a new window after the snapshot,
+    // e.g. call getMetrics(true) once per reporting period.
+    public static long[] getMetrics(boolean reset) {
+        return nativeGetMetrics(reset);
+    }
+
+    // Names of the histograms (convert, blob, forward, parse, landmark, jni, ...) then the counters
+    // (frames, frames_dropped, ...) of getMetrics()
+    public static String[] getMetricNames() {
+        return nativeGetMetricNames();
+    }
+
+    // Landmark cascade stages: stages for a new face (0 for all), and the last warmStages for a tracked face
+    // which starts from its landmarks of the last frame (see analyze())
+    public void setLandmarkStages(int stages, int warmStages) {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return;
+        }
+        try {
+            nativeSetLandmarkStages(handle, stages, warmStages);
+        } finally {
+            release();
+        }
+    }
+
+    // Native buffer (re)allocations by process(), it stops increasing once warmed up. A lower bound: only the
+    // frame buffers of the detector are watched, not allocations inside OpenCV (see FrameArena)
+    public long getAllocations() {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return 0;
+        }
+        try {
+            return nativeAllocations(handle);
+        } finally {
+            release();
+        }
     }
 
     public Rect[] findFaces(NativeBuffer nativeBuffer) {
-        Rect[] objectRects = new Rect[0];
-        if (mNativeHandle != 0 && nativeBuffer.getFormat() == PixelFormat.RGBA_8888) {
-            objectRects = nativeDetect(mNativeHandle,  nativeBuffer.getByteBuffer(),
+        if (nativeBuffer.getFormat() != PixelFormat.RGBA_8888) {
+            return new Rect[0];
+        }
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return new Rect[0];
+        }
+        try {
+            return nativeDetect(handle, nativeBuffer.getByteBuffer(),
                     nativeBuffer.getWidth(), nativeBuffer.getHeight(), nativeBuffer.getStride());
+        } finally {
+            release();
+        }
+    }
+
+    public Rect[] findFaces(byte[] nv21, int width, int height) {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return new Rect[0];
+        }
+        try {
+            return nativeDetectNV21(handle, nv21, width, height);
+        } finally {
+            release();
+        }
+    }
+
+    // Detect faces (or track them in detect-then-track mode) and fit their landmarks with one native call,
+    // all results are written into results (see newResults()). Returns the number of faces in results
+    public int analyze(NativeBuffer nativeBuffer, FaceResults results, boolean landmarks) {
+        if (nativeBuffer.getFormat() != PixelFormat.RGBA_8888) {
+            return 0;
+        }
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return 0;
+        }
+        try {
+            return nativeAnalyze(handle, nativeBuffer.getByteBuffer(), nativeBuffer.getWidth(),
+                    nativeBuffer.getHeight(), nativeBuffer.getStride(), results.getByteBuffer(), landmarks);
+        } finally {
+            release();
+        }
+    }
+
+    // Results for analyze() with room for maxFaces faces, with the landmarks per face of the loaded model.
+    // Returns null if not opened yet
+    public FaceResults newResults(int maxFaces) {
+        // The landmark model doesn't change once loaded, it's read even while the async pipeline runs
+        long handle = acquire();
+        if (handle == 0) {
+            return null;
+        }
+        try {
+            return new FaceResults(maxFaces, nativeLandmarkCount(handle));
+        } finally {
+            release();
         }
-        return objectRects;
     }
 
     public PointF[] getMarks(NativeBuffer nativeBuffer, Rect face) {
-        PointF[] marks = new PointF[0];
-        if (mNativeHandle != 0 && nativeBuffer.getFormat() == PixelFormat.RGBA_8888) {
-            marks = nativeGetMarks(mNativeHandle, nativeBuffer.getByteBuffer(),
+        if (nativeBuffer.getFormat() != PixelFormat.RGBA_8888) {
+            return new PointF[0];
+        }
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return new PointF[0];
+        }
+        try {
+            return nativeGetMarks(handle, nativeBuffer.getByteBuffer(),
                     nativeBuffer.getWidth(), nativeBuffer.getHeight(), nativeBuffer.getStride(), face);
+        } finally {
+            release();
+        }
+    }
+
+    // Landmarks of faces fitted on the Y plane of a camera frame (e.g. plane 0 of a YUV_420_888 Image), without
+    // converting the frame to RGBA. Returned packed as { x0, y0, x1, y1, ... } face by face, null on failure
+    public float[] getMarks(ByteBuffer yPlane, int width, int height, int rowStride, Rect[] faces) {
+        if (!yPlane.isDirect()) {
+            return null;
+        }
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return null;
+        }
+        try {
+            return nativeGetMarksY(handle, yPlane, width, height, rowStride, packRects(faces));
+        } finally {
+            release();
+        }
+    }
+
+    // Same as above, on the Y plane of a NV21 frame
+    public float[] getMarks(byte[] nv21, int width, int height, Rect[] faces) {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return null;
+        }
+        try {
+            return nativeGetMarksNV21(handle, nv21, width, height, packRects(faces));
+        } finally {
+            release();
         }
-        return marks;
+    }
+
+    // NOTES:
+    // Aligned face chips for a second network (e.g. recognition): each face is rotated & scaled by its eye centers
+    // and mouth corners onto a width x height chip, of 3 (RGB, or BGR with swapRB) or 1 (gray) channels.
+    // Chips are uint8, or float32 normalized as (value - mean)*scale with normalize. Defaults: 112x112 RGB,
+    // normalized with mean 127.5 & scale 1/128.
+    public void setChipParams(int width, int height, int channels, boolean swapRB, boolean normalize, float mean, float scale) {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return;
+        }
+        try {
+            nativeSetChipParams(handle, width, height, channels, swapRB, normalize, mean, scale);
+        } finally {
+            release();
+        }
+    }
+
+    // Bytes of the chips of given faces
+    public long getChipBytes(int faces) {
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return 0;
+        }
+        try {
+            return nativeChipBytes(handle, faces);
+        } finally {
+            release();
+        }
+    }
+
+    // Warp all faces of landmarks (packed as { x0, y0, x1, y1, ... } face by face, points per face, e.g. from
+    // getMarks() or FaceResults) into chips, a direct buffer of at least getChipBytes(faces), in one pass, as a
+    // contiguous NxHxWxC tensor in native byte order. Returns the number of chips, -1 on failure
+    public int extractChips(NativeBuffer nativeBuffer, float[] landmarks, int points, ByteBuffer chips) {
+        if (nativeBuffer.getFormat() != PixelFormat.RGBA_8888 || !chips.isDirect()) {
+            return -1;
+        }
+        long handle = acquireDetector();
+        if (handle == 0) {
+            return -1;
+        }
+        try {
+            return nativeExtractChips(handle, nativeBuffer.getByteBuffer(), nativeBuffer.getWidth(),
+                    nativeBuffer.getHeight(), nativeBuffer.getStride(), landmarks, points, chips);
+        } finally {
+            release();
+        }
+    }
+
+    private static int[] packRects(Rect[] rects) {
+        int[] sides = new int[rects.length*4];
+        for (int i = 0; i < rects.length; ++i) {
+            sides[i*4] = rects[i].left;
+            sides[i*4 + 1] = rects[i].top;
+            sides[i*4 + 2] = rects[i].right;
+            sides[i*4 + 3] = rects[i].bottom;
+        }
+        return sides;
     }
 
     // Create native face detector
-    private static native long nativeCreate(String modelDir) ;
+    private static native long nativeCreate(String modelDir, boolean warmUp);
 
     // Destroy native face detector
     private static native void nativeDestroy(long nativeHandle);
@@ -72,10 +531,74 @@ public class FaceDetector {
     // Face detection for RGBA_8888 image
     private static native Rect[] nativeDetect(long nativeHandle, ByteBuffer byteBuffer, int width, int height, int stride);
 
+    // Face detection for NV21 image
+    private static native Rect[] nativeDetectNV21(long nativeHandle, byte[] nv21, int width, int height);
+
     // Face marks for RGBA_8888 image
     private static native PointF[] nativeGetMarks(long nativeHandle, ByteBuffer byteBuffer, int width, int height, int stride, Rect roi);
 
+    // Face marks for the Y plane of a YUV image, faces packed as { left, top, right, bottom, ... }
+    private static native float[] nativeGetMarksY(long nativeHandle, ByteBuffer yPlane, int width, int height, int rowStride, int[] faces);
+    private static native float[] nativeGetMarksNV21(long nativeHandle, byte[] nv21, int width, int height, int[] faces);
+
+    // Aligned face chips for RGBA_8888 image
+    private static native void nativeSetChipParams(long nativeHandle, int width, int height, int channels,
+            boolean swapRB, boolean normalize, float mean, float scale);
+    private static native long nativeChipBytes(long nativeHandle, int faces);
+    private static native int nativeExtractChips(long nativeHandle, ByteBuffer byteBuffer, int width, int height, int stride,
+            float[] landmarks, int points, ByteBuffer chips);
+
+    // Face detection & landmarks for RGBA_8888 image, packed into resultBuffer
+    private static native int nativeAnalyze(long nativeHandle, ByteBuffer byteBuffer, int width, int height, int stride,
+                                            ByteBuffer resultBuffer, boolean landmarks);
+
+    // Landmarks per face of the loaded model
+    private static native int nativeLandmarkCount(long nativeHandle);
+
+    // Native buffer (re)allocations
+    private static native long nativeAllocations(long nativeHandle);
+
+    // Enable/disable multi-scale detection
+    private static native void nativeSetMultiScale(long nativeHandle, boolean enabled, int tileSize, float overlap,
+                                                   float[] scales, boolean globalView,
+                                                   float confidenceThreshold, float nmsThreshold);
+
+    // Inference precision
+    private static native boolean nativeSetPrecision(long nativeHandle, int precision, String calibrationDir);
+
+    // Landmark cascade stages
+    private static native void nativeSetLandmarkStages(long nativeHandle, int stages, int warmStages);
+
+    // Landmark cache
+    private static native void nativeSetLandmarkCache(long nativeHandle, boolean enabled, float threshold);
+    private static native long[] nativeGetLandmarkCacheStats(long nativeHandle);
+
+    // Latency-budget governor
+    private static native void nativeSetGovernor(long nativeHandle, boolean enabled, float budgetMs);
+    private static native float[] nativeGetGovernor(long nativeHandle);
+
+    // Enable/disable detect-then-track mode
+    private static native void nativeSetTracking(long nativeHandle, boolean enabled, int detectInterval,
+            float minConfidence, boolean detectOnLoss, float matchThreshold, int gridSize, float maxError);
+
+    // Pipeline trace
+    private static native void nativeStartTrace(int eventsPerThread);
+    private static native void nativeStopTrace();
+    private static native boolean nativeDumpTrace(String file);
+
+    // Stage metrics
+    private static native long[] nativeGetMetrics(boolean reset);
+    private static native String[] nativeGetMetricNames();
+
     // Process all face related stuff
     private static native void nativeProcess(long nativeHandle, ByteBuffer byteBuffer, int width, int height, int stride);
 
+    // Asynchronous pipeline of all face related stuff
+    private static native long nativeCreatePipeline(long nativeHandle);
+    private static native void nativeDestroyPipeline(long pipelineHandle);
+    private static native long nativeProcessAsync(long pipelineHandle, ByteBuffer byteBuffer, int width, int height, int stride);
+
+    // Draw frame with face overlay
+    private static native void nativeDraw(long nativeHandle, Surface surface, ByteBuffer byteBuffer, int width, int height, int stride);
+
 }
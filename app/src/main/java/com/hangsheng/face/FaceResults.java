@@ -0,0 +1,89 @@
+package com.hangsheng.face;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+// NOTES:
+// Faces of a frame, packed by native code as struct-of-arrays into a direct ByteBuffer (see face_result.h):
+//   header:    [count, landmarks per face (m), total faces, reserved]
+//   ids:       int[count]
+//   boxes:     int[count*4] as left, top, right, bottom
+//   scores:    float[count]
+//   tracking:  float[count]
+//   ages:      int[count]
+//   landmarks: float[count*m*2] as x, y
+// The buffer is reused by every frame, and fields are read in place, so no object is created per face or landmark.
+public class FaceResults {
+    private static final int HEADER_WORDS = 4;
+
+    private final ByteBuffer mByteBuffer;
+
+    // Capacity for maxFaces faces with landmarks points each, see FaceDetector.newResults() which takes
+    // the landmarks of the loaded model
+    public FaceResults(int maxFaces, int landmarks) {
+        int faceWords = 1 + 4 + 1 + 1 + 1 + landmarks*2;
+        mByteBuffer = ByteBuffer.allocateDirect((HEADER_WORDS + maxFaces*faceWords)*4).order(ByteOrder.nativeOrder());
+    }
+
+    ByteBuffer getByteBuffer() {
+        return mByteBuffer;
+    }
+
+    // Number of faces in the buffer
+    public int getCount() {
+        return word(0);
+    }
+    // Landmarks per face, 0 if landmarks aren't fitted
+    public int getLandmarkCount() {
+        return word(1);
+    }
+    // Number of detected faces, more than getCount() if the buffer is too small (faces are dropped in results
+    // order: by score for detections, by track in detect-then-track mode)
+    public int getTotal() {
+        return word(2);
+    }
+
+    public int getId(int face) {
+        return word(HEADER_WORDS + face);
+    }
+    public int getLeft(int face) {
+        return box(face, 0);
+    }
+    public int getTop(int face) {
+        return box(face, 1);
+    }
+    public int getRight(int face) {
+        return box(face, 2);
+    }
+    public int getBottom(int face) {
+        return box(face, 3);
+    }
+    public float getScore(int face) {
+        return mByteBuffer.getFloat((HEADER_WORDS + getCount()*5 + face)*4);
+    }
+    // Tracking confidence, 1 for a just detected face
+    public float getTracking(int face) {
+        return mByteBuffer.getFloat((HEADER_WORDS + getCount()*6 + face)*4);
+    }
+    // Frames since the last detection
+    public int getAge(int face) {
+        return word(HEADER_WORDS + getCount()*7 + face);
+    }
+    public float getLandmarkX(int face, int index) {
+        return landmark(face, index, 0);
+    }
+    public float getLandmarkY(int face, int index) {
+        return landmark(face, index, 1);
+    }
+
+    private int word(int index) {
+        return mByteBuffer.getInt(index*4);
+    }
+    private int box(int face, int side) {
+        return word(HEADER_WORDS + getCount() + face*4 + side);
+    }
+    private float landmark(int face, int index, int axis) {
+        int m = getLandmarkCount();
+        return mByteBuffer.getFloat((HEADER_WORDS + getCount()*8 + (face*m + index)*2 + axis)*4);
+    }
+}
@@ -86,7 +86,7 @@ public class MainActivity extends Activity {
             public void surfaceCreated(SurfaceHolder holder) {
                 mPreviewSurface = holder.getSurface();
                 mFaceDetector = new FaceDetector();
-                mFaceDetector.open();
+                mFaceDetector.openAsync(true, null);
                 mVideoCapture = new VideoCapture(MainActivity.this);
                 mVideoCapture.setCaptureImage(640, 480, PixelFormat.RGBA_8888);
                 mVideoCapture.setCaptureListener(new VideoCapture.CaptureListener() {
@@ -96,16 +96,10 @@ public class MainActivity extends Activity {
                         // Draw surface
                         if (mPreviewSurface != null) {
                             long t1 = System.currentTimeMillis();
-                            NativeBuffer nativeBuffer = NativeBuffer.fromImage(image);
-                            Log.i(TAG, "NativeBuffer.<init>: " + (System.currentTimeMillis() - t1) + "ms");
-
-                            long t2 = System.currentTimeMillis();
-                            nativeBuffer = nativeBuffer.rotate(mVideoCapture.getCaptureRotation());
-                            Log.i(TAG, "NativeBuffer.rotate: " + (System.currentTimeMillis() - t2) + "ms");
-
-                            long t3 = System.currentTimeMillis();
-                            nativeBuffer = nativeBuffer.flip(mVideoCapture.getCaptureFlipping());
-                            Log.i(TAG, "NativeBuffer.flip: " + (System.currentTimeMillis() - t3) + "ms");
+                            // Convert, rotate & flip in one pass
+                            NativeBuffer nativeBuffer = NativeBuffer.fromImage(image,
+                                    mVideoCapture.getCaptureRotation(), mVideoCapture.getCaptureFlipping(), 1);
+                            Log.i(TAG, "NativeBuffer.fromImage: " + (System.currentTimeMillis() - t1) + "ms");
 
                             // Face detection;
                             long t4 = System.currentTimeMillis();
@@ -113,8 +107,9 @@ public class MainActivity extends Activity {
                             Log.i(TAG, "FaceDetector.process: " + (System.currentTimeMillis() - t4) + "ms");
 
                             long t5 = System.currentTimeMillis();
-                            nativeBuffer.draw(mPreviewSurface);
-                            Log.i(TAG, "NativeBuffer.draw: " + (System.currentTimeMillis() - t5) + "ms");
+                            mFaceDetector.draw(nativeBuffer, mPreviewSurface);
+                            Log.i(TAG, "FaceDetector.draw: " + (System.currentTimeMillis() - t5) + "ms");
+                            nativeBuffer.recycle();
                         }
                         Log.i(TAG, "VideoCapture.onCaptured: " + (System.currentTimeMillis() - t0) + "ms");
                     }
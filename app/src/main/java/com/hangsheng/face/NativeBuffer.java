@@ -5,7 +5,12 @@ import android.graphics.PixelFormat;
 import android.media.Image;
 import android.view.Surface;
 
+import java.lang.ref.PhantomReference;
+import java.lang.ref.ReferenceQueue;
 import java.nio.ByteBuffer;
+import java.util.ArrayDeque;
+import java.util.Arrays;
+import java.util.HashSet;
 
 public class NativeBuffer {
     private int mWidth;
@@ -13,6 +18,32 @@ public class NativeBuffer {
     private int mFormat;
     private int mStride;
     private ByteBuffer mByteBuffer;
+    // Whether mByteBuffer is obtained from the pool
+    private boolean mPooled;
+
+    // NOTES:
+    // Direct ByteBuffers backed by pooled native memory. Recycled buffers are cached here (by capacity),
+    // so frames of a steady resolution neither allocate nor leave direct buffers for GC.
+    private static final int MAX_POOLED_BUFFERS = 4;
+    private static final ArrayDeque<ByteBuffer> sBufferPool = new ArrayDeque<>(MAX_POOLED_BUFFERS);
+
+    // NOTES:
+    // The native block of a pooled ByteBuffer is freed once that ByteBuffer is unreachable, whatever happens to
+    // its NativeBuffer: a ByteBuffer returned by getByteBuffer() stays valid as long as it's referenced, even after
+    // its NativeBuffer is dropped. Blocks are tracked by PhantomReferences (Cleaner needs API 33), and freed by
+    // a daemon thread once their ByteBuffer is collected.
+    private static final class BlockReference extends PhantomReference<ByteBuffer> {
+        final long mAddress;
+
+        BlockReference(ByteBuffer byteBuffer, long address) {
+            super(byteBuffer, sReleasedBlocks);
+            mAddress = address;
+        }
+    }
+    private static final ReferenceQueue<ByteBuffer> sReleasedBlocks = new ReferenceQueue<>();
+    // Keeps the references of live blocks reachable until they are enqueued
+    private static final HashSet<BlockReference> sBlocks = new HashSet<>();
+    private static Thread sReleaser;
 
     // NOTES:
     // Currently, only support RGBA/JPEG Image
@@ -26,19 +57,213 @@ public class NativeBuffer {
             return new NativeBuffer(byteBuffer, width, height, format, stride);
         }
         if (format == ImageFormat.JPEG) {
-            ByteBuffer outBuffer = ByteBuffer.allocateDirect(width*height*4);
-            nativeDecode(byteBuffer, byteBuffer.remaining(), outBuffer, width, height, width*4);
-            return new NativeBuffer(outBuffer, width, height, PixelFormat.RGBA_8888, width*4);
+            NativeBuffer outBuffer = obtain(width, height);
+            nativeDecode(byteBuffer, byteBuffer.position(), byteBuffer.remaining(), outBuffer.mByteBuffer, width, height, width*4);
+            return outBuffer;
         }
         return null;
     }
 
+    // NOTES:
+    // Decode JPEG data (direct ByteBuffer) at the smallest DCT-reduced size (1/1, 1/2, 1/4 or 1/8) which still
+    // covers minWidth x minHeight, straight into a pooled buffer. E.g. a 4000x3000 photo for the detector
+    // (300x300) is decoded at 500x375, 64 times fewer pixels. EXIF orientation isn't applied.
+    // The JPEG data is from position() to limit() of jpeg, which isn't modified.
+    // Returns null if data isn't a decodable JPEG (or jpeg isn't direct).
+    public static NativeBuffer decodeJpeg(ByteBuffer jpeg, int minWidth, int minHeight) {
+        int[] size = nativeJpegSize(jpeg, jpeg.position(), jpeg.remaining(), minWidth, minHeight);
+        if (size == null) {
+            return null;
+        }
+        NativeBuffer outBuffer = obtain(size[0], size[1]);
+        if (!nativeDecodeScaled(jpeg, jpeg.position(), jpeg.remaining(), outBuffer.mByteBuffer, size[0], size[1], size[0]*4)) {
+            outBuffer.recycle();
+            return null;
+        }
+        return outBuffer;
+    }
+
+    // Decode many JPEGs like decodeJpeg(), in parallel. An element is null if its data isn't a decodable JPEG
+    public static NativeBuffer[] decodeJpegs(ByteBuffer[] jpegs, int minWidth, int minHeight) {
+        int n = jpegs.length;
+        NativeBuffer[] outBuffers = new NativeBuffer[n];
+        ByteBuffer[] srcBuffers = new ByteBuffer[n];
+        ByteBuffer[] dstBuffers = new ByteBuffer[n];
+        int[] srcOffsets = new int[n];
+        int[] srcSizes = new int[n];
+        int[] widths = new int[n];
+        int[] heights = new int[n];
+        int count = 0;
+        int[] indices = new int[n];
+        for (int i = 0; i < n; ++i) {
+            int[] size = nativeJpegSize(jpegs[i], jpegs[i].position(), jpegs[i].remaining(), minWidth, minHeight);
+            if (size == null) {
+                continue;
+            }
+            outBuffers[i] = obtain(size[0], size[1]);
+            srcBuffers[count] = jpegs[i];
+            srcOffsets[count] = jpegs[i].position();
+            srcSizes[count] = jpegs[i].remaining();
+            dstBuffers[count] = outBuffers[i].mByteBuffer;
+            widths[count] = size[0];
+            heights[count] = size[1];
+            indices[count++] = i;
+        }
+        if (count < n) {
+            srcBuffers = Arrays.copyOf(srcBuffers, count);
+            dstBuffers = Arrays.copyOf(dstBuffers, count);
+            srcOffsets = Arrays.copyOf(srcOffsets, count);
+            srcSizes = Arrays.copyOf(srcSizes, count);
+            widths = Arrays.copyOf(widths, count);
+            heights = Arrays.copyOf(heights, count);
+        }
+        boolean[] decoded = nativeDecodeBatch(srcBuffers, srcOffsets, srcSizes, dstBuffers, widths, heights);
+        for (int i = 0; i < count; ++i) {
+            if (!decoded[i]) {
+                outBuffers[indices[i]].recycle();
+                outBuffers[indices[i]] = null;
+            }
+        }
+        return outBuffers;
+    }
+
     // NOTES:
     // Currently, only support RGBA/JPEG Image
     public static NativeBuffer fromNV21(byte[] nv21, int width, int height) {
-            ByteBuffer rgbaBuffer = ByteBuffer.allocateDirect(width*height*4);
-            nativeNV21ToRGBA(nv21, rgbaBuffer, width, height, width*4);
-            return new NativeBuffer(rgbaBuffer, width, height, PixelFormat.RGBA_8888, width*4);
+            NativeBuffer rgbaBuffer = obtain(width, height);
+            nativeNV21ToRGBA(nv21, rgbaBuffer.mByteBuffer, width, height, width*4);
+            return rgbaBuffer;
+    }
+
+    // NOTES:
+    // Convert, rotate (same as rotate()), flip (same as flip()) and downscale by an integer factor (block mean) in one native pass.
+    // Supports RGBA/YUV_420_888/JPEG Image, the returned buffer is obtained from the pool.
+    public static NativeBuffer fromImage(Image image, int rotateCode, int flipCode, int scale) {
+        int width = image.getWidth();
+        int height = image.getHeight();
+        int format = image.getFormat();
+        Image.Plane[] planes = image.getPlanes();
+        if (format == ImageFormat.YUV_420_888) {
+            NativeBuffer outBuffer = obtainTransformed(width, height, rotateCode, scale);
+            nativeTransformYUV(planes[0].getBuffer(), planes[1].getBuffer(), planes[2].getBuffer(),
+                    planes[0].getRowStride(), planes[1].getRowStride(), planes[1].getPixelStride(), width, height,
+                    outBuffer.mByteBuffer, outBuffer.mStride, rotateCode, flipCode, scale);
+            return outBuffer;
+        }
+        NativeBuffer nativeBuffer = fromImage(image);
+        if (nativeBuffer == null) {
+            return null;
+        }
+        NativeBuffer outBuffer = nativeBuffer.transform(rotateCode, flipCode, scale);
+        if (outBuffer != nativeBuffer) {
+            nativeBuffer.recycle();
+        }
+        return outBuffer;
+    }
+
+    public static NativeBuffer fromNV21(byte[] nv21, int width, int height, int rotateCode, int flipCode, int scale) {
+        NativeBuffer outBuffer = obtainTransformed(width, height, rotateCode, scale);
+        nativeTransformNV21(nv21, width, height, outBuffer.mByteBuffer, outBuffer.mStride, rotateCode, flipCode, scale);
+        return outBuffer;
+    }
+
+    // Rotate, flip & downscale RGBA buffer in one pass, returns this if nothing is to be done
+    public NativeBuffer transform(int rotateCode, int flipCode, int scale) {
+        if (rotateCode == 0 && flipCode == 0 && scale <= 1) {
+            return this;
+        }
+        NativeBuffer outBuffer = obtainTransformed(mWidth, mHeight, rotateCode, scale);
+        nativeTransformRGBA(mByteBuffer, mWidth, mHeight, mStride, outBuffer.mByteBuffer, outBuffer.mStride,
+                rotateCode, flipCode, scale);
+        return outBuffer;
+    }
+
+    private static NativeBuffer obtainTransformed(int width, int height, int rotateCode, int scale) {
+        scale = Math.max(scale, 1);
+        if (rotateCode == 90 || rotateCode == 270) {
+            return obtain(height/scale, width/scale);
+        }
+        return obtain(width/scale, height/scale);
+    }
+
+    // NOTES:
+    // Get a RGBA_8888 buffer from the pool, give it back by recycle() once it's not used anymore
+    // (a dropped buffer is only freed once its ByteBuffer is garbage collected, see BlockReference)
+    public static NativeBuffer obtain(int width, int height) {
+        int capacity = width*height*4;
+        ByteBuffer byteBuffer = null;
+        synchronized (sBufferPool) {
+            for (int i = sBufferPool.size(); i > 0 && byteBuffer == null; --i) {
+                ByteBuffer buffer = sBufferPool.pollFirst();
+                if (buffer.capacity() == capacity) {
+                    byteBuffer = buffer;
+                } else {
+                    sBufferPool.addLast(buffer);
+                }
+            }
+        }
+        if (byteBuffer == null) {
+            byteBuffer = allocate(capacity);
+        }
+        byteBuffer.clear();
+        NativeBuffer nativeBuffer = new NativeBuffer(byteBuffer, width, height, PixelFormat.RGBA_8888, width*4);
+        nativeBuffer.mPooled = true;
+        return nativeBuffer;
+    }
+
+    // Give the buffer back to the pool, nothing is done if it isn't obtained from the pool.
+    // Its ByteBuffer must not be used anymore, it's handed out again by obtain()
+    public void recycle() {
+        if (!mPooled) {
+            return;
+        }
+        mPooled = false;
+        ByteBuffer byteBuffer = mByteBuffer;
+        mByteBuffer = null;
+        synchronized (sBufferPool) {
+            if (sBufferPool.size() < MAX_POOLED_BUFFERS) {
+                sBufferPool.addLast(byteBuffer);
+            }
+        }
+        // Otherwise the block is freed once byteBuffer is collected
+    }
+
+    private static ByteBuffer allocate(int capacity) {
+        ByteBuffer byteBuffer = nativeObtain(capacity);
+        synchronized (sBlocks) {
+            sBlocks.add(new BlockReference(byteBuffer, nativeAddress(byteBuffer)));
+            if (sReleaser == null) {
+                sReleaser = new Thread(new Runnable() {
+                    @Override
+                    public void run() {
+                        releaseBlocks();
+                    }
+                }, "NativeBufferReleaser");
+                sReleaser.setDaemon(true);
+                sReleaser.start();
+            }
+        }
+        return byteBuffer;
+    }
+
+    private static void releaseBlocks() {
+        while (true) {
+            BlockReference block;
+            try {
+                block = (BlockReference) sReleasedBlocks.remove();
+            } catch (InterruptedException e) {
+                continue;
+            }
+            synchronized (sBlocks) {
+                sBlocks.remove(block);
+            }
+            nativeRecycle(block.mAddress);
+        }
+    }
+
+    // Native memory blocks allocated by the pool, it stops increasing once warmed up
+    public static long getAllocations() {
+        return nativeAllocations();
     }
 
 
@@ -90,13 +315,14 @@ public class NativeBuffer {
             // NEED NO rotating
             return  this;
         }
-        ByteBuffer outBuffer = ByteBuffer.allocateDirect(mWidth*mHeight*4);
         if (rotateCode == 90 || rotateCode == 270) {
-            nativeRotate(mByteBuffer, mWidth, mHeight, mStride, outBuffer, mHeight*4, rotateCode);
-            return new NativeBuffer(outBuffer, mHeight, mWidth, mFormat, mHeight*4);
+            NativeBuffer outBuffer = obtain(mHeight, mWidth);
+            nativeRotate(mByteBuffer, mWidth, mHeight, mStride, outBuffer.mByteBuffer, mHeight*4, rotateCode);
+            return outBuffer;
         } else {
-            nativeRotate(mByteBuffer, mWidth, mHeight, mStride, outBuffer, mWidth*4, rotateCode);
-            return  new NativeBuffer(outBuffer, mWidth, mHeight, mFormat, mWidth*4);
+            NativeBuffer outBuffer = obtain(mWidth, mHeight);
+            nativeRotate(mByteBuffer, mWidth, mHeight, mStride, outBuffer.mByteBuffer, mWidth*4, rotateCode);
+            return outBuffer;
         }
     }
 
@@ -106,6 +332,27 @@ public class NativeBuffer {
     private static native void nativeRotate(ByteBuffer srcBuffer, int srcWidth, int srcHeight, int srcStride,
                                           ByteBuffer dstBuffer, int dstStride, int rotateCode);
 
-    private static native void nativeDecode(ByteBuffer srcBuffer, int srcSize, ByteBuffer dstBuffer, int dstWidth, int dstHeight, int dstStride);
+    // JPEG data of srcBuffer starts at srcOffset (its position())
+    private static native void nativeDecode(ByteBuffer srcBuffer, int srcOffset, int srcSize, ByteBuffer dstBuffer, int dstWidth, int dstHeight, int dstStride);
+    // Reduced-resolution JPEG decode
+    private static native int[] nativeJpegSize(ByteBuffer srcBuffer, int srcOffset, int srcSize, int minWidth, int minHeight);
+    private static native boolean nativeDecodeScaled(ByteBuffer srcBuffer, int srcOffset, int srcSize, ByteBuffer dstBuffer, int dstWidth, int dstHeight, int dstStride);
+    private static native boolean[] nativeDecodeBatch(ByteBuffer[] srcBuffers, int[] srcOffsets, int[] srcSizes, ByteBuffer[] dstBuffers,
+                                                      int[] dstWidths, int[] dstHeights);
     private static native void nativeNV21ToRGBA(byte[] srcBuffer, ByteBuffer dstBuffer, int dstWidth, int dstHeight, int dstStride);
+
+    // Fused convert + rotate + flip + downscale
+    private static native void nativeTransformYUV(ByteBuffer yBuffer, ByteBuffer uBuffer, ByteBuffer vBuffer,
+                                                  int yStride, int uvStride, int uvPixelStride, int width, int height,
+                                                  ByteBuffer dstBuffer, int dstStride, int rotateCode, int flipCode, int scale);
+    private static native void nativeTransformNV21(byte[] srcBuffer, int width, int height,
+                                                   ByteBuffer dstBuffer, int dstStride, int rotateCode, int flipCode, int scale);
+    private static native void nativeTransformRGBA(ByteBuffer srcBuffer, int srcWidth, int srcHeight, int srcStride,
+                                                   ByteBuffer dstBuffer, int dstStride, int rotateCode, int flipCode, int scale);
+
+    // Pooled native memory
+    private static native ByteBuffer nativeObtain(int capacity);
+    private static native long nativeAddress(ByteBuffer byteBuffer);
+    private static native void nativeRecycle(long address);
+    private static native long nativeAllocations();
 }